@@ -0,0 +1,283 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* end-to-end benchmark, see `make bench`
+ *
+ * Resolves names against the servers given, normally run by fakedns,
+ * first with dnsq() against each server on its own, and all of them
+ * together, then through the nss entry points, using a config that
+ * puts all servers in a single pool.  The module is built to read its
+ * config from bench.conf, which is written here, with its cache
+ * disabled, such that every lookup goes out on the wire. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <nss.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dnspq.h"
+#include "nss-dnspq.h"
+
+typedef struct {
+	int (*lookup)(size_t i);
+	size_t base;  /* of the names to look up */
+	size_t count;
+	double *lat;  /* usec, per lookup */
+	size_t fails;
+} benchthread;
+
+static dnspq_server *servers[MAXSERVERS + 1];
+static dnspq_server **dnsservers;  /* those used by lookup_dnsq */
+static dnspq_opts opts;
+
+static inline double
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/* the lookups, each asking for another name */
+static int
+lookup_dnsq(size_t i)
+{
+	char name[64];
+	dnspq_answer ans;
+	char sid;
+
+	snprintf(name, sizeof(name), "h%zu.bench", i);
+	return dnsq(dnsservers, &opts, name, AF_INET, &ans, &sid) == NOERR;
+}
+
+static int
+lookup_byname3(size_t i)
+{
+	char name[64];
+	char buf[1024];
+	struct hostent h;
+	int e;
+	int he;
+
+	snprintf(name, sizeof(name), "h%zu.bench", i);
+	return _nss_dnspq_gethostbyname3_r(name, AF_INET, &h, buf, sizeof(buf),
+			&e, &he, NULL, NULL) == NSS_STATUS_SUCCESS;
+}
+
+static int
+lookup_byname4(size_t i)
+{
+	char name[64];
+	char buf[1024];
+	struct gaih_addrtuple *pat = NULL;
+	int e;
+	int he;
+
+	snprintf(name, sizeof(name), "h%zu.bench", i);
+	return _nss_dnspq_gethostbyname4_r(name, &pat, buf, sizeof(buf),
+			&e, &he, NULL) == NSS_STATUS_SUCCESS;
+}
+
+static int
+lookup_byaddr2(size_t i)
+{
+	char buf[1024];
+	struct hostent h;
+	struct in_addr a;
+	int e;
+	int he;
+
+	a.s_addr = htonl(0x0a000000 | (uint32_t)(i & 0xffffff));
+	return _nss_dnspq_gethostbyaddr2_r(&a, sizeof(a), AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL) == NSS_STATUS_SUCCESS;
+}
+
+static void *
+bench_thread(void *arg)
+{
+	benchthread *bt = (benchthread *)arg;
+	double start;
+	size_t i;
+
+	for (i = 0; i < bt->count; i++) {
+		start = now_usec();
+		if (!bt->lookup(bt->base + i))
+			bt->fails++;
+		bt->lat[i] = now_usec() - start;
+	}
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* runs count lookups from each of threads threads, and reports */
+static void
+bench(const char *label, int (*lookup)(size_t), size_t count, int threads)
+{
+	pthread_t tids[threads];
+	benchthread bts[threads];
+	double *lat;
+	double start;
+	double secs;
+	size_t fails = 0;
+	size_t n = count * threads;
+	int i;
+
+	if ((lat = malloc(sizeof(*lat) * n)) == NULL)
+		return;
+	lookup(0);  /* warm up, e.g. read the config */
+	start = now_usec();
+	for (i = 0; i < threads; i++) {
+		bts[i].lookup = lookup;
+		bts[i].base = i * count;
+		bts[i].count = count;
+		bts[i].lat = lat + i * count;
+		bts[i].fails = 0;
+		pthread_create(&tids[i], NULL, bench_thread, &bts[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		fails += bts[i].fails;
+	}
+	secs = (now_usec() - start) / 1000000.0;
+
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	printf("%-24s %3d %9.0f %9.1f %9.1f %9.1f %9.1f %7zu\n",
+			label, threads, n / secs,
+			lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1],
+			fails);
+	fflush(stdout);
+	free(lat);
+}
+
+static void
+usage(void)
+{
+	printf("usage: dnspqbench [-n count] [-t threads] [-H] [-A] "
+			"server[:port] ...\n");
+	printf("  -n <count>    lookups per thread (10000)\n");
+	printf("  -t <threads>  threads to run the lookups from at once, next\n");
+	printf("                to a single thread (4)\n");
+	printf("  -H            hedged mode\n");
+	printf("  -A            adaptive retry timeouts\n");
+}
+
+int main(int argc, char *argv[]) {
+	dnspq_server *single[2] = { NULL, NULL };
+	char label[64];
+	char ip[INET6_ADDRSTRLEN];
+	size_t count = 10000;
+	int threads = 4;
+	int nservers = 0;
+	int t;
+	int i;
+	FILE *f;
+
+	while ((i = getopt(argc, argv, "n:t:HAh")) != -1) {
+		switch (i) {
+			case 'n':
+				count = (size_t)atol(optarg);
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'H':
+				opts.hedge = 1;
+				break;
+			case 'A':
+				opts.adaptive = 1;
+				break;
+			default:
+				usage();
+				return i == 'h' ? 0 : 1;
+		}
+	}
+	if (count == 0 || threads <= 0 || optind == argc) {
+		usage();
+		return 1;
+	}
+
+	if ((f = fopen("bench.conf", "w")) == NULL) {
+		perror("bench.conf");
+		return 1;
+	}
+	fprintf(f, "options cache:0%s%s\n",
+			opts.hedge ? " hedge" : "", opts.adaptive ? " adaptive" : "");
+	for (i = 0; i < 2; i++) {
+		fprintf(f, "%s", i == 0 ? ".bench" : ".in-addr.arpa");
+		for (t = optind; t < argc; t++)
+			fprintf(f, " %s", argv[t]);
+		fprintf(f, "\n");
+	}
+	fclose(f);
+
+	for (i = optind; i < argc && nservers < MAXSERVERS; i++) {
+		if ((servers[nservers] = malloc(sizeof(dnspq_server))) == NULL ||
+				dnspq_server_parse(servers[nservers], argv[i]) != 0)
+		{
+			fprintf(stderr, "failed to parse server '%s'\n", argv[i]);
+			return 1;
+		}
+		nservers++;
+	}
+
+	printf("%-24s %3s %9s %9s %9s %9s %9s %7s\n", "lookup", "thr",
+			"qps", "p50 us", "p99 us", "p999 us", "max us", "failed");
+	for (i = 0; i < nservers; i++) {
+		single[0] = servers[i];
+		dnsservers = single;
+		if (servers[i]->addr.sa.sa_family == AF_INET6) {
+			inet_ntop(AF_INET6, &servers[i]->addr.sin6.sin6_addr,
+					ip, sizeof(ip));
+		} else {
+			inet_ntop(AF_INET, &servers[i]->addr.sin.sin_addr,
+					ip, sizeof(ip));
+		}
+		snprintf(label, sizeof(label), "dnsq %s:%d", ip,
+				ntohs(servers[i]->addr.sin.sin_port));
+		bench(label, lookup_dnsq, count, 1);
+		bench(label, lookup_dnsq, count, threads);
+	}
+	dnsservers = servers;
+	bench("dnsq all", lookup_dnsq, count, 1);
+	bench("dnsq all", lookup_dnsq, count, threads);
+	bench("gethostbyname3_r", lookup_byname3, count, 1);
+	bench("gethostbyname3_r", lookup_byname3, count, threads);
+	bench("gethostbyname4_r", lookup_byname4, count, 1);
+	bench("gethostbyname4_r", lookup_byname4, count, threads);
+	bench("gethostbyaddr2_r", lookup_byaddr2, count, 1);
+	bench("gethostbyaddr2_r", lookup_byaddr2, count, threads);
+
+	unlink("bench.conf");
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* in-process answer cache
+ *
+ * The cache is split in a number of shards, each guarded by its own
+ * lock, such that threads looking up different names hardly ever
+ * contend.  Within a shard, entries are found through an index of
+ * their hashes, an open addressing table with linear probing that is
+ * kept at most half full, and evicted using the CLOCK (second chance)
+ * algorithm, which only picks the victim.  Time is taken from the
+ * coarse monotonic clock, which is served from the vDSO, hence a cache
+ * hit doesn't cost any syscall.
+ * Next to answers, the cache holds failed lookups (negative entries),
+ * which carry the dnspq_errno of the failure instead of an address.
+ * Answers can be kept for a while after they expired, to fall back on
+ * when the servers fail, see dnspq_cache_stale(). */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "cache.h"
+
+#ifndef CACHE_SHARDS
+# define CACHE_SHARDS  16
+#endif
+#define CACHE_NAMELEN  256
+
+typedef struct {
+	char name[CACHE_NAMELEN];
+	dnspq_answer ans;  /* ttl unused, see expires */
+	time_t expires;
+	time_t retry;  /* refreshing the expired answer failed, it's served
+	                  as is until then */
+	unsigned char ref;
+	char err;  /* 0 for answers, dnspq_errno for negative entries */
+} cacheentry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	size_t hand;
+	uint32_t *hashes;  /* 0 means unused slot */
+	uint32_t *index;  /* entry + 1 by hash, 0 means empty bucket */
+	cacheentry *entries;
+} __attribute__((aligned(64))) cacheshard;
+
+static cacheshard shards[CACHE_SHARDS];
+static size_t shardsize = 0;
+static size_t indexmask = 0;  /* buckets in an index - 1 */
+static time_t stalekeep = 0;  /* seconds answers are kept after expiry */
+
+static inline time_t
+cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/* FNV-1a over the family and name, 0 is reserved for unused slots */
+static inline uint32_t
+cache_hash(const char *name, int af)
+{
+	uint32_t h = (2166136261U ^ (unsigned char)af) * 16777619U;
+
+	for (; *name != '\0'; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	return h == 0 ? 1 : h;
+}
+
+/* the bucket of hash h, the low bits already picked the shard */
+static inline size_t
+cache_bucket(uint32_t h)
+{
+	return (h / CACHE_SHARDS) & indexmask;
+}
+
+/* returns the entry for name, or -1 when s doesn't have it */
+static inline ssize_t
+cache_find(cacheshard *s, uint32_t h, const char *name, int af)
+{
+	size_t b;
+	uint32_t i;
+
+	if (s->index == NULL)
+		return -1;
+	for (b = cache_bucket(h); (i = s->index[b]) != 0;
+			b = (b + 1) & indexmask)
+	{
+		i--;
+		if (s->hashes[i] == h && s->entries[i].ans.af == af &&
+				strcmp(s->entries[i].name, name) == 0)
+			return (ssize_t)i;
+	}
+	return -1;
+}
+
+/* drops entry i from the index, moving back the entries that probed
+ * past its bucket, such that lookups don't stop short of them */
+static void
+cache_unindex(cacheshard *s, size_t i)
+{
+	size_t b;
+	size_t j;
+	size_t home;
+
+	for (b = cache_bucket(s->hashes[i]); s->index[b] != i + 1;
+			b = (b + 1) & indexmask)
+		;
+	for (j = (b + 1) & indexmask; s->index[j] != 0; j = (j + 1) & indexmask) {
+		home = cache_bucket(s->hashes[s->index[j] - 1]);
+		/* it can fill the hole unless its bucket lies in (b, j] */
+		if (b < j ? (home <= b || home > j) : (home <= b && home > j)) {
+			s->index[b] = s->index[j];
+			b = j;
+		}
+	}
+	s->index[b] = 0;
+}
+
+static void
+cache_atfork_child(void)
+{
+	int i;
+
+	/* a lock held by another thread during fork would never be
+	 * released in the child */
+	for (i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+/* sets up the cache to hold (about) entries answers, 0 disables the
+ * cache, memory is only allocated upon first use, answers remain
+ * available to dnspq_cache_stale() for stale seconds after expiry */
+void
+dnspq_cache_init(size_t entries, unsigned int stale)
+{
+	int i;
+
+	stalekeep = stale;
+
+	shardsize = (entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	if (shardsize == 0)
+		return;
+	for (indexmask = 1; indexmask < 2 * shardsize; indexmask <<= 1)
+		;
+	indexmask--;
+	for (i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+	pthread_atfork(NULL, NULL, cache_atfork_child);
+}
+
+int
+dnspq_cache_get(
+		const char *name,
+		int af,
+		dnspq_answer *ret,
+		char *err)
+{
+	uint32_t h;
+	cacheshard *s;
+	cacheentry *e;
+	time_t now;
+	ssize_t i;
+	int found = 0;
+
+	if (shardsize == 0)
+		return 0;
+
+	h = cache_hash(name, af);
+	s = &shards[h % CACHE_SHARDS];
+	now = cache_now();
+
+	pthread_mutex_lock(&s->lock);
+	if ((i = cache_find(s, h, name, af)) != -1) {
+		e = &s->entries[i];
+		if (e->expires > now || e->retry > now) {
+			ret->af = af;
+			if ((*err = e->err) == 0) {
+				ret->naddrs = e->ans.naddrs;
+				memcpy(&ret->addrs, &e->ans.addrs,
+						DNSPQ_ADDRS_LEN(&e->ans));
+			}
+			ret->ttl = (unsigned int)((e->expires > now ?
+						e->expires : e->retry) - now);
+			e->ref = 1;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return found;
+}
+
+/* like dnspq_cache_get(), but returns the answer for name even when it
+ * expired, as long as that's no longer than the stale window ago, ttl
+ * is left to the caller, failures aren't returned */
+int
+dnspq_cache_stale(
+		const char *name,
+		int af,
+		dnspq_answer *ret)
+{
+	uint32_t h;
+	cacheshard *s;
+	cacheentry *e;
+	ssize_t i;
+	int found = 0;
+
+	if (shardsize == 0 || stalekeep == 0)
+		return 0;
+
+	h = cache_hash(name, af);
+	s = &shards[h % CACHE_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	if ((i = cache_find(s, h, name, af)) != -1) {
+		e = &s->entries[i];
+		if (e->err == 0 && e->expires + stalekeep > cache_now()) {
+			ret->af = af;
+			ret->naddrs = e->ans.naddrs;
+			memcpy(&ret->addrs, &e->ans.addrs, DNSPQ_ADDRS_LEN(&e->ans));
+			ret->ttl = 0;
+			e->ref = 1;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return found;
+}
+
+/* remembers that refreshing the expired answer for name failed, such
+ * that dnspq_cache_get() returns it for the next secs seconds, instead
+ * of having every lookup wait for the servers to fail again, but never
+ * past the stale window */
+void
+dnspq_cache_retry(
+		const char *name,
+		int af,
+		unsigned int secs)
+{
+	uint32_t h;
+	cacheshard *s;
+	cacheentry *e;
+	time_t now;
+	ssize_t i;
+
+	if (shardsize == 0 || stalekeep == 0 || secs == 0)
+		return;
+
+	h = cache_hash(name, af);
+	s = &shards[h % CACHE_SHARDS];
+	now = cache_now();
+
+	pthread_mutex_lock(&s->lock);
+	if ((i = cache_find(s, h, name, af)) != -1) {
+		e = &s->entries[i];
+		if (e->err == 0 && e->expires <= now &&
+				e->expires + stalekeep > now)
+		{
+			e->retry = now + secs;
+			if (e->retry > e->expires + stalekeep)
+				e->retry = e->expires + stalekeep;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+dnspq_cache_put(
+		const char *name,
+		const dnspq_answer *ans,
+		char err)
+{
+	uint32_t h;
+	cacheshard *s;
+	cacheentry *e;
+	time_t now;
+	ssize_t i;
+	size_t b;
+	size_t nlen;
+
+	if (shardsize == 0 || ans->ttl == 0 ||
+			(nlen = strlen(name)) >= CACHE_NAMELEN)
+		return;
+
+	h = cache_hash(name, ans->af);
+	s = &shards[h % CACHE_SHARDS];
+	now = cache_now();
+
+	pthread_mutex_lock(&s->lock);
+	if (s->hashes == NULL) {
+		s->hashes = calloc(shardsize, sizeof(*s->hashes));
+		s->index = calloc(indexmask + 1, sizeof(*s->index));
+		s->entries = malloc(shardsize * sizeof(*s->entries));
+		if (s->hashes == NULL || s->index == NULL || s->entries == NULL) {
+			free(s->hashes);
+			free(s->index);
+			free(s->entries);
+			s->hashes = NULL;
+			s->index = NULL;
+			s->entries = NULL;
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+	}
+
+	/* update in place if we know this name already */
+	if ((i = cache_find(s, h, name, ans->af)) == -1) {
+		/* find a victim: unused, expired (and past the stale window
+		 * for answers), or not recently used */
+		for (;;) {
+			i = (ssize_t)s->hand;
+			s->hand = (s->hand + 1) % shardsize;
+			e = &s->entries[i];
+			if (s->hashes[i] == 0 || e->ref == 0 ||
+					e->expires + (e->err == 0 ? stalekeep : 0) <= now)
+				break;
+			e->ref = 0;
+		}
+		if (s->hashes[i] != 0)
+			cache_unindex(s, (size_t)i);
+		s->hashes[i] = h;
+		memcpy(s->entries[i].name, name, nlen + 1);
+		for (b = cache_bucket(h); s->index[b] != 0; b = (b + 1) & indexmask)
+			;
+		s->index[b] = (uint32_t)i + 1;
+	}
+	e = &s->entries[i];
+	e->ans.af = ans->af;
+	if ((e->err = err) == 0) {
+		e->ans.naddrs = ans->naddrs;
+		memcpy(&e->ans.addrs, &ans->addrs, DNSPQ_ADDRS_LEN(ans));
+	}
+	e->expires = now + ans->ttl;
+	e->retry = 0;
+	e->ref = 0;
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,36 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+void dnspq_cache_init(size_t entries, unsigned int stale);
+int dnspq_cache_get(
+		const char *name,
+		int af,
+		dnspq_answer *ret,
+		char *err);
+int dnspq_cache_stale(
+		const char *name,
+		int af,
+		dnspq_answer *ret);
+void dnspq_cache_retry(
+		const char *name,
+		int af,
+		unsigned int secs);
+void dnspq_cache_put(
+		const char *name,
+		const dnspq_answer *ans,
+		char err);
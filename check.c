@@ -0,0 +1,1039 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* behaviour checks, see `make check`
+ *
+ * Runs lookups against the servers of fakedns, each port misbehaving
+ * in its own way, and checks the outcome, along with the number of
+ * queries it took, as counted in the per-server statistics.  The
+ * module is built to read its config from check.conf, which is written
+ * here.  Its cache is on, so each check looks up names of its own. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <nss.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "nss-dnspq.h"
+#include "stats.h"
+#include "config.h"
+#include "daemon.h"
+#include "shmcache.h"
+
+#define CHECK_CONF   "check.conf"
+#define CHECK_STATS  "check.stats"
+#define CHECK_SHM    "check.shm"
+
+#define CHECK_HEDGED  16  /* lookups in hedged mode that are counted */
+#define CHECK_FLIGHT   8  /* threads looking up the same name at once */
+
+/* the ports given, in this order */
+enum {
+	PORT_NODATA,
+	PORT_EDNS,
+	PORT_NOEDNS,
+	PORT_CNAME,
+	PORT_SHORTTTL,
+	PORT_DEAD,
+	PORT_PLAIN,
+	PORT_NXDOMAIN,
+	PORT_SLOW,
+	PORT_TRUNCATE,
+	NPORTS
+};
+static char **ports;
+
+/* from dnspq.c, built with DNSPQ_CHECK */
+int dnsq_parse_check(const char *name, int af,
+		unsigned char *pkt, int len, dnspq_answer *ans);
+
+static int failures = 0;
+
+static void
+check(int ok, const char *what)
+{
+	printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failures++;
+}
+
+/* the counters kept for the server at 127.0.0.1:port */
+static dnspq_stats *
+server_stats(const char *port)
+{
+	dnspq_server srv;
+	char addr[32];
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%s", port);
+	if (dnspq_server_parse(&srv, addr) != 0)
+		return NULL;
+	return dnspq_stats_server(&srv.addr);
+}
+
+/* a name that exists, but without the records asked for, is a single
+ * query, and not found */
+static void
+check_nodata(const char *port)
+{
+	dnspq_stats *s = server_stats(port);
+	struct hostent h;
+	struct gaih_addrtuple *pat = NULL;
+	char buf[1024];
+	uint64_t sent;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	if (s == NULL) {
+		check(0, "nodata: statistics");
+		return;
+	}
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.nodata", AF_INET6, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_NOTFOUND && he == NO_DATA,
+			"nodata: gethostbyname3_r is NOTFOUND, NO_DATA");
+	check(s->sent - sent == 1, "nodata: gethostbyname3_r sends 1 query");
+
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname4_r("h4.nodata", &pat,
+			buf, sizeof(buf), &e, &he, NULL);
+	check(ret == NSS_STATUS_NOTFOUND && he == NO_DATA,
+			"nodata: gethostbyname4_r is NOTFOUND, NO_DATA");
+	check(s->sent - sent == 2, "nodata: gethostbyname4_r sends 2 queries");
+}
+
+/* a name too long to be shared with other lookups is resolved on its
+ * own, it is too long to be asked for too */
+static void
+check_longname(const char *port)
+{
+	dnspq_stats *s = server_stats(port);
+	struct hostent h;
+	struct gaih_addrtuple *pat = NULL;
+	char name[320];
+	char buf[1024];
+	uint64_t sent;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	if (s == NULL) {
+		check(0, "longname: statistics");
+		return;
+	}
+	memset(name, 'a', 300);
+	strcpy(name + 300, ".nodata");
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname3_r(name, AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret != NSS_STATUS_SUCCESS,
+			"longname: gethostbyname3_r fails");
+	ret = _nss_dnspq_gethostbyname4_r(name, &pat,
+			buf, sizeof(buf), &e, &he, NULL);
+	check(ret != NSS_STATUS_SUCCESS,
+			"longname: gethostbyname4_r fails");
+	check(s->sent == sent, "longname: sends no queries");
+}
+
+/* parses the len bytes of pkt as the answer to h.check, from a buffer
+ * of exactly that size, such that reading past it is caught when built
+ * with -fsanitize=address */
+static int
+parse(const unsigned char *pkt, int len, int af, dnspq_answer *ans)
+{
+	unsigned char *copy = malloc(len > 0 ? (size_t)len : 1);
+	int err;
+
+	memcpy(copy, pkt, (size_t)len);
+	err = dnsq_parse_check(af == AF_UNSPEC ? "1.0.0.127.in-addr.arpa" :
+			"h.check", af, copy, len, ans);
+	free(copy);
+	return err;
+}
+
+/* the header and question of an answer to h.check with ancount records,
+ * returns where the records go */
+static unsigned char *
+parse_reply(unsigned char *pkt, int af, int ancount)
+{
+	static const unsigned char ptrname[] =
+		"\0011\0010\0010\003127\007in-addr\004arpa";
+	uint16_t qtype = af == AF_INET6 ? 28 : af == AF_UNSPEC ? 12 : 1;
+	unsigned char *w = pkt + 12;
+
+	memset(pkt, 0, 12);
+	pkt[2] = 0x80;  /* QR */
+	pkt[5] = 1;
+	pkt[6] = (unsigned char)(ancount >> 8);
+	pkt[7] = (unsigned char)ancount;
+	if (af == AF_UNSPEC) {
+		memcpy(w, ptrname, sizeof(ptrname));
+		w += sizeof(ptrname);
+	} else {
+		memcpy(w, "\001h\005check", 9);
+		w += 9;
+	}
+	*w++ = 0;
+	*w++ = (unsigned char)qtype;
+	*w++ = 0;
+	*w++ = 1;
+	return w;
+}
+
+/* a record, owned by the name at offset owner, rdlen is what's claimed,
+ * n what's there */
+static unsigned char *
+parse_rr(unsigned char *w, int owner, uint16_t type,
+		uint16_t rdlen, const void *rdata, size_t n)
+{
+	*w++ = (unsigned char)(0xc0 | owner >> 8);
+	*w++ = (unsigned char)owner;
+	*w++ = (unsigned char)(type >> 8);
+	*w++ = (unsigned char)type;
+	*w++ = 0;
+	*w++ = 1;
+	memset(w, 0, 3);
+	w[3] = 60;
+	w += 4;
+	*w++ = (unsigned char)(rdlen >> 8);
+	*w++ = (unsigned char)rdlen;
+	memcpy(w, rdata, n);
+	return w + n;
+}
+
+/* malformed answers are rejected, without reading outside of them */
+static void
+check_parse(void)
+{
+	static const unsigned char addr[4] = { 10, 0, 0, 1 };
+	unsigned char pkt[2048];
+	unsigned char mangled[2048];
+	unsigned char rdata[8];
+	unsigned char *w;
+	dnspq_answer ans;
+	uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+	int len;
+	int owner;
+	int ok;
+	int err;
+	int i;
+	int j;
+
+	/* an alias, and two addresses, which is fine */
+	w = parse_reply(pkt, AF_INET, 3);
+	rdata[0] = 1;
+	rdata[1] = 'a';
+	rdata[2] = 0xc0;
+	rdata[3] = 14;  /* a.check */
+	owner = (int)(w - pkt) + 12;
+	w = parse_rr(w, 12, 5, 4, rdata, 4);
+	w = parse_rr(w, owner, 1, 4, addr, 4);
+	w = parse_rr(w, owner, 1, 4, addr, 4);
+	len = (int)(w - pkt);
+	check(parse(pkt, len, AF_INET, &ans) == NOERR && ans.naddrs == 2,
+			"parse: alias with addresses");
+
+	for (i = 0, ok = 1; i < len; i++)
+		if (parse(pkt, i, AF_INET, &ans) == NOERR)
+			ok = 0;
+	check(ok, "parse: truncated answers fail");
+
+	/* an owner pointing at itself */
+	w = parse_reply(pkt, AF_INET, 1);
+	w = parse_rr(w, (int)(w - pkt), 1, 4, addr, 4);
+	check(parse(pkt, (int)(w - pkt), AF_INET, &ans) != NOERR,
+			"parse: compression pointer loop fails");
+
+	/* an owner pointing past the end */
+	w = parse_reply(pkt, AF_INET, 1);
+	w = parse_rr(w, 0x3fff, 1, 4, addr, 4);
+	check(parse(pkt, (int)(w - pkt), AF_INET, &ans) != NOERR,
+			"parse: compression pointer out of range fails");
+
+	/* an address claiming more data than there is */
+	w = parse_reply(pkt, AF_INET, 1);
+	w = parse_rr(w, 12, 1, 200, addr, 4);
+	check(parse(pkt, (int)(w - pkt), AF_INET, &ans) != NOERR,
+			"parse: rdlength past the end fails");
+
+	/* an alias pointing at itself */
+	w = parse_reply(pkt, AF_INET, 2);
+	owner = (int)(w - pkt) + 12;
+	rdata[0] = (unsigned char)(0xc0 | owner >> 8);
+	rdata[1] = (unsigned char)owner;
+	w = parse_rr(w, 12, 5, 2, rdata, 2);
+	w = parse_rr(w, owner, 1, 4, addr, 4);
+	check(parse(pkt, (int)(w - pkt), AF_INET, &ans) != NOERR,
+			"parse: alias loop fails");
+
+	/* a name pointing at itself */
+	w = parse_reply(pkt, AF_UNSPEC, 1);
+	owner = (int)(w - pkt) + 12;
+	rdata[0] = (unsigned char)(0xc0 | owner >> 8);
+	rdata[1] = (unsigned char)owner;
+	w = parse_rr(w, 12, 12, 2, rdata, 2);
+	check(parse(pkt, (int)(w - pkt), AF_UNSPEC, &ans) != NOERR,
+			"parse: PTR pointer loop fails");
+
+	/* a chain of 32 aliases, each aN.check */
+	w = parse_reply(pkt, AF_INET, 33);
+	owner = 12;
+	for (i = 0; i < 32; i++) {
+		rdata[0] = 3;
+		rdata[1] = 'a';
+		rdata[2] = (unsigned char)('0' + i / 10);
+		rdata[3] = (unsigned char)('0' + i % 10);
+		rdata[4] = 0xc0;
+		rdata[5] = 14;
+		j = (int)(w - pkt) + 12;
+		w = parse_rr(w, owner, 5, 6, rdata, 6);
+		owner = j;
+	}
+	w = parse_rr(w, owner, 1, 4, addr, 4);
+	check(parse(pkt, (int)(w - pkt), AF_INET, &ans) != NOERR,
+			"parse: too many aliases fail");
+
+	/* random damage to the first answer, never mind the outcome, as
+	 * long as it holds up */
+	w = parse_reply(pkt, AF_INET, 3);
+	rdata[0] = 1;
+	rdata[1] = 'a';
+	rdata[2] = 0xc0;
+	rdata[3] = 14;
+	owner = (int)(w - pkt) + 12;
+	w = parse_rr(w, 12, 5, 4, rdata, 4);
+	w = parse_rr(w, owner, 1, 4, addr, 4);
+	w = parse_rr(w, owner, 1, 4, addr, 4);
+	len = (int)(w - pkt);
+	for (i = 0, ok = 1; i < 100000; i++) {
+		memcpy(mangled, pkt, (size_t)len);
+		for (j = 0; j < 4; j++) {
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 7;
+			rnd ^= rnd << 17;
+			mangled[12 + rnd % (uint64_t)(len - 12)] = (unsigned char)(rnd >> 32);
+		}
+		err = parse(mangled, len - (int)(rnd >> 40) % 8, AF_INET, &ans);
+		if (err == NOERR &&
+				(ans.naddrs == 0 || ans.naddrs > DNSPQ_MAXADDRS))
+			ok = 0;
+	}
+	check(ok, "parse: damaged answers hold up");
+}
+
+/* an alias without records behind it is the same as no records, a
+ * single query, and not found */
+static void
+check_cname(const char *port)
+{
+	dnspq_stats *s = server_stats(port);
+	struct hostent h;
+	char buf[1024];
+	uint64_t sent;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	if (s == NULL) {
+		check(0, "cname: statistics");
+		return;
+	}
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.cname", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_NOTFOUND && he == NO_DATA,
+			"cname: gethostbyname3_r is NOTFOUND, NO_DATA");
+	check(s->sent - sent == 1, "cname: gethostbyname3_r sends 1 query");
+}
+
+/* a server that rejects EDNS0 is asked without it from then on, while
+ * a server that does EDNS0 keeps getting it */
+static void
+check_edns(const char *eport, const char *nport)
+{
+	dnspq_server srvs[2];
+	dnspq_server *servers[3] = { &srvs[0], &srvs[1], NULL };
+	dnspq_opts opts;
+	dnspq_answer ans;
+	char addr[32];
+	char sid;
+	uint64_t sent;
+	int ok = 1;
+	int i;
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%s", eport);
+	dnspq_server_parse(&srvs[0], addr);
+	snprintf(addr, sizeof(addr), "127.0.0.1:%s", nport);
+	dnspq_server_parse(&srvs[1], addr);
+	srvs[0].stats = dnspq_stats_server(&srvs[0].addr);
+	srvs[1].stats = dnspq_stats_server(&srvs[1].addr);
+	if (srvs[0].stats == NULL || srvs[1].stats == NULL) {
+		check(0, "edns: statistics");
+		return;
+	}
+	memset(&opts, 0, sizeof(opts));
+
+	ok = dnsq(servers, &opts, "h.edns", AF_INET, &ans, &sid) == 0;
+	check(ok, "edns: lookup succeeds");
+	check(srvs[1].noedns && !srvs[0].noedns,
+			"edns: only the server rejecting EDNS0 is marked");
+
+	sent = srvs[1].stats->sent;
+	for (i = 0, ok = 1; i < 8; i++)
+		if (dnsq(servers, &opts, "h.edns", AF_INET, &ans, &sid) != 0)
+			ok = 0;
+	check(ok, "edns: lookups succeed");
+	check(srvs[1].stats->sent - sent == 8,
+			"edns: server without EDNS0 gets 1 query per lookup");
+
+	/* as if it rejected EDNS0 long ago */
+	srvs[1].noedns = 1;
+	sent = srvs[1].stats->sent;
+	ok = dnsq(servers, &opts, "h.edns", AF_INET, &ans, &sid) == 0;
+	check(ok && srvs[1].stats->sent - sent == 2 && srvs[1].noedns > 1,
+			"edns: server is tried with EDNS0 again after a while");
+}
+
+static void
+async_done(void *udata, const dnsq_item *item)
+{
+	int *ok = udata;
+
+	if (item->err == NOERR && item->ans.naddrs > 0)
+		(*ok)++;
+}
+
+/* a context keeps its queries apart while reusing its slots, also when
+ * some are cancelled before their answer comes in */
+static void
+check_async(const char *port)
+{
+	dnspq_server srv;
+	dnspq_server *servers[2] = { &srv, NULL };
+	dnspq_opts opts;
+	dnspq_ctx *ctx;
+	struct pollfd pfd;
+	char addr[32];
+	char name[32];
+	int handles[64];
+	int ok = 0;
+	int round;
+	int i;
+
+	snprintf(addr, sizeof(addr), "127.0.0.1:%s", port);
+	dnspq_server_parse(&srv, addr);
+	srv.stats = NULL;
+	memset(&opts, 0, sizeof(opts));
+	if ((ctx = dnspq_ctx_new(64)) == NULL) {
+		check(0, "async: context");
+		return;
+	}
+	for (round = 0; round < 4; round++) {
+		for (i = 0; i < 64; i++) {
+			snprintf(name, sizeof(name), "h%d-%d.async", round, i);
+			handles[i] = dnspq_submit(ctx, servers, &opts, name, AF_INET,
+					async_done, &ok);
+		}
+		/* every other one goes away, its slot is taken again */
+		for (i = 0; i < 64; i += 2)
+			dnspq_cancel(ctx, handles[i]);
+		for (i = 0; i < 64; i += 2) {
+			snprintf(name, sizeof(name), "h%d-%d.again", round, i);
+			dnspq_submit(ctx, servers, &opts, name, AF_INET,
+					async_done, &ok);
+		}
+		pfd.fd = dnspq_fd(ctx);
+		pfd.events = POLLIN;
+		while (dnspq_process(ctx) > 0)
+			poll(&pfd, 1, dnspq_timeout(ctx));
+	}
+	dnspq_ctx_free(ctx);
+	check(ok == 4 * 64, "async: lookups complete");
+}
+
+/* an image of which all slots are taken would have a lookup probe for
+ * a domain not in it forever, so it must not be used */
+static void
+check_image(void)
+{
+	dnspq_image *img;
+	dnspq_image_slot *slots;
+	dnspq_image_group *groups;
+	FILE *f;
+	size_t used = 0;
+	size_t i;
+
+	if ((f = tmpfile()) == NULL) {
+		check(0, "image: config");
+		return;
+	}
+	fprintf(f, ".a 127.0.0.1\n.b 127.0.0.2\n.c 127.0.0.3\n");
+	rewind(f);
+	img = dnspq_image_read(f);
+	fclose(f);
+	if (img == NULL) {
+		check(0, "image: compiles");
+		return;
+	}
+	check(dnspq_image_valid(img, img->size), "image: is valid");
+
+	groups = (dnspq_image_group *)((char *)img + img->groups);
+	groups[1].first = groups[0].first;
+	check(!dnspq_image_valid(img, img->size),
+			"image: with overlapping groups is invalid");
+	groups[1].first = groups[0].first + groups[0].count;
+
+	slots = (dnspq_image_slot *)((char *)img + img->slots);
+	for (i = 0; i < img->nslots; i++)
+		if (slots[i].hash != 0)
+			used = i;
+	for (i = 0; i < img->nslots; i++)
+		if (slots[i].hash == 0)
+			slots[i] = slots[used];
+	check(!dnspq_image_valid(img, img->size),
+			"image: without empty slots is invalid");
+	free(img);
+}
+
+#define CHECK_DAEMON  "check.sock"
+#define CHECK_DAEMON_LINK  "check.link"
+
+typedef struct {
+	int fd;
+	unsigned int delay;  /* ms */
+} fakedaemon;
+
+/* a daemon answering the first question it gets after a delay */
+static void *
+fake_daemon(void *arg)
+{
+	fakedaemon *d = arg;
+	dnspq_daemon_request req;
+	dnspq_daemon_reply rep;
+	struct sockaddr_un from;
+	socklen_t fromlen = sizeof(from);
+
+	if (recvfrom(d->fd, &req, sizeof(req), 0,
+				(struct sockaddr *)&from, &fromlen) <= 0)
+		return NULL;
+	usleep(d->delay * 1000);
+	memset(&rep, 0, sizeof(rep));
+	rep.magic = DNSPQ_DAEMON_MAGIC;
+	rep.id = req.id;
+	rep.err = DNSNXDOMAIN;
+	sendto(d->fd, &rep, sizeof(rep), 0, (struct sockaddr *)&from, fromlen);
+	return NULL;
+}
+
+/* the daemon gets as long as the pool's timeout to answer, and its
+ * socket is only used when it is one, owned by root or us, not when
+ * it's a link to one, which anyone could have put there */
+static void
+check_daemon(void)
+{
+	struct sockaddr_un sun;
+	dnspq_opts opts;
+	dnsq_item item;
+	fakedaemon d;
+	pthread_t tid;
+	int ret;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, CHECK_DAEMON);
+	unlink(CHECK_DAEMON);
+	if ((d.fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+			bind(d.fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+	{
+		check(0, "daemon: socket");
+		return;
+	}
+	memset(&opts, 0, sizeof(opts));
+	opts.timeout = 500 * 1000;
+	item.name = "h.daemon";
+	item.af = AF_INET;
+	d.delay = 1200;
+	pthread_create(&tid, NULL, fake_daemon, &d);
+	ret = dnspq_daemon_query(CHECK_DAEMON, &opts, &item, 1);
+	pthread_join(tid, NULL);
+	check(ret == 0 && item.err == DNSNXDOMAIN,
+			"daemon: answer within the pool's timeout is used");
+
+	/* last, as this makes the daemon left alone for a while */
+	unlink(CHECK_DAEMON_LINK);
+	symlink(CHECK_DAEMON, CHECK_DAEMON_LINK);
+	d.delay = 0;
+	pthread_create(&tid, NULL, fake_daemon, &d);
+	ret = dnspq_daemon_query(CHECK_DAEMON_LINK, &opts, &item, 1);
+	check(ret == -1, "daemon: a link to a socket is not used");
+	shutdown(d.fd, SHUT_RDWR);
+	pthread_join(tid, NULL);
+	close(d.fd);
+	unlink(CHECK_DAEMON_LINK);
+	unlink(CHECK_DAEMON);
+}
+
+/* writes the config, with the pool of .stale served from port, as a
+ * whole new file, such that the module notices the change */
+static int
+write_conf(const char *staleport, const char *reloadport)
+{
+	FILE *f;
+
+	if ((f = fopen(CHECK_CONF ".new", "w")) == NULL)
+		return -1;
+	fprintf(f, "options cache:1024 shm-cache:%s stale:60 stale-timeout:0 "
+			"fail-ttl:5 stats:%s\n", CHECK_SHM, CHECK_STATS);
+	fprintf(f, ".nodata 127.0.0.1:%s\n", ports[PORT_NODATA]);
+	fprintf(f, ".cname 127.0.0.1:%s\n", ports[PORT_CNAME]);
+	fprintf(f, ".cache 127.0.0.1:%s\n", ports[PORT_PLAIN]);
+	fprintf(f, ".shm 127.0.0.1:%s\n", ports[PORT_PLAIN]);
+	fprintf(f, ".neg 127.0.0.1:%s\n", ports[PORT_NXDOMAIN]);
+	fprintf(f, ".many 127.0.0.1:%s\n", ports[PORT_EDNS]);
+	fprintf(f, ".2.0.192.in-addr.arpa 127.0.0.1:%s\n", ports[PORT_PLAIN]);
+	fprintf(f, ".reload 127.0.0.1:%s\n", reloadport);
+	fprintf(f, ".flight 127.0.0.1:%s\n", ports[PORT_SLOW]);
+	fprintf(f, ".tc 127.0.0.1:%s\n", ports[PORT_TRUNCATE]);
+	fprintf(f, "options timeout:200\n");
+	fprintf(f, ".stale 127.0.0.1:%s\n", staleport);
+	fprintf(f, ".fail 127.0.0.1:%s\n", ports[PORT_DEAD]);
+	fprintf(f, "options hedge timeout:1000\n");
+	fprintf(f, ".hedge 127.0.0.1:%s 127.0.0.1:%s\n",
+			ports[PORT_PLAIN], ports[PORT_SLOW]);
+	fclose(f);
+	return rename(CHECK_CONF ".new", CHECK_CONF);
+}
+
+/* an answer is used again until it expires, without asking */
+static void
+check_cache(void)
+{
+	dnspq_stats *s = server_stats(ports[PORT_PLAIN]);
+	struct hostent h;
+	char buf[1024];
+	struct in_addr first;
+	uint64_t sent;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	if (s == NULL) {
+		check(0, "cache: statistics");
+		return;
+	}
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.cache", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && s->sent - sent == 1,
+			"cache: first lookup asks the server");
+	if (ret != NSS_STATUS_SUCCESS)
+		return;
+	memcpy(&first, h.h_addr_list[0], sizeof(first));
+	ret = _nss_dnspq_gethostbyname3_r("h.cache", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && s->sent - sent == 1 &&
+			memcmp(&first, h.h_addr_list[0], sizeof(first)) == 0,
+			"cache: second lookup is answered from the cache");
+}
+
+/* answers are shared through the file of shm-cache */
+static void
+check_shm(void)
+{
+	dnspq_stats *s = server_stats(ports[PORT_PLAIN]);
+	struct hostent h;
+	char buf[1024];
+	dnspq_answer ans;
+	struct in_addr addr;
+	uint64_t sent;
+	char err;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	if (s == NULL) {
+		check(0, "shm: statistics");
+		return;
+	}
+	sent = s->sent;
+
+	/* as if another process resolved it */
+	memset(&ans, 0, sizeof(ans));
+	ans.ttl = 60;
+	ans.af = AF_INET;
+	ans.naddrs = 1;
+	addr.s_addr = htonl(0xc0000201);  /* 192.0.2.1 */
+	ans.addrs.v4[0] = addr;
+	dnspq_shmcache_put("h.shm", &ans, NOERR);
+	ret = _nss_dnspq_gethostbyname3_r("h.shm", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && s->sent == sent &&
+			memcmp(h.h_addr_list[0], &addr, sizeof(addr)) == 0,
+			"shm: answer of another process is used");
+
+	ret = _nss_dnspq_gethostbyname3_r("h2.shm", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS &&
+			dnspq_shmcache_get("h2.shm", AF_INET, &ans, &err) &&
+			err == NOERR && ans.naddrs == 1 &&
+			memcmp(h.h_addr_list[0], &ans.addrs.v4[0],
+				sizeof(addr)) == 0,
+			"shm: answer is shared with other processes");
+}
+
+/* names that do not exist, and servers that fail, are not asked
+ * about again for neg-ttl and fail-ttl */
+static void
+check_negative(void)
+{
+	dnspq_stats *nx = server_stats(ports[PORT_NXDOMAIN]);
+	dnspq_stats *dead = server_stats(ports[PORT_DEAD]);
+	struct hostent h;
+	char buf[1024];
+	uint64_t sent;
+	int i;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	if (nx == NULL || dead == NULL) {
+		check(0, "negative: statistics");
+		return;
+	}
+	sent = nx->sent;
+	for (i = 0; i < 2; i++) {
+		ret = _nss_dnspq_gethostbyname3_r("h.neg", AF_INET, &h,
+				buf, sizeof(buf), &e, &he, NULL, NULL);
+		if (ret != NSS_STATUS_NOTFOUND || he != HOST_NOT_FOUND)
+			break;
+	}
+	check(i == 2 && nx->sent - sent == 1,
+			"negative: no such name is remembered");
+
+	sent = dead->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.fail", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret != NSS_STATUS_SUCCESS && dead->sent != sent,
+			"negative: failing servers are asked");
+	sent = dead->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.fail", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret != NSS_STATUS_SUCCESS && dead->sent == sent,
+			"negative: failure is remembered");
+}
+
+/* in hedged mode, the slow server is left alone once the fast one
+ * proved itself */
+static void
+check_hedge(void)
+{
+	dnspq_stats *fast = server_stats(ports[PORT_PLAIN]);
+	dnspq_stats *slow = server_stats(ports[PORT_SLOW]);
+	struct hostent h;
+	char buf[1024];
+	char name[32];
+	uint64_t fastsent;
+	uint64_t slowsent;
+	int ok = 1;
+	int i;
+	int e;
+	int he;
+
+	if (fast == NULL || slow == NULL) {
+		check(0, "hedge: statistics");
+		return;
+	}
+	/* have both servers measured */
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "w%d.hedge", i);
+		_nss_dnspq_gethostbyname3_r(name, AF_INET, &h,
+				buf, sizeof(buf), &e, &he, NULL, NULL);
+	}
+	usleep(100 * 1000);
+
+	fastsent = fast->sent;
+	slowsent = slow->sent;
+	for (i = 0; i < CHECK_HEDGED; i++) {
+		snprintf(name, sizeof(name), "h%d.hedge", i);
+		if (_nss_dnspq_gethostbyname3_r(name, AF_INET, &h,
+				buf, sizeof(buf), &e, &he, NULL, NULL) !=
+				NSS_STATUS_SUCCESS)
+			ok = 0;
+	}
+	check(ok && fast->sent - fastsent == CHECK_HEDGED &&
+			slow->sent - slowsent < CHECK_HEDGED / 2,
+			"hedge: only the fast server is asked");
+}
+
+/* an answer with more addresses than fit the buffer asks for a larger
+ * one, as glibc then retries */
+static void
+check_erange(void)
+{
+	struct hostent h;
+	struct gaih_addrtuple *pat;
+	char small[64];
+	char buf[1024];
+	int n;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	e = he = 0;
+	ret = _nss_dnspq_gethostbyname3_r("h.many", AF_INET, &h,
+			small, sizeof(small), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_TRYAGAIN && e == ERANGE &&
+			he == NETDB_INTERNAL,
+			"erange: gethostbyname3_r wants a larger buffer");
+	ret = _nss_dnspq_gethostbyname3_r("h.many", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	for (n = 0; ret == NSS_STATUS_SUCCESS && h.h_addr_list[n] != NULL; n++)
+		;
+	check(ret == NSS_STATUS_SUCCESS && n == DNSPQ_MAXADDRS,
+			"erange: gethostbyname3_r fits in a larger buffer");
+
+	e = he = 0;
+	ret = _nss_dnspq_gethostbyname4_r("h4.many", &pat,
+			small, sizeof(small), &e, &he, NULL);
+	check(ret == NSS_STATUS_TRYAGAIN && e == ERANGE &&
+			he == NETDB_INTERNAL,
+			"erange: gethostbyname4_r wants a larger buffer");
+}
+
+/* addresses are looked up by their name in the reverse tree */
+static void
+check_ptr(void)
+{
+	struct hostent h;
+	struct in_addr addr;
+	char buf[1024];
+	char want[32];
+	int e;
+	int he;
+	enum nss_status ret;
+
+	snprintf(want, sizeof(want), "host-%s.example", ports[PORT_PLAIN]);
+	addr.s_addr = htonl(0xc0000207);  /* 192.0.2.7 */
+	ret = _nss_dnspq_gethostbyaddr2_r(&addr, sizeof(addr), AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL);
+	check(ret == NSS_STATUS_SUCCESS && strcmp(h.h_name, want) == 0 &&
+			h.h_addrtype == AF_INET && h.h_addr_list[0] != NULL &&
+			memcmp(h.h_addr_list[0], &addr, sizeof(addr)) == 0,
+			"ptr: name of the address");
+	addr.s_addr = htonl(0xc0000307);  /* 192.0.3.7, no pool */
+	ret = _nss_dnspq_gethostbyaddr2_r(&addr, sizeof(addr), AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL);
+	check(ret != NSS_STATUS_SUCCESS, "ptr: address outside the pools");
+}
+
+static pthread_barrier_t flightstart;
+
+static void *
+flight_lookup(void *arg)
+{
+	struct hostent h;
+	char buf[1024];
+	int e;
+	int he;
+
+	pthread_barrier_wait(&flightstart);
+	*(enum nss_status *)arg = _nss_dnspq_gethostbyname3_r("h.flight",
+			AF_INET, &h, buf, sizeof(buf), &e, &he, NULL, NULL);
+	return NULL;
+}
+
+/* lookups of the same name at the same time share a single query */
+static void
+check_flight(void)
+{
+	dnspq_stats *s = server_stats(ports[PORT_SLOW]);
+	pthread_t tids[CHECK_FLIGHT];
+	enum nss_status rets[CHECK_FLIGHT];
+	uint64_t sent;
+	int ok = 1;
+	int i;
+
+	if (s == NULL) {
+		check(0, "flight: statistics");
+		return;
+	}
+	sent = s->sent;
+	pthread_barrier_init(&flightstart, NULL, CHECK_FLIGHT);
+	for (i = 0; i < CHECK_FLIGHT; i++)
+		pthread_create(&tids[i], NULL, flight_lookup, &rets[i]);
+	for (i = 0; i < CHECK_FLIGHT; i++) {
+		pthread_join(tids[i], NULL);
+		if (rets[i] != NSS_STATUS_SUCCESS)
+			ok = 0;
+	}
+	pthread_barrier_destroy(&flightstart);
+	check(ok, "flight: all lookups are answered");
+	check(s->sent - sent == 1, "flight: a single query is sent");
+}
+
+/* an expired answer is used when the servers fail, and then for as long
+ * as a failure is remembered without asking them again */
+static void
+check_stale(void)
+{
+	dnspq_stats *s = server_stats(ports[PORT_DEAD]);
+	struct hostent h;
+	char buf[1024];
+	uint64_t sent;
+	int e;
+	int he;
+	enum nss_status ret;
+
+	ret = _nss_dnspq_gethostbyname3_r("h.stale", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS, "stale: answer");
+	if (s == NULL ||
+			write_conf(ports[PORT_DEAD], ports[PORT_PLAIN]) != 0)
+	{
+		check(0, "stale: config");
+		return;
+	}
+	sleep(2);  /* the answer expires, and the config is reread */
+
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.stale", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && s->sent > sent,
+			"stale: expired answer used when the servers fail");
+	sent = s->sent;
+	ret = _nss_dnspq_gethostbyname3_r("h.stale", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && s->sent == sent,
+			"stale: servers not asked again while failing");
+	write_conf(ports[PORT_SHORTTTL], ports[PORT_PLAIN]);
+}
+
+/* whether the (first) address h resolved to is one fakedns answers on
+ * port with */
+static int
+answered_by(const struct hostent *h, const char *port)
+{
+	const unsigned char *a = (const unsigned char *)h->h_addr_list[0];
+
+	return a != NULL && a[0] == 10 && a[1] == (atoi(port) & 0xff);
+}
+
+/* a changed config is picked up by a running process */
+static void
+check_reload(void)
+{
+	struct hostent h;
+	char buf[1024];
+	int e;
+	int he;
+	enum nss_status ret;
+
+	ret = _nss_dnspq_gethostbyname3_r("h1.reload", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && answered_by(&h, ports[PORT_PLAIN]),
+			"reload: answer from the configured server");
+	if (write_conf(ports[PORT_SHORTTTL], ports[PORT_SLOW]) != 0) {
+		check(0, "reload: config");
+		return;
+	}
+	sleep(2);  /* the config is reread */
+
+	ret = _nss_dnspq_gethostbyname3_r("h2.reload", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS && answered_by(&h, ports[PORT_SLOW]),
+			"reload: answer from the newly configured server");
+	write_conf(ports[PORT_SHORTTTL], ports[PORT_PLAIN]);
+}
+
+/* an answer truncated over UDP is asked for again over TCP */
+static void
+check_tcp(void)
+{
+	struct hostent h;
+	char buf[1024];
+	int e;
+	int he;
+	enum nss_status ret;
+
+	ret = _nss_dnspq_gethostbyname3_r("h.tc", AF_INET, &h,
+			buf, sizeof(buf), &e, &he, NULL, NULL);
+	check(ret == NSS_STATUS_SUCCESS &&
+			answered_by(&h, ports[PORT_TRUNCATE]),
+			"tcp: truncated answer is asked for over TCP");
+}
+
+static void
+usage(void)
+{
+	printf("usage: dnspqcheck <port>...\n");
+	printf("  %d ports, see PORT_ in check.c for what each is for\n", NPORTS);
+	printf("  the ports are served by fakedns, see CHECK_SERVERS in the\n");
+	printf("  Makefile for how each of them should behave\n");
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != NPORTS + 1) {
+		usage();
+		return 1;
+	}
+	ports = argv + 1;
+
+	unlink(CHECK_STATS);
+	unlink(CHECK_SHM);
+	if (write_conf(ports[PORT_SHORTTTL], ports[PORT_PLAIN]) != 0) {
+		perror(CHECK_CONF);
+		return 1;
+	}
+	dnspq_stats_init(CHECK_STATS);
+
+	check_parse();
+	check_nodata(ports[PORT_NODATA]);
+	check_longname(ports[PORT_NODATA]);
+	check_edns(ports[PORT_EDNS], ports[PORT_NOEDNS]);
+	check_cname(ports[PORT_CNAME]);
+	check_async(ports[PORT_EDNS]);
+	check_cache();
+	check_shm();
+	check_negative();
+	check_hedge();
+	check_erange();
+	check_ptr();
+	check_flight();
+	check_stale();
+	check_reload();
+	check_tcp();
+	check_image();
+	check_daemon();
+
+	unlink(CHECK_CONF);
+	unlink(CHECK_STATS);
+	unlink(CHECK_SHM);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,482 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* config file parsing
+ *
+ * The config file is turned into an image (see config.h), which the nss
+ * module either builds from the text file, or maps from a file written
+ * by `dnspq -c`, which saves the parsing in every process. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#ifdef LOGGING
+#include <syslog.h>
+#endif
+
+#include "dnspq.h"
+#include "config.h"
+
+#ifndef CACHE_SIZE
+#define CACHE_SIZE 1024
+#endif
+#ifndef NEG_TTL
+#define NEG_TTL 5  /* seconds to remember NXDOMAIN */
+#endif
+#ifndef FAIL_TTL
+#define FAIL_TTL 1  /* seconds to remember all servers failing */
+#endif
+#ifndef STALE_TIMEOUT
+#define STALE_TIMEOUT 100  /* ms to wait before using a stale answer */
+#endif
+#define MAXPOOLSERVERS MAXSERVERS  /* servers on a single line, the most
+                                     a query goes out to */
+
+#define IMAGE_ABI  ((uint32_t)sizeof(dnspq_image) | \
+		(uint32_t)sizeof(dnspq_image_slot) << 8 | \
+		(uint32_t)sizeof(dnspq_image_group) << 16 | \
+		(uint32_t)sizeof(dnspq_sockaddr) << 24)
+
+typedef struct {
+	uint32_t pool;  /* NONE for the traditional mode servers */
+	uint32_t first;
+	uint32_t count;
+	dnspq_opts opts;
+} parsegroup;
+
+typedef struct {
+	dnspq_image hdr;  /* the options */
+	char *shmcache;
+	char *stats;
+	char *daemon;
+	dnspq_opts curopts;  /* applies to the pools that follow */
+	char **domains;
+	size_t npools;
+	parsegroup *groups;
+	size_t ngroups;
+	dnspq_sockaddr *servers;
+	size_t nservers;
+} parsestate;
+
+/* makes room for element n in the array at *p, which doubles in size */
+static int grow(void *p, size_t n, size_t size) {
+	void *r;
+
+	if (n != 0 && (n & (n - 1)) != 0)
+		return 0;
+	if ((r = realloc(*(void **)p, (n == 0 ? 1 : n * 2) * size)) == NULL)
+		return -1;
+	*(void **)p = r;
+	return 0;
+}
+
+/* parse the arguments of an options line, e.g.
+ * options cache:4096 shm-cache:/dev/shm/dnspq-cache neg-ttl:5 fail-ttl:1
+ *   stats:/dev/shm/dnspq-stats daemon:/run/dnspq.sock stale:3600
+ *   stale-timeout:100
+ * query options (hedge, adaptive, timeouts and retries) only affect the
+ * pools defined after them */
+static void parseoptions(char *p, parsestate *ps) {
+	char *v;
+	char *last = NULL;
+
+	while ((p = strtok_r(p, " \t\n", &last)) != NULL) {
+		if ((v = strchr(p, ':')) != NULL)
+			*v++ = '\0';
+		if (strcmp(p, "cache") == 0 && v != NULL) {
+			ps->hdr.cachesize = (uint32_t)atol(v);
+		} else if (strcmp(p, "shm-cache") == 0 && v != NULL) {
+			free(ps->shmcache);
+			ps->shmcache = strdup(v);
+		} else if (strcmp(p, "stats") == 0 && v != NULL) {
+			free(ps->stats);
+			ps->stats = strdup(v);
+		} else if (strcmp(p, "daemon") == 0 && v != NULL) {
+			free(ps->daemon);
+			ps->daemon = strdup(v);
+		} else if (strcmp(p, "neg-ttl") == 0 && v != NULL) {
+			ps->hdr.negttl = (uint32_t)atoi(v);
+		} else if (strcmp(p, "fail-ttl") == 0 && v != NULL) {
+			ps->hdr.failttl = (uint32_t)atoi(v);
+		} else if (strcmp(p, "stale") == 0 && v != NULL) {
+			ps->hdr.stale = (uint32_t)atoi(v);
+		} else if (strcmp(p, "stale-timeout") == 0 && v != NULL) {
+			ps->hdr.staletimeout = (uint32_t)atoi(v);
+		} else if (strcmp(p, "hedge") == 0) {
+			ps->curopts.hedge = 1;
+		} else if (strcmp(p, "no-hedge") == 0) {
+			ps->curopts.hedge = 0;
+		} else if (strcmp(p, "adaptive") == 0) {
+			ps->curopts.adaptive = 1;
+		} else if (strcmp(p, "no-adaptive") == 0) {
+			ps->curopts.adaptive = 0;
+		} else if (strcmp(p, "timeout") == 0 && v != NULL) {
+			ps->curopts.timeout = (int)(atof(v) * 1000);  /* ms to usec */
+		} else if (strcmp(p, "retry-timeout") == 0 && v != NULL) {
+			ps->curopts.retrytimeout = (int)(atof(v) * 1000);
+		} else if (strcmp(p, "retries") == 0 && v != NULL) {
+			ps->curopts.tries = atoi(v) + 1;
+		} else if (strcmp(p, "edns") == 0 && v != NULL) {
+			ps->curopts.edns = atoi(v) > 0 ? atoi(v) : -1;
+		} else if (strcmp(p, "no-edns") == 0) {
+			ps->curopts.edns = -1;
+		}
+#ifdef LOGGING
+		else {
+			syslog(LOG_INFO, "ignoring unknown option '%s'", p);
+		}
+#endif
+		p = NULL;
+	}
+}
+
+/* adds a group of the servers in the (whitespace separated) list p */
+static int addgroup(parsestate *ps, uint32_t pool, char *p) {
+	parsegroup *g;
+	dnspq_server srv;
+	char *last = NULL;
+
+	if (grow(&ps->groups, ps->ngroups, sizeof(*ps->groups)) != 0)
+		return -1;
+	g = &ps->groups[ps->ngroups++];
+	g->pool = pool;
+	g->first = (uint32_t)ps->nservers;
+	g->count = 0;
+	g->opts = ps->curopts;
+	while (g->count < MAXPOOLSERVERS &&
+			(p = strtok_r(p, " \t\n", &last)) != NULL)
+	{
+		if (dnspq_server_parse(&srv, p) == 0) {
+			if (grow(&ps->servers, ps->nservers, sizeof(*ps->servers)) != 0)
+				return -1;
+			ps->servers[ps->nservers++] = srv.addr;
+			g->count++;
+		}
+		p = NULL;
+	}
+	return 0;
+}
+
+/* builds the image out of what was parsed */
+static dnspq_image *buildimage(parsestate *ps) {
+	dnspq_image *img;
+	dnspq_image_slot *slots;
+	dnspq_image_group *groups;
+	dnspq_sockaddr *servers;
+	uint32_t *pools;
+	char *names;
+	size_t *next;
+	size_t *order;
+	size_t namelen = 0;
+	size_t nslots;
+	size_t size;
+	size_t len;
+	size_t i;
+	size_t j;
+	uint32_t h;
+	parsegroup *g;
+
+	for (i = 0; i < ps->npools; i++)
+		namelen += strlen(ps->domains[i]);
+	if (ps->shmcache != NULL)
+		namelen += strlen(ps->shmcache) + 1;
+	if (ps->stats != NULL)
+		namelen += strlen(ps->stats) + 1;
+	if (ps->daemon != NULL)
+		namelen += strlen(ps->daemon) + 1;
+	for (nslots = 8; nslots < ps->npools * 2; nslots <<= 1)
+		;
+
+	size = sizeof(*img) +
+		nslots * sizeof(*slots) +
+		ps->ngroups * sizeof(*groups) +
+		ps->nservers * sizeof(*servers) +
+		ps->npools * sizeof(*pools) +
+		namelen;
+	if (size > UINT32_MAX || (img = calloc(1, size)) == NULL)
+		return NULL;
+	*img = ps->hdr;
+	img->magic = DNSPQ_IMAGE_MAGIC;
+	img->version = DNSPQ_IMAGE_VERSION;
+	img->abi = IMAGE_ABI;
+	img->size = (uint32_t)size;
+	img->npools = (uint32_t)ps->npools;
+	img->nslots = (uint32_t)nslots;
+	img->ngroups = (uint32_t)ps->ngroups;
+	img->nservers = (uint32_t)ps->nservers;
+	img->namelen = (uint32_t)namelen;
+	img->slots = sizeof(*img);
+	img->groups = img->slots + nslots * sizeof(*slots);
+	img->servers = img->groups + ps->ngroups * sizeof(*groups);
+	img->pools = img->servers + ps->nservers * sizeof(*servers);
+	img->names = img->pools + ps->npools * sizeof(*pools);
+	slots = (dnspq_image_slot *)((char *)img + img->slots);
+	groups = (dnspq_image_group *)((char *)img + img->groups);
+	servers = (dnspq_sockaddr *)((char *)img + img->servers);
+	pools = (uint32_t *)((char *)img + img->pools);
+	names = (char *)img + img->names;
+
+	/* the members of a pool go together, in order of the pools, with
+	 * the traditional mode servers last */
+	if ((next = calloc(ps->npools + 1, sizeof(*next))) == NULL) {
+		free(img);
+		return NULL;
+	}
+	for (i = 0; i < ps->ngroups; i++)
+		next[ps->groups[i].pool == DNSPQ_IMAGE_NONE ?
+			ps->npools : ps->groups[i].pool]++;
+	for (i = 0, j = 0; i <= ps->npools; i++) {
+		len = next[i];
+		next[i] = j;
+		j += len;
+	}
+
+	namelen = 0;
+	for (i = 0; i < ps->npools; i++) {
+		len = strlen(ps->domains[i]);
+		for (h = POOLHASH_INIT, j = len; j > 0; j--)
+			h = POOLHASH(h, ps->domains[i][j - 1]);
+		if (h == 0)
+			h = 1;
+		for (j = h & (nslots - 1); slots[j].hash != 0; j = (j + 1) & (nslots - 1))
+			;
+		slots[j].hash = h;
+		slots[j].pool = (uint32_t)i;
+		slots[j].name = (uint32_t)namelen;
+		slots[j].len = (uint32_t)len;
+		slots[j].first = (uint32_t)next[i];
+		slots[j].count = (uint32_t)(next[i + 1] - next[i]);
+		pools[i] = (uint32_t)j;
+		memcpy(names + namelen, ps->domains[i], len);
+		namelen += len;
+	}
+	img->shmcache = DNSPQ_IMAGE_NONE;
+	if (ps->shmcache != NULL) {
+		img->shmcache = (uint32_t)namelen;
+		memcpy(names + namelen, ps->shmcache, strlen(ps->shmcache) + 1);
+		namelen += strlen(ps->shmcache) + 1;
+	}
+	img->stats = DNSPQ_IMAGE_NONE;
+	if (ps->stats != NULL) {
+		img->stats = (uint32_t)namelen;
+		memcpy(names + namelen, ps->stats, strlen(ps->stats) + 1);
+		namelen += strlen(ps->stats) + 1;
+	}
+	img->daemon = DNSPQ_IMAGE_NONE;
+	if (ps->daemon != NULL) {
+		img->daemon = (uint32_t)namelen;
+		memcpy(names + namelen, ps->daemon, strlen(ps->daemon) + 1);
+	}
+	img->fallback = next[ps->npools] < ps->ngroups ?
+		(uint32_t)next[ps->npools] : DNSPQ_IMAGE_NONE;
+
+	if ((order = malloc((ps->ngroups + 1) * sizeof(*order))) == NULL) {
+		free(next);
+		free(img);
+		return NULL;
+	}
+	for (i = 0; i < ps->ngroups; i++)
+		order[next[ps->groups[i].pool == DNSPQ_IMAGE_NONE ?
+			ps->npools : ps->groups[i].pool]++] = i;
+	for (i = 0, j = 0; i < ps->ngroups; i++) {
+		g = &ps->groups[order[i]];
+		groups[i].first = (uint32_t)j;
+		groups[i].count = g->count;
+		groups[i].opts = g->opts;
+		memcpy(&servers[j], &ps->servers[g->first],
+				g->count * sizeof(*servers));
+		j += g->count;
+	}
+	free(order);
+	free(next);
+
+	return img;
+}
+
+/* reads the config file f into an image, which is to be freed */
+dnspq_image *dnspq_image_read(FILE *f) {
+	parsestate ps;
+	dnspq_image *img = NULL;
+	struct stat st;
+	char buf[1024];
+	char *p;
+	char *fb = NULL;  /* the traditional mode servers */
+	size_t fblen = 0;
+	size_t len;
+	size_t i;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.hdr.cachesize = CACHE_SIZE;
+	ps.hdr.negttl = NEG_TTL;
+	ps.hdr.failttl = FAIL_TTL;
+	ps.hdr.staletimeout = STALE_TIMEOUT;
+	if (fstat(fileno(f), &st) == 0) {
+		ps.hdr.srcmtime = st.st_mtim.tv_sec * 1000000000LL +
+			st.st_mtim.tv_nsec;
+		ps.hdr.srcsize = (uint64_t)st.st_size;
+	}
+
+	/* .domain ip:port ip:port ...
+	 * or
+	 * nameserver ip 
+	 *
+	 * The first form creates a group of DNS servers to query for the
+	 * domain.  The leading . is mandatory here (to distinguish easily).
+	 * Multiple lines for the same domain form a pool, of which a member
+	 * is picked in turn for every query.
+	 * The second form is to facilitate traditional /etc/resolv.conf
+	 * files.  Interleaving both forms is NOT supported.
+	 *
+	 * options name[:value] ...
+	 * tunes the library, see parseoptions() for the available names.
+	 */
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		if (strncmp(buf, "nameserver ", 11) == 0) {
+			/* traditional /etc/resolv.conf mode, collect them into a
+			 * single group */
+			len = strlen(buf + 11);
+			if ((p = realloc(fb, fblen + len + 2)) == NULL)
+				goto out;
+			fb = p;
+			memcpy(fb + fblen, buf + 11, len);
+			fblen += len;
+			fb[fblen++] = ' ';
+			fb[fblen] = '\0';
+		} else if (strncmp(buf, "options ", 8) == 0) {
+			parseoptions(buf + 8, &ps);
+		} else if (buf[0] == '.') { /* group mode */
+			if ((p = strpbrk(buf + 1, " \t")) == NULL)
+				continue;
+			*p++ = '\0';
+			for (i = 0; i < ps.npools; i++)
+				if (strcmp(ps.domains[i], buf + 1) == 0)
+					break;
+			if (i == ps.npools) {
+				if (grow(&ps.domains, ps.npools, sizeof(*ps.domains)) != 0 ||
+						(ps.domains[i] = strdup(buf + 1)) == NULL)
+					goto out;
+				ps.npools++;
+			}
+			if (addgroup(&ps, (uint32_t)i, p) != 0)
+				goto out;
+		}
+	}
+
+	if (fb != NULL && addgroup(&ps, DNSPQ_IMAGE_NONE, fb) != 0)
+		goto out;
+	img = buildimage(&ps);
+
+out:
+	for (i = 0; i < ps.npools; i++)
+		free(ps.domains[i]);
+	free(ps.domains);
+	free(ps.groups);
+	free(ps.servers);
+	free(ps.shmcache);
+	free(ps.stats);
+	free(ps.daemon);
+	free(fb);
+	return img;
+}
+
+/* checks that all of the image fits in len bytes, such that following
+ * its offsets and indices is safe */
+int dnspq_image_valid(const dnspq_image *img, size_t len) {
+	const dnspq_image_slot *slots;
+	const dnspq_image_group *groups;
+	const dnspq_sockaddr *servers;
+	const uint32_t *pools;
+	const char *names;
+	uint64_t end;
+	size_t used;
+	size_t i;
+
+	if (len < sizeof(*img) ||
+			img->magic != DNSPQ_IMAGE_MAGIC ||
+			img->version != DNSPQ_IMAGE_VERSION ||
+			img->abi != IMAGE_ABI ||
+			img->size != len ||
+			img->nslots == 0 ||
+			(img->nslots & (img->nslots - 1)) != 0 ||
+			img->nslots <= img->npools)
+		return 0;
+#define TABLE_FITS(OFF, N, T) \
+	((OFF) % __alignof__(T) == 0 && (OFF) >= sizeof(*img) && \
+	 (end = (uint64_t)(OFF) + (uint64_t)(N) * sizeof(T)) <= len)
+	if (!TABLE_FITS(img->slots, img->nslots, dnspq_image_slot) ||
+			!TABLE_FITS(img->groups, img->ngroups, dnspq_image_group) ||
+			!TABLE_FITS(img->servers, img->nservers, dnspq_sockaddr) ||
+			!TABLE_FITS(img->pools, img->npools, uint32_t) ||
+			!TABLE_FITS(img->names, img->namelen, char))
+		return 0;
+#undef TABLE_FITS
+
+	slots = DNSPQ_IMAGE_AT(img, img->slots);
+	groups = DNSPQ_IMAGE_AT(img, img->groups);
+	servers = DNSPQ_IMAGE_AT(img, img->servers);
+	pools = DNSPQ_IMAGE_AT(img, img->pools);
+	names = DNSPQ_IMAGE_AT(img, img->names);
+
+	for (i = 0, used = 0; i < img->nslots; i++) {
+		if (slots[i].hash == 0)
+			continue;
+		if (slots[i].pool >= img->npools ||
+				(uint64_t)slots[i].name + slots[i].len > img->namelen ||
+				(uint64_t)slots[i].first + slots[i].count > img->ngroups ||
+				slots[i].count == 0)
+			return 0;
+		used++;
+	}
+	/* each pool has one slot, which leaves empty ones to end the probe
+	 * of a lookup on, since there are more slots than pools */
+	if (used != img->npools)
+		return 0;
+	for (i = 0; i < img->npools; i++)
+		if (pools[i] >= img->nslots || slots[pools[i]].hash == 0 ||
+				slots[pools[i]].pool != i)
+			return 0;
+	/* the groups' servers follow each other, the module lays out their
+	 * lists likewise, each followed by a NULL, see GROUP_SERVERS, which
+	 * only works when they don't overlap */
+	for (i = 0; i < img->ngroups; i++)
+		if ((uint64_t)groups[i].first + groups[i].count > img->nservers ||
+				groups[i].count > MAXPOOLSERVERS ||
+				(i > 0 && groups[i].first <
+				 (uint64_t)groups[i - 1].first + groups[i - 1].count))
+			return 0;
+	for (i = 0; i < img->nservers; i++)
+		if (servers[i].sa.sa_family != AF_INET &&
+				servers[i].sa.sa_family != AF_INET6)
+			return 0;
+	if (img->fallback != DNSPQ_IMAGE_NONE && img->fallback >= img->ngroups)
+		return 0;
+#define PATH_FITS(OFF) \
+	((OFF) == DNSPQ_IMAGE_NONE || \
+	 ((OFF) < img->namelen && \
+	  memchr(names + (OFF), '\0', img->namelen - (OFF)) != NULL))
+	if (!PATH_FITS(img->shmcache) || !PATH_FITS(img->stats) ||
+			!PATH_FITS(img->daemon))
+		return 0;
+#undef PATH_FITS
+
+	return 1;
+}
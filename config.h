@@ -0,0 +1,86 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESOLV_CONF
+#define RESOLV_CONF "/etc/resolv-dnspq.conf"
+#endif
+#ifndef RESOLV_CONF_IMAGE
+#define RESOLV_CONF_IMAGE RESOLV_CONF ".bin"
+#endif
+
+#define DNSPQ_IMAGE_MAGIC    0x64707169  /* "dpqi" */
+#define DNSPQ_IMAGE_VERSION  5
+#define DNSPQ_IMAGE_NONE     0xffffffffU
+
+/* a config file compiled into a single block without pointers, all
+ * references are offsets from the start of the image, or indices in its
+ * tables, such that it can be mapped anywhere */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t abi;  /* sizes of the tables' elements, see config.c */
+	uint32_t size;  /* of the whole image */
+	int64_t srcmtime;  /* of the config file, in nsec */
+	uint64_t srcsize;
+	uint32_t cachesize;
+	uint32_t negttl;
+	uint32_t failttl;
+	uint32_t stale;  /* seconds answers remain usable after expiry */
+	uint32_t staletimeout;  /* ms to wait before using those */
+	uint32_t shmcache;  /* offset of the path in names, or NONE */
+	uint32_t stats;  /* likewise */
+	uint32_t daemon;  /* likewise */
+	uint32_t fallback;  /* group of the traditional mode servers, or NONE */
+	uint32_t npools;
+	uint32_t nslots;  /* a power of two, larger than npools */
+	uint32_t ngroups;
+	uint32_t nservers;
+	uint32_t namelen;
+	uint32_t slots;  /* offsets of the tables */
+	uint32_t pools;
+	uint32_t groups;
+	uint32_t servers;
+	uint32_t names;
+	uint32_t pad;
+} dnspq_image;
+
+/* the pool domains, in an open addressing table, hashed back to front
+ * with POOLHASH, such that the hashes of all suffixes of a name are
+ * found in a single pass over it */
+typedef struct {
+	uint32_t hash;  /* 0 means unused slot */
+	uint32_t pool;  /* position of the pool in the config */
+	uint32_t name;  /* offset of the domain in names */
+	uint32_t len;
+	uint32_t first;  /* first member in groups */
+	uint32_t count;
+} dnspq_image_slot;
+
+/* a pool member, or the traditional mode servers */
+typedef struct {
+	uint32_t first;  /* first server in servers */
+	uint32_t count;
+	dnspq_opts opts;
+} dnspq_image_group;
+
+#define POOLHASH_INIT  2166136261U
+#define POOLHASH(H, C)  (((H) ^ (unsigned char)(C)) * 16777619U)
+
+#define DNSPQ_IMAGE_AT(I, O)  ((const void *)((const char *)(I) + (O)))
+
+dnspq_image *dnspq_image_read(FILE *f);
+int dnspq_image_valid(const dnspq_image *img, size_t len);
@@ -0,0 +1,510 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* local stub daemon
+ *
+ * `dnspq -D` resolves lookups on behalf of all processes on the host,
+ * such that identical questions asked by many of them at once go out
+ * to the servers only once, and their answers are cached in a single
+ * place.  Processes talk to it over a unix datagram socket, a question
+ * and an answer each fit a single datagram.  The daemon resolves with
+ * the asynchronous interface from a single thread, and uses the pools
+ * and caches of the nss module, see nss-dnspq.c.
+ *
+ * The client side is used by the nss module when a daemon is
+ * configured: a lookup it cannot get answered, because the daemon isn't
+ * running, or doesn't answer in time, is resolved by the process itself,
+ * and the daemon is left alone for a while. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#ifdef LOGGING
+#include <syslog.h>
+#endif
+
+#include "dnspq.h"
+#include "daemon.h"
+
+#ifndef DAEMON_TIMEOUT
+# define DAEMON_TIMEOUT  1000  /* ms to wait for the daemon to answer, on
+                                  top of the timeout of the pool */
+#endif
+#ifndef DAEMON_RETRY
+# define DAEMON_RETRY  5  /* seconds to leave a failing daemon alone */
+#endif
+#ifndef DAEMON_INFLIGHT
+# define DAEMON_INFLIGHT  4096  /* distinct questions resolved at once */
+#endif
+#define DAEMON_BUCKETS  1024  /* of the table of questions in flight */
+
+/* each thread keeps its own socket to talk to the daemon, bound to an
+ * address of its own such that the daemon can answer it */
+static __thread int daemonfd = -1;
+static __thread uint32_t daemonid = 0;
+static pthread_key_t daemonkey;
+static pthread_once_t daemononce = PTHREAD_ONCE_INIT;
+static time_t daemondown = 0;  /* don't try before then */
+
+static inline time_t
+daemon_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static int
+daemon_addr(const char *path, struct sockaddr_un *sun)
+{
+	size_t len = strlen(path);
+
+	if (len >= sizeof(sun->sun_path))
+		return -1;
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	memcpy(sun->sun_path, path, len + 1);
+	return (int)(offsetof(struct sockaddr_un, sun_path) + len + 1);
+}
+
+static void
+daemonsock_release(void *arg)
+{
+	/* thread exit, stored as fd + 1 because NULL means unset */
+	close((int)(intptr_t)arg - 1);
+}
+
+static void
+daemonsock_atfork_child(void)
+{
+	/* answers for the parent shouldn't end up in the child */
+	if (daemonfd != -1) {
+		close(daemonfd);
+		daemonfd = -1;
+		pthread_setspecific(daemonkey, NULL);
+	}
+}
+
+static void
+daemonsock_setup(void)
+{
+	pthread_key_create(&daemonkey, daemonsock_release);
+	pthread_atfork(NULL, NULL, daemonsock_atfork_child);
+}
+
+static int
+daemonsock(void)
+{
+	sa_family_t af = AF_UNIX;
+
+	if (daemonfd == -1) {
+		pthread_once(&daemononce, daemonsock_setup);
+		if ((daemonfd = socket(AF_UNIX,
+						SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+			return -1;
+		/* autobind: an unused abstract address */
+		if (bind(daemonfd, (struct sockaddr *)&af, sizeof(af)) != 0) {
+			close(daemonfd);
+			daemonfd = -1;
+			return -1;
+		}
+		pthread_setspecific(daemonkey, (void *)(intptr_t)(daemonfd + 1));
+	}
+	return daemonfd;
+}
+
+/* whether the socket at path can be trusted to be the daemon's: anyone
+ * listening there gets to answer the lookups of this process, so it
+ * must be owned by the user of this process, or by root, like the files
+ * of the shared cache and the statistics */
+static int
+daemon_trusted(const char *path)
+{
+	struct stat st;
+
+	return lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+		(st.st_uid == geteuid() || st.st_uid == 0);
+}
+
+/* asks the daemon at path to resolve the n items, which it does with
+ * opts, returns 0 when it answered all of them, or -1 when the caller
+ * should resolve them itself */
+int
+dnspq_daemon_query(const char *path, const dnspq_opts *opts,
+		dnsq_item *items, size_t n)
+{
+	dnspq_daemon_request req;
+	dnspq_daemon_reply rep;
+	struct sockaddr_un to;
+	struct sockaddr_un from;
+	socklen_t fromlen;
+	int tolen;
+	struct pollfd pfd;
+	struct timespec ts;
+	int64_t deadline;
+	int64_t now;
+	uint32_t base;
+	size_t left = n;
+	size_t i;
+	ssize_t len;
+	int fd;
+
+	if (n == 0 || __atomic_load_n(&daemondown, __ATOMIC_RELAXED) >
+			daemon_now() ||
+			(tolen = daemon_addr(path, &to)) == -1 ||
+			(fd = daemonsock()) == -1)
+		return -1;
+	if (!daemon_trusted(path)) {
+#ifdef LOGGING
+		syslog(LOG_WARNING, "not using daemon at %s, its socket is not "
+				"owned by root or us", path);
+#endif
+		__atomic_store_n(&daemondown, daemon_now() + DAEMON_RETRY,
+				__ATOMIC_RELAXED);
+		return -1;
+	}
+
+	/* drop whatever answers came in too late for an earlier lookup */
+	while (recv(fd, &rep, sizeof(rep), 0) > 0)
+		;
+
+	base = daemonid;
+	daemonid += (uint32_t)n;
+	req.magic = DNSPQ_DAEMON_MAGIC;
+	for (i = 0; i < n; i++) {
+		req.id = base + (uint32_t)i;
+		req.af = items[i].af;
+		if ((len = (ssize_t)strlen(items[i].name)) >= (ssize_t)sizeof(req.name))
+			return -1;
+		memcpy(req.name, items[i].name, (size_t)len + 1);
+		items[i].err = -1;
+		if (sendto(fd, &req, offsetof(dnspq_daemon_request, name) + len + 1,
+					0, (struct sockaddr *)&to, (socklen_t)tolen) < 0)
+		{
+			/* no daemon (ENOENT, ECONNREFUSED), or it can't keep up */
+			__atomic_store_n(&daemondown, daemon_now() + DAEMON_RETRY,
+					__ATOMIC_RELAXED);
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	/* the daemon answers failures too, but it may take all of the
+	 * pool's timeout to get to one */
+	deadline = now + DAEMON_TIMEOUT +
+		(opts != NULL && opts->timeout > 0 ? opts->timeout / 1000 : 0);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (left > 0) {
+		fromlen = sizeof(from);
+		len = recvfrom(fd, &rep, sizeof(rep), 0,
+				(struct sockaddr *)&from, &fromlen);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break;
+			if (now >= deadline ||
+					poll(&pfd, 1, (int)(deadline - now)) < 0)
+				break;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+			continue;
+		}
+		/* only the daemon gets to answer */
+		if (len != sizeof(rep) || rep.magic != DNSPQ_DAEMON_MAGIC ||
+				fromlen <= offsetof(struct sockaddr_un, sun_path) ||
+				strncmp(from.sun_path, to.sun_path,
+					sizeof(from.sun_path)) != 0 ||
+				rep.id - base >= n || items[rep.id - base].err != -1)
+			continue;
+		i = rep.id - base;
+		if (rep.err == -1)
+			return -1;  /* the daemon doesn't know this name */
+		items[i].err = (char)rep.err;
+		if (rep.err == NOERR) {
+			items[i].ans = rep.ans;
+			items[i].serverid = 0;
+		}
+		left--;
+	}
+	if (left > 0) {
+#ifdef LOGGING
+		syslog(LOG_INFO, "daemon at %s didn't answer, resolving directly",
+				path);
+#endif
+		__atomic_store_n(&daemondown, daemon_now() + DAEMON_RETRY,
+				__ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef DNSPQ_TOOL
+/* a client waiting for the answer to a question */
+typedef struct {
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	uint32_t id;
+} waiter;
+
+/* a question being resolved, on behalf of all clients that asked it */
+typedef struct _flight {
+	struct _flight *next;  /* in its bucket */
+	void *conf;  /* the config the servers were picked from */
+	int af;
+	size_t nwaiters;
+	size_t cap;
+	waiter *waiters;
+	char name[];
+} flight;
+
+static int daemonsockfd = -1;
+static flight *flights[DAEMON_BUCKETS];
+static volatile sig_atomic_t running = 1;
+static size_t stat_questions = 0;
+static size_t stat_coalesced = 0;
+static size_t stat_cached = 0;
+
+static inline uint32_t
+daemon_hash(const char *name, int af)
+{
+	uint32_t h = (2166136261U ^ (unsigned char)af) * 16777619U;
+
+	for (; *name != '\0'; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	return h;
+}
+
+static void
+daemon_reply(const waiter *w, char err, const dnspq_answer *ans)
+{
+	dnspq_daemon_reply rep;
+
+	memset(&rep, 0, sizeof(rep));
+	rep.magic = DNSPQ_DAEMON_MAGIC;
+	rep.id = w->id;
+	rep.err = err;
+	if (err == NOERR)
+		rep.ans = *ans;
+	/* a client that is gone, or not reading, doesn't hold us up */
+	sendto(daemonsockfd, &rep, sizeof(rep), MSG_DONTWAIT,
+			(const struct sockaddr *)&w->addr, w->addrlen);
+}
+
+static int
+daemon_wait(flight *f, const waiter *w)
+{
+	waiter *r;
+
+	if (f->nwaiters == f->cap) {
+		if ((r = realloc(f->waiters,
+						(f->cap == 0 ? 2 : f->cap * 2) * sizeof(*r))) == NULL)
+			return -1;
+		f->waiters = r;
+		f->cap = f->cap == 0 ? 2 : f->cap * 2;
+	}
+	f->waiters[f->nwaiters++] = *w;
+	return 0;
+}
+
+/* answers everyone waiting for f, and forgets about it */
+static void
+daemon_done(void *udata, const dnsq_item *item)
+{
+	flight *f = (flight *)udata;
+	flight **fp;
+	dnspq_answer ans;
+	char err = item->err;
+	size_t i;
+
+	if (err == NOERR)
+		ans = item->ans;
+	dnspq_nss_done(f->conf, f->name, f->af, &ans, err);
+	for (i = 0; i < f->nwaiters; i++)
+		daemon_reply(&f->waiters[i], err, &ans);
+
+	for (fp = &flights[daemon_hash(f->name, f->af) % DAEMON_BUCKETS];
+			*fp != f; fp = &(*fp)->next)
+		;
+	*fp = f->next;
+	free(f->waiters);
+	free(f);
+}
+
+/* handles a question from a client: answer it from the cache, or join
+ * the lookup of the same question in flight, or start one */
+static void
+daemon_question(dnspq_ctx *ctx, const dnspq_daemon_request *req,
+		const waiter *w)
+{
+	dnspq_server **dnsservers;
+	const dnspq_opts *opts;
+	dnspq_answer ans;
+	flight *f;
+	flight **b;
+	size_t len;
+	char err;
+
+	stat_questions++;
+	if (dnspq_nss_cached(req->name, req->af, &ans, &err)) {
+		stat_cached++;
+		daemon_reply(w, err, &ans);
+		return;
+	}
+
+	b = &flights[daemon_hash(req->name, req->af) % DAEMON_BUCKETS];
+	for (f = *b; f != NULL; f = f->next) {
+		if (f->af == req->af && strcmp(f->name, req->name) == 0) {
+			stat_coalesced++;
+			if (daemon_wait(f, w) != 0)
+				daemon_reply(w, -1, NULL);
+			return;
+		}
+	}
+
+	len = strlen(req->name);
+	if ((f = calloc(1, sizeof(*f) + len + 1)) == NULL) {
+		daemon_reply(w, -1, NULL);
+		return;
+	}
+	memcpy(f->name, req->name, len + 1);
+	f->af = req->af;
+	if ((f->conf = dnspq_nss_route(f->name, &dnsservers, &opts)) == NULL ||
+			daemon_wait(f, w) != 0 ||
+			dnspq_submit(ctx, dnsservers, opts, f->name, f->af,
+				daemon_done, f) < 0)
+	{
+		/* not ours to resolve, or too busy: the client does it */
+		dnspq_nss_done(f->conf, NULL, 0, NULL, 0);
+		free(f->waiters);
+		free(f);
+		daemon_reply(w, -1, NULL);
+		return;
+	}
+	f->next = *b;
+	*b = f;
+}
+
+/* reads and handles the questions that came in */
+static void
+daemon_read(dnspq_ctx *ctx)
+{
+	dnspq_daemon_request req;
+	waiter w;
+	ssize_t len;
+	int i;
+
+	/* don't let a flood of questions starve the replies from servers */
+	for (i = 0; i < 256; i++) {
+		w.addrlen = sizeof(w.addr);
+		if ((len = recvfrom(daemonsockfd, &req, sizeof(req), 0,
+						(struct sockaddr *)&w.addr, &w.addrlen)) < 0)
+			break;
+		if (len <= (ssize_t)offsetof(dnspq_daemon_request, name) ||
+				req.magic != DNSPQ_DAEMON_MAGIC ||
+				((char *)&req)[len - 1] != '\0' ||
+				(req.af != AF_INET && req.af != AF_INET6 &&
+				 req.af != AF_UNSPEC) ||
+				req.name[0] == '\0' || w.addrlen <= sizeof(sa_family_t))
+			continue;  /* garbage, or nowhere to send the answer */
+		w.id = req.id;
+		daemon_question(ctx, &req, &w);
+	}
+}
+
+static void
+daemon_stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+/* serves questions on a unix socket at path until interrupted */
+int
+dnspq_daemon_run(const char *path)
+{
+	struct sockaddr_un sun;
+	struct pollfd pfds[2];
+	dnspq_ctx *ctx;
+	int len;
+	int timeout;
+
+	if ((len = daemon_addr(path, &sun)) == -1) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return 1;
+	}
+	if ((ctx = dnspq_ctx_new(DAEMON_INFLIGHT)) == NULL ||
+			(daemonsockfd = socket(AF_UNIX,
+					SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+	{
+		fprintf(stderr, "failed to create sockets: %s\n", strerror(errno));
+		dnspq_ctx_free(ctx);
+		return 1;
+	}
+	/* a socket left behind by a previous run is in the way */
+	unlink(path);
+	if (bind(daemonsockfd, (struct sockaddr *)&sun, (socklen_t)len) != 0 ||
+			chmod(path, 0666) != 0)
+	{
+		fprintf(stderr, "failed to bind %s: %s\n", path, strerror(errno));
+		close(daemonsockfd);
+		dnspq_ctx_free(ctx);
+		return 1;
+	}
+
+	signal(SIGINT, daemon_stop);
+	signal(SIGTERM, daemon_stop);
+	signal(SIGPIPE, SIG_IGN);
+	printf("serving on %s\n", path);
+	fflush(stdout);
+
+	pfds[0].fd = daemonsockfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = dnspq_fd(ctx);
+	pfds[1].events = POLLIN;
+	while (running) {
+		timeout = dnspq_timeout(ctx);
+		if (poll(pfds, 2, timeout) < 0 && errno != EINTR)
+			break;
+		if (pfds[0].revents & POLLIN)
+			daemon_read(ctx);
+		dnspq_process(ctx);
+	}
+
+	printf("%zu questions, %zu answered from cache, %zu coalesced\n",
+			stat_questions, stat_cached, stat_coalesced);
+	unlink(path);
+	close(daemonsockfd);
+	dnspq_ctx_free(ctx);
+	return 0;
+}
+#endif
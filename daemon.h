@@ -0,0 +1,51 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSPQ_DAEMON_PATH
+#define DNSPQ_DAEMON_PATH "/run/dnspq.sock"
+#endif
+
+#define DNSPQ_DAEMON_MAGIC  0x64707164  /* "dpqd" */
+
+/* a question to the daemon, af is AF_UNSPEC for a PTR record */
+typedef struct {
+	uint32_t magic;
+	uint32_t id;
+	int32_t af;
+	char name[256];
+} dnspq_daemon_request;
+
+/* its answer, err is a dnspq_errno, or -1 when the daemon didn't
+ * resolve the name, and the client should do so itself */
+typedef struct {
+	uint32_t magic;
+	uint32_t id;
+	int32_t err;
+	dnspq_answer ans;
+} dnspq_daemon_reply;
+
+int dnspq_daemon_query(const char *path, const dnspq_opts *opts,
+		dnsq_item *items, size_t n);
+int dnspq_daemon_run(const char *path);
+
+/* the daemon's way into the pools and caches of nss-dnspq.c */
+void *dnspq_nss_route(const char *name,
+		dnspq_server ***dnsservers, const dnspq_opts **opts);
+int dnspq_nss_cached(const char *name, int af,
+		dnspq_answer *ans, char *err);
+void dnspq_nss_done(void *conf, const char *name, int af,
+		dnspq_answer *ans, char err);
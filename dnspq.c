@@ -15,6 +15,7 @@
  *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /* ppoll */
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -23,9 +24,15 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
@@ -35,6 +42,12 @@
 #endif
 
 #include "dnspq.h"
+#include "stats.h"
+#ifdef DNSPQ_TOOL
+#include <sys/stat.h>
+#include "config.h"
+#include "daemon.h"
+#endif
 
 /* http://www.freesoft.org/CIE/RFC/1035/40.htm */
 
@@ -67,9 +80,6 @@
 #define SET_ARCOUNT(buf, val) (*(uint16_t*)(buf+10) = htons(val))
 
 
-#ifndef MAXSERVERS
-# define MAXSERVERS  8
-#endif
 #ifndef MAX_RETRIES
 # define MAX_RETRIES  1
 #endif
@@ -79,47 +89,54 @@
 #ifndef RETRY_TIMEOUT
 # define RETRY_TIMEOUT  300 * 1000  /* 300ms, time to wait for answers */
 #endif
+#ifndef HEDGE_PROBE
+# define HEDGE_PROBE  32  /* in hedged mode, ask everyone every n queries */
+#endif
+#define HEDGE_MIN  100  /* usec, shortest wait for the best server */
+#ifndef EDNS_PAYLOAD
+# define EDNS_PAYLOAD  1232  /* UDP payload we advertise by default */
+#endif
+#ifndef EDNS_RETRY
+# define EDNS_RETRY  600  /* seconds before trying EDNS0 again with a
+                             server that answered it with a format error */
+#endif
+#ifndef EDNS_MAXPAYLOAD
+# define EDNS_MAXPAYLOAD  4096  /* largest UDP reply we take */
+#endif
+#define OPT_LEN  11  /* the OPT record for EDNS0 */
+#define RECV_BATCH  16  /* replies read at once */
+#ifndef ADAPTIVE_MIN
+# define ADAPTIVE_MIN  1000  /* usec, shortest adaptive retry timeout */
+#endif
+#define RTT_MAX  60 * 1000 * 1000  /* usec, cap on round trip samples */
+#ifndef MAX_CNAMES
+# define MAX_CNAMES  8  /* aliases followed within an answer */
+#endif
 
-typedef enum {
-	NOERR = 0,
-	NODATA = 1,
-	SENDFAIL = 2,
-	QTOOLONG = 3,
-	NOHDR = 4,
-	SOCKFAIL = 5,
-	INVALIDID = 7,
-	DNSNOQR = 8,
-	DNSNOSQ = 9,
-	DNSRFAIL = 10,
-	DNSFUTURE = 11,
-	DNSEMPTY = 12,
-	DNSNXDOMAIN = 13,
-	INCOMPLETE = 14,
-	DNSAINVALIDLEN = 15,
-	DNSNOA = 16,
-	DNSNOIN = 17
-} dnspq_errno;
+#if MAXSERVERS > 32
+# error "MAXSERVERS cannot exceed 32"
+#endif
 
 #if defined(LOGGING) || defined(DNSPQ_TOOL)
 static const char *dnspq_errcodes[] = {
-	/*  0 */ "Success",
-	/*  1 */ "No data received from server",
-	/*  2 */ "Input query too long (exceeds 255 characters)",
-	/*  3 */ "Failed to create socket",
-	/*  4 */ "Server sent incomplete data, expected header",
-	/*  5 */ "Failed to send data to server",
-	/*  6 */ NULL,
-	/*  7 */ "Server sent invalid ID (not matching our request)",
-	/*  8 */ "DNS answer is not a response message",
-	/*  9 */ "DNS answer is not a standard query",
-	/* 10 */ "DNS answer is: format error, server failure, not implemented, or refused",
-	/* 11 */ "DNS answer is: attempt to use future feature",
-	/* 12 */ "DNS answer doesn't have address answers",
-	/* 13 */ "DNS answer is: no such domain",
-	/* 14 */ "Received data is incomplete",
-	/* 15 */ "DNS answer has invalid length for IP response",
-	/* 16 */ "DNS answer isn't for type A",
-	/* 17 */ "DNS answer isn't for class IN"
+	[NOERR]          = "Success",
+	[NODATA]         = "No data received from server",
+	[SENDFAIL]       = "Failed to send data to server",
+	[QTOOLONG]       = "Input query too long (exceeds 255 characters)",
+	[NOHDR]          = "Server sent incomplete data, expected header",
+	[SOCKFAIL]       = "Failed to create socket",
+	[6]              = NULL,
+	[INVALIDID]      = "Server sent invalid ID (not matching our request)",
+	[DNSNOQR]        = "DNS answer is not a response message",
+	[DNSNOSQ]        = "DNS answer is not a standard query",
+	[DNSRFAIL]       = "DNS answer is: format error, server failure, not implemented, or refused",
+	[DNSFUTURE]      = "DNS answer is: attempt to use future feature",
+	[DNSEMPTY]       = "DNS answer doesn't have address answers",
+	[DNSNXDOMAIN]    = "DNS answer is: no such domain",
+	[INCOMPLETE]     = "Received data is incomplete",
+	[DNSAINVALIDLEN] = "DNS answer has invalid length for IP response",
+	[DNSNOA]         = "DNS answer isn't of the type asked for",
+	[DNSNOIN]        = "DNS answer isn't for class IN"
 };
 
 static const char *
@@ -129,46 +146,582 @@ dnspq_strerror(dnspq_errno err)
 }
 #endif
 
-static uint16_t cntr = 0;
+/* each thread keeps its own UDP socket open across queries, and
+ * numbers its queries from its own counter: IDs only need to be unique
+ * per socket, so threads never share (or contend for) this state */
+static __thread int udpfd = -1;
+static __thread uint16_t cntr = 0;
+static __thread unsigned char (*recvbufs)[EDNS_MAXPAYLOAD] = NULL;
+static pthread_key_t udpkey;
+static pthread_key_t recvkey;
+static pthread_once_t udponce = PTHREAD_ONCE_INIT;
 
-#define timediff(X, Y) \
-	(Y.tv_sec > X.tv_sec ? (Y.tv_sec - X.tv_sec) * 1000 * 1000 + ((Y.tv_usec - X.tv_usec)) : Y.tv_usec - X.tv_usec)
+static void
+udpsock_release(void *arg)
+{
+	/* thread exit, stored as fd + 1 because NULL means unset */
+	close((int)(intptr_t)arg - 1);
+}
 
-int dnsq(
-		struct sockaddr_in* const dnsservers[],
-		const char *a,
-		struct in_addr *ret,
-		unsigned int *ttl,
-		char *serverid)
+static void
+udpsock_atfork_child(void)
+{
+	/* don't share the socket with the parent, replies would end up
+	 * in either process */
+	if (udpfd != -1) {
+		close(udpfd);
+		udpfd = -1;
+		pthread_setspecific(udpkey, NULL);
+	}
+}
+
+static void
+udpsock_setup(void)
+{
+	pthread_key_create(&udpkey, udpsock_release);
+	pthread_key_create(&recvkey, free);
+	pthread_atfork(NULL, NULL, udpsock_atfork_child);
+}
+
+/* a random starting point for a range of IDs */
+static uint16_t
+random_id(void)
+{
+	uint16_t id;
+	struct timespec ts;
+
+	if (getrandom(&id, sizeof(id), GRND_NONBLOCK) == sizeof(id))
+		return id;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint16_t)(ts.tv_nsec ^ getpid() ^ (uintptr_t)&ts);
+}
+
+/* use IPv6 sockets, which reach IPv4 servers too (through v4-mapped
+ * addresses), cleared when the kernel doesn't do IPv6 */
+static int usev6 = 1;
+
+/* creates a non-blocking socket able to reach all servers */
+static int
+dnsq_socket(void)
 {
-	unsigned char dnspkg[512];
-	unsigned char *p = dnspkg;
-	char *ap;
-	size_t len;
-	int saddr_buf_len;
 	int fd;
-	struct timeval tv;
-	struct timeval begin, end;
+	int off = 0;
+
+	if (usev6) {
+		fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				IPPROTO_UDP);
+		if (fd != -1) {
+			if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+						&off, sizeof(off)) == 0)
+				return fd;
+			close(fd);
+			return -1;
+		}
+		if (errno != EAFNOSUPPORT)
+			return -1;
+		usev6 = 0;
+	}
+	return socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			IPPROTO_UDP);
+}
+
+/* sets to to the address of s, as to be used on our sockets, returns
+ * its length */
+static socklen_t
+dnsq_target(const dnspq_server *s, dnspq_sockaddr *to)
+{
+	if (s->addr.sa.sa_family == AF_INET6) {
+		to->sin6 = s->addr.sin6;
+		return sizeof(to->sin6);
+	}
+	if (!usev6) {
+		to->sin = s->addr.sin;
+		return sizeof(to->sin);
+	}
+	/* ::ffff:a.b.c.d */
+	memset(&to->sin6, 0, sizeof(to->sin6));
+	to->sin6.sin6_family = AF_INET6;
+	to->sin6.sin6_port = s->addr.sin.sin_port;
+	to->sin6.sin6_addr.s6_addr[10] = 0xff;
+	to->sin6.sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&to->sin6.sin6_addr.s6_addr[12], &s->addr.sin.sin_addr, 4);
+	return sizeof(to->sin6);
+}
+
+/* whether from, as received on our sockets, is the address of s */
+static int
+dnsq_from(const dnspq_sockaddr *from, const dnspq_server *s)
+{
+	if (s->addr.sa.sa_family == AF_INET6)
+		return from->sa.sa_family == AF_INET6 &&
+			from->sin6.sin6_port == s->addr.sin6.sin6_port &&
+			memcmp(&from->sin6.sin6_addr, &s->addr.sin6.sin6_addr,
+					sizeof(struct in6_addr)) == 0;
+	if (from->sa.sa_family == AF_INET)
+		return from->sin.sin_port == s->addr.sin.sin_port &&
+			from->sin.sin_addr.s_addr == s->addr.sin.sin_addr.s_addr;
+	return from->sa.sa_family == AF_INET6 &&
+		from->sin6.sin6_port == s->addr.sin.sin_port &&
+		IN6_IS_ADDR_V4MAPPED(&from->sin6.sin6_addr) &&
+		memcmp(&from->sin6.sin6_addr.s6_addr[12], &s->addr.sin.sin_addr,
+				4) == 0;
+}
+
+/* fills in srv from str, which is an IPv4 address, an IPv6 address, or
+ * either followed by :port, in which case an IPv6 address needs to be
+ * enclosed in brackets, e.g. [::1]:53, returns -1 if str is invalid */
+int
+dnspq_server_parse(dnspq_server *srv, char *str)
+{
+	char *port = NULL;
+	char *p;
+
+	memset(srv, 0, sizeof(*srv));
+	srv->health = 1024;
+	if (*str == '[') {
+		if ((p = strchr(++str, ']')) == NULL)
+			return -1;
+		*p++ = '\0';
+		if (*p == ':')
+			port = p + 1;
+		else if (*p != '\0')
+			return -1;
+	} else if ((p = strchr(str, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+		/* a single colon separates the port of an IPv4 address */
+		*p = '\0';
+		port = p + 1;
+	}
+
+	if (inet_pton(AF_INET, str, &srv->addr.sin.sin_addr) == 1) {
+		srv->addr.sin.sin_family = AF_INET;
+	} else if (inet_pton(AF_INET6, str, &srv->addr.sin6.sin6_addr) == 1) {
+		srv->addr.sin6.sin6_family = AF_INET6;
+	} else {
+		return -1;
+	}
+	/* sin_port and sin6_port live at the same offset */
+	srv->addr.sin.sin_port = htons(port == NULL || atoi(port) == 0 ?
+			53 : atoi(port));
+	return 0;
+}
+
+/* the socket of this thread, along with the buffers to read replies
+ * into, which are too big for the stack when EDNS0 is used */
+static inline int
+udpsock(void)
+{
+	if (udpfd == -1) {
+		pthread_once(&udponce, udpsock_setup);
+		udpfd = dnsq_socket();
+		if (udpfd != -1)
+			pthread_setspecific(udpkey, (void *)(intptr_t)(udpfd + 1));
+		cntr = random_id();
+	}
+	if (recvbufs == NULL) {
+		if ((recvbufs = malloc(sizeof(*recvbufs) * RECV_BATCH)) == NULL)
+			return -1;
+		pthread_setspecific(recvkey, recvbufs);
+	}
+	return udpfd;
+}
+
+/* use sendmmsg/recvmmsg, cleared when the kernel doesn't have them */
+static int usemmsg = 1;
+
+#ifdef DNSPQ_TOOL
+static size_t stat_syscalls = 0;
+static size_t stat_sent = 0;  /* query packets sent */
+static size_t stat_retries = 0;  /* rounds after the first */
+static size_t stat_stray = 0;  /* replies not matching a query in flight */
+# define COUNT(X)  __atomic_add_fetch(&(X), 1, __ATOMIC_RELAXED)
+# define SYSCALL(X)  (COUNT(stat_syscalls), (X))
+#else
+# define COUNT(X)
+# define SYSCALL(X)  (X)
+#endif
+
+#ifndef BATCH_SIZE
+# define BATCH_SIZE  256  /* names in flight at once in dnsq_batch() */
+#endif
+#ifndef TCP_CONNS
+# define TCP_CONNS  MAXSERVERS  /* TCP connections kept per thread */
+#endif
+#ifndef TCP_IDLE
+# define TCP_IDLE  10 * 1000 * 1000  /* usec, idle connections are closed */
+#endif
+#define TCP_MSGLEN  65535
+
+/* a TCP connection to a server, for answers that don't fit in a UDP
+ * reply, queries are pipelined on it, and it is kept open for the next
+ * lookups */
+typedef struct {
+	int fd;  /* -1 when closed */
+	uint32_t events;  /* as registered with epoll */
+	dnspq_sockaddr addr;  /* of the server */
+	size_t pending;  /* queries sent that weren't answered yet */
+	int64_t used;
+	unsigned char *out;  /* queries not written yet */
+	size_t outlen;
+	size_t outcap;
+	unsigned char *in;  /* TCP_MSGLEN + 2, answers read */
+	size_t inlen;
+	size_t inoff;  /* start of the next answer */
+} dnsq_conn;
+
+/* the connections of a thread, or an asynchronous context */
+typedef struct {
+	int epfd;  /* for a context, else -1 */
+	dnsq_conn conns[TCP_CONNS];
+} dnsq_tcp;
+
+/* state of a single name being resolved */
+typedef struct {
+	unsigned char query[512];
+	size_t len;  /* up to the end of the question */
+	size_t optlen;  /* of the OPT record following it, 0 without EDNS0 */
+	uint16_t edns;  /* UDP payload advertised, 0 without EDNS0 */
+	uint32_t noedns;  /* servers to ask without the OPT record */
+	dnspq_server* const *servers;
+	int nums;  /* servers in the set */
+	uint32_t sent;  /* servers sent to in the current round */
+	uint32_t replied;  /* servers that replied in the current round */
+	uint32_t usetcp;  /* servers asked over TCP, their answers are big */
+	dnsq_tcp *tcp;  /* connections to use, NULL for the thread's */
+	int retries;  /* rounds left after the current one */
+	int timeout;  /* usec, total time for the query */
+	int retrytimeout;  /* usec, longest time for a round */
+	int round;
+	char adaptive;
+	char hedge;
+	char done;
+	dnspq_errno err;
+	int64_t start;
+	int64_t deadline;  /* end of the current round */
+	int64_t hedgeat;  /* when to ask everyone, 0 when already done */
+	int64_t sentat[MAXSERVERS];
+	uint16_t id;  /* ID for the first server, i-th server gets id + i */
+	uint16_t qtype;  /* 1 (A), 28 (AAAA) or 12 (PTR) */
+	char serverid;
+	dnspq_answer ans;
+} dnsq_query;
+
+static inline int64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+static inline int32_t
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int32_t)ts.tv_sec;
+}
+
+/* feeds a round trip time sample into the estimates of s, following
+ * Jacobson/Karels (RFC 6298), concurrent updates may get lost, which
+ * is fine for an estimate */
+static void
+server_rtt(dnspq_server *s, int64_t rtt)
+{
+	int32_t srtt = __atomic_load_n(&s->srtt, __ATOMIC_RELAXED);
+	int32_t rttvar = __atomic_load_n(&s->rttvar, __ATOMIC_RELAXED);
+
+	if (rtt < 1)
+		rtt = 1;
+	else if (rtt > RTT_MAX)
+		rtt = RTT_MAX;
+	if (srtt == 0) {
+		srtt = (int32_t)rtt;
+		rttvar = (int32_t)rtt / 2;
+	} else {
+		rttvar += ((srtt > rtt ? srtt - rtt : rtt - srtt) - rttvar) / 4;
+		srtt += (rtt - srtt) / 8;
+		if (srtt < 1)
+			srtt = 1;
+	}
+	__atomic_store_n(&s->rttvar, rttvar, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->srtt, srtt, __ATOMIC_RELAXED);
+}
+
+/* moves the answer rate of s towards answering (ok) or failing */
+static void
+server_health(dnspq_server *s, int ok)
+{
+	int32_t h = __atomic_load_n(&s->health, __ATOMIC_RELAXED);
+
+	h += ok ? (1024 - h + 7) / 8 : -((h + 7) / 8);
+	__atomic_store_n(&s->health, h, __ATOMIC_RELAXED);
+}
+
+/* the time within which s answers about 95% of the queries */
+static inline int32_t
+server_p95(const dnspq_server *s)
+{
+	return __atomic_load_n(&s->srtt, __ATOMIC_RELAXED) +
+		2 * __atomic_load_n(&s->rttvar, __ATOMIC_RELAXED);
+}
+
+static __thread dnsq_tcp *threadtcp = NULL;
+static pthread_key_t tcpkey;
+static pthread_once_t tcponce = PTHREAD_ONCE_INIT;
+
+static dnsq_tcp *
+tcp_new(int epfd)
+{
+	dnsq_tcp *tcp;
 	int i;
-	int nums = 0;
-	uint16_t qid;
-	char retries = MAX_RETRIES;
-	suseconds_t maxtime = MAX_TIMEOUT;
-	suseconds_t waittime = 0;
-	dnspq_errno err = NOERR;
-
-	if (++cntr == 0)  /* next sequence number, start at 1 (detect errs)  */
-		cntr++;
-	if (USHRT_MAX - MAXSERVERS < cntr)  /* avoid having to deal with overflow */
-		cntr = 1;
+
+	if ((tcp = calloc(1, sizeof(*tcp))) == NULL)
+		return NULL;
+	tcp->epfd = epfd;
+	for (i = 0; i < TCP_CONNS; i++)
+		tcp->conns[i].fd = -1;
+	return tcp;
+}
+
+static void
+tcp_close(dnsq_conn *c)
+{
+	/* closing removes it from epoll too */
+	close(c->fd);
+	c->fd = -1;
+	c->events = 0;
+	c->pending = 0;
+	c->outlen = 0;
+	c->inlen = c->inoff = 0;
+}
+
+static void
+tcp_free(dnsq_tcp *tcp)
+{
+	int i;
+
+	if (tcp == NULL)
+		return;
+	for (i = 0; i < TCP_CONNS; i++) {
+		if (tcp->conns[i].fd != -1)
+			tcp_close(&tcp->conns[i]);
+		free(tcp->conns[i].out);
+		free(tcp->conns[i].in);
+	}
+	free(tcp);
+}
+
+static void
+tcp_release(void *arg)
+{
+	tcp_free((dnsq_tcp *)arg);
+}
+
+static void
+tcp_atfork_child(void)
+{
+	/* like the UDP socket, connections aren't shared with the parent */
+	if (threadtcp != NULL) {
+		tcp_free(threadtcp);
+		threadtcp = NULL;
+		pthread_setspecific(tcpkey, NULL);
+	}
+}
+
+static void
+tcp_setup(void)
+{
+	pthread_key_create(&tcpkey, tcp_release);
+	pthread_atfork(NULL, NULL, tcp_atfork_child);
+}
+
+/* the connections of this thread, set up when first needed, as most
+ * never need them */
+static dnsq_tcp *
+tcp_thread(void)
+{
+	if (threadtcp == NULL) {
+		pthread_once(&tcponce, tcp_setup);
+		if ((threadtcp = tcp_new(-1)) != NULL)
+			pthread_setspecific(tcpkey, threadtcp);
+	}
+	return threadtcp;
+}
+
+/* keeps epoll, if used, up to date with what c waits for */
+static void
+tcp_watch(dnsq_tcp *tcp, dnsq_conn *c)
+{
+	struct epoll_event ev;
+	uint32_t events = EPOLLIN | (c->outlen > 0 ? EPOLLOUT : 0);
+
+	if (tcp->epfd == -1 || c->events == events)
+		return;
+	ev.events = events;
+	ev.data.ptr = c;
+	if (SYSCALL(epoll_ctl(tcp->epfd, c->events == 0 ?
+					EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev)) == 0)
+		c->events = events;
+}
+
+/* whether a is a better connection to give up on than b: a closed
+ * one, else the one least waited for */
+static inline int
+tcp_victim(const dnsq_conn *a, const dnsq_conn *b)
+{
+	if ((a->fd == -1) != (b->fd == -1))
+		return a->fd == -1;
+	return a->pending < b->pending ||
+		(a->pending == b->pending && a->used < b->used);
+}
+
+/* returns the connection to s, opening one when there is none, or it
+ * was closed by the server, NULL when that fails */
+static dnsq_conn *
+tcp_conn(dnsq_tcp *tcp, const dnspq_server *s, int64_t now)
+{
+	dnsq_conn *c;
+	dnsq_conn *victim = NULL;
+	char b;
+	int on = 1;
+	int i;
+
+	for (i = 0; i < TCP_CONNS; i++) {
+		c = &tcp->conns[i];
+		if (c->fd != -1 && c->pending == 0 && c->outlen == 0) {
+			/* servers close idle connections, notice before we ask
+			 * anything, the answer would never come */
+			if (now - c->used > TCP_IDLE ||
+					SYSCALL(recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT)) != -1 ||
+					(errno != EAGAIN && errno != EWOULDBLOCK))
+				tcp_close(c);
+		}
+		if (c->fd != -1 && dnsq_from(&c->addr, s))
+			return c;
+		if (victim == NULL || tcp_victim(c, victim))
+			victim = c;
+	}
+
+	c = victim;
+	if (c->fd != -1)
+		tcp_close(c);
+	if (c->in == NULL && (c->in = malloc(TCP_MSGLEN + 2)) == NULL)
+		return NULL;
+	if ((c->fd = socket(s->addr.sa.sa_family,
+					SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		return NULL;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (SYSCALL(connect(c->fd, &s->addr.sa,
+					s->addr.sa.sa_family == AF_INET6 ?
+					sizeof(s->addr.sin6) : sizeof(s->addr.sin))) != 0 &&
+			errno != EINPROGRESS)
+	{
+		tcp_close(c);
+		return NULL;
+	}
+	c->addr = s->addr;
+	c->used = now;
+	return c;
+}
+
+/* writes what c has queued, returns -1 when the connection failed */
+static int
+tcp_flush(dnsq_tcp *tcp, dnsq_conn *c)
+{
+	ssize_t n;
+
+	while (c->outlen > 0) {
+		n = SYSCALL(send(c->fd, c->out, c->outlen,
+					MSG_DONTWAIT | MSG_NOSIGNAL));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+				break;  /* still connecting, or full */
+			tcp_close(c);
+			return -1;
+		}
+		c->outlen -= n;
+		memmove(c->out, c->out + n, c->outlen);
+	}
+	tcp_watch(tcp, c);
+	return 0;
+}
+
+/* returns the next answer read from c, which is valid until the next
+ * call, or NULL when there is none (yet) */
+static unsigned char *
+tcp_recv(dnsq_conn *c, int *len)
+{
+	unsigned char *p;
+	size_t mlen;
+	ssize_t n;
+
+	while (c->fd != -1) {
+		if (c->inlen - c->inoff >= 2) {
+			mlen = ID(c->in + c->inoff);
+			if (c->inlen - c->inoff >= 2 + mlen) {
+				p = c->in + c->inoff + 2;
+				c->inoff += 2 + mlen;
+				if (c->pending > 0)
+					c->pending--;
+				*len = (int)mlen;
+				return p;
+			}
+		}
+		if (c->inoff > 0) {
+			memmove(c->in, c->in + c->inoff, c->inlen - c->inoff);
+			c->inlen -= c->inoff;
+			c->inoff = 0;
+		}
+		n = SYSCALL(recv(c->fd, c->in + c->inlen,
+					TCP_MSGLEN + 2 - c->inlen, MSG_DONTWAIT));
+		if (n > 0) {
+			c->inlen += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				tcp_close(c);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* fills in the query packet for name */
+static dnspq_errno
+dnsq_build(dnsq_query *q, const char *a)
+{
+	unsigned char *p = q->query;
+	char *ap;
+	size_t len;
 
 	/* header */
+	memset(p, 0, 4); /* need zeros; macros below do or-ing due to bits */
+	/* SET_ID is done per server */
+	SET_QR(p, 0 /* query */);
+	SET_OPCODE(p, 0 /* standard query */);
+	SET_AA(p, 0);
+	SET_TC(p, 0);
+	SET_RD(p, 0);
+	SET_RA(p, 0);
+	SET_Z(p, 0);
+	SET_RCODE(p, 0);
+	SET_QDCOUNT(p, 1 /* one question */);
+	SET_ANCOUNT(p, 0);
+	SET_NSCOUNT(p, 0);
+	SET_ARCOUNT(p, 0);
 	p += 12;
 
 	/* question section */
+	if (strlen(a) > 253)  /* proto spec */
+		return QTOOLONG;
 	while ((ap = strchr(a, '.')) != NULL) {
 		len = ap - a;
-		if (len > 255)  /* proto spec */
+		if (len > 63)  /* proto spec */
 			return QTOOLONG;
 		*p++ = (unsigned char)len;
 		memcpy(p, a, len);
@@ -176,191 +729,1423 @@ int dnsq(
 		a = ap + 1;
 	}
 	len = strlen(a);
+	if (len > 63)
+		return QTOOLONG;
 	*p++ = len;
 	memcpy(p, a, len + 1);  /* always fits: 512 - 12 > 255 */
 	p += len + 1;  /* including the trailing null label */
-	SET_ID(p, 1 /* QTYPE == A */);
+	SET_ID(p, q->qtype);
 	p += 2;
 	SET_ID(p, 1 /* QCLASS == IN */);
 	p += 2;
 
-	/* answer sections not necessary */
-	len = p - dnspkg;
+	/* answer sections not necessary */
+	q->len = p - q->query;
+
+	/* but an OPT record, telling how big a reply we can take */
+	q->optlen = 0;
+	if (q->edns > 0) {
+		*p++ = 0;  /* root name */
+		SET_ID(p, 41 /* OPT */);
+		SET_ID(p + 2, q->edns);
+		memset(p + 4, 0, 6);  /* extended rcode, version, flags, rdlen */
+		SET_ARCOUNT(q->query, 1);
+		q->optlen = OPT_LEN;
+	}
+
+	return NOERR;
+}
+
+/* fills in the header of the query for the i-th server in hdr, and
+ * returns the length of its message, which is query with that header,
+ * and without the OPT record for servers that don't do EDNS0 */
+static inline size_t
+dnsq_header(const dnsq_query *q, int i, unsigned char *hdr)
+{
+	int edns = q->optlen > 0 && !(q->noedns & (1U << i));
+
+	memcpy(hdr, q->query, 12);
+	SET_ID(hdr, q->id + i);
+	SET_ARCOUNT(hdr, edns ? 1 : 0);
+	return q->len + (edns ? q->optlen : 0);
+}
+
+/* queues the query for the servers in mask on their TCP connections,
+ * returns the servers it could be sent to */
+static uint32_t
+dnsq_send_tcp(dnsq_query *q, uint32_t mask, int64_t now)
+{
+	dnsq_tcp *tcp = q->tcp != NULL ? q->tcp : tcp_thread();
+	dnsq_conn *c;
+	unsigned char *out;
+	unsigned char hdr[12];
+	uint32_t sent = 0;
+	size_t len;
+	size_t need;
+	int i;
+
+	if (tcp == NULL)
+		return 0;
+	for (i = 0; i < q->nums; i++) {
+		if (!(mask & (1U << i)) ||
+				(c = tcp_conn(tcp, q->servers[i], now)) == NULL)
+			continue;
+		/* each message is preceded by its length */
+		len = dnsq_header(q, i, hdr);
+		need = c->outlen + 2 + len;
+		if (need > c->outcap) {
+			if ((out = realloc(c->out, need)) == NULL)
+				continue;
+			c->out = out;
+			c->outcap = need;
+		}
+		out = c->out + c->outlen;
+		SET_ID(out, len);
+		memcpy(out + 2, hdr, sizeof(hdr));
+		memcpy(out + 2 + sizeof(hdr), q->query + sizeof(hdr),
+				len - sizeof(hdr));
+		c->outlen = need;
+		c->pending++;
+		c->used = now;
+		if (tcp_flush(tcp, c) == 0)
+			sent |= 1U << i;
+	}
+	return sent;
+}
+
+/* sends the query to the servers in mask, the i-th server with ID
+ * id + i, over TCP for those known to give big answers */
+static int
+dnsq_send(int fd, dnsq_query *q, uint32_t mask, int64_t now)
+{
+	struct mmsghdr msgs[MAXSERVERS];
+	struct iovec iovs[MAXSERVERS][2];
+	dnspq_sockaddr to[MAXSERVERS];
+	unsigned char hdrs[MAXSERVERS][12];
+	uint32_t tcpmask;
+	size_t len;
+	int i;
+	int k;
+	int n;
+
+	for (i = 0; i < q->nums; i++) {
+		if (mask & (1U << i)) {
+			q->sentat[i] = now;
+			COUNT(stat_sent);
+			DNSPQ_STATS_COUNT(q->servers[i], sent);
+		}
+	}
+	q->sent |= mask;
+
+	if ((mask & q->usetcp) != 0) {
+		tcpmask = dnsq_send_tcp(q, mask & q->usetcp, now);
+		/* make do with UDP for those we can't reach over TCP */
+		q->usetcp &= ~(mask & q->usetcp & ~tcpmask);
+		mask &= ~tcpmask;
+	}
+
+	if (usemmsg) {
+		/* the header (ID, and whether an OPT record follows) is the
+		 * only difference between the messages, so share the
+		 * remainder of the packet */
+		memset(msgs, 0, sizeof(msgs[0]) * q->nums);
+		for (i = 0, k = 0; i < q->nums; i++) {
+			if (!(mask & (1U << i)))
+				continue;
+			len = dnsq_header(q, i, hdrs[k]);
+			iovs[k][0].iov_base = hdrs[k];
+			iovs[k][0].iov_len = sizeof(hdrs[k]);
+			iovs[k][1].iov_base = q->query + sizeof(hdrs[k]);
+			iovs[k][1].iov_len = len - sizeof(hdrs[k]);
+			msgs[k].msg_hdr.msg_name = &to[k];
+			msgs[k].msg_hdr.msg_namelen = dnsq_target(q->servers[i], &to[k]);
+			msgs[k].msg_hdr.msg_iov = iovs[k];
+			msgs[k].msg_hdr.msg_iovlen = 2;
+			k++;
+		}
+		for (i = 0; i < k; i += n) {
+			if ((n = SYSCALL(sendmmsg(fd, msgs + i, k - i, 0))) <= 0) {
+				if (n < 0 && errno == ENOSYS && i == 0) {
+					usemmsg = 0;
+					break;
+				}
+				return -1;
+			}
+		}
+		if (usemmsg)
+			return 0;
+	}
+
+	for (i = 0; i < q->nums; i++) {
+		if (!(mask & (1U << i)))
+			continue;
+		len = dnsq_header(q, i, hdrs[0]);
+		memcpy(q->query, hdrs[0], sizeof(hdrs[0]));
+		if (SYSCALL(sendto(fd, q->query, len, 0, &to[0].sa,
+						dnsq_target(q->servers[i], &to[0]))) != (ssize_t)len)
+			return -1;
+	}
+	return 0;
+}
+
+/* reads as many pending replies as fit in msgs without blocking,
+ * returns how many were read, or -1 with errno set */
+static inline int
+dnsq_recv(int fd, struct mmsghdr *msgs, int n)
+{
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < n; i++)
+		msgs[i].msg_hdr.msg_namelen = sizeof(dnspq_sockaddr);
+	if (usemmsg)
+		return SYSCALL(recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL));
+
+	if ((len = SYSCALL(recvmsg(fd, &msgs[0].msg_hdr, MSG_DONTWAIT))) < 0)
+		return -1;
+	msgs[0].msg_len = (unsigned int)len;
+	return 1;
+}
+
+/* the time to give the servers of q to answer before retrying, based
+ * on the round trip times of those we know (RFC 6298), or the
+ * configured timeout when we don't know any */
+static int64_t
+dnsq_rto(const dnsq_query *q)
+{
+	int64_t rto = 0;
+	int64_t srto;
+	int32_t srtt;
+	int i;
+
+	if (!q->adaptive)
+		return q->retrytimeout;
+	for (i = 0; i < q->nums; i++) {
+		if ((srtt = __atomic_load_n(&q->servers[i]->srtt,
+						__ATOMIC_RELAXED)) == 0)
+			continue;
+		srto = srtt + 4 * (int64_t)__atomic_load_n(&q->servers[i]->rttvar,
+				__ATOMIC_RELAXED);
+		if (srto > rto)
+			rto = srto;
+	}
+	if (rto == 0 || rto > q->retrytimeout)
+		return q->retrytimeout;
+	return rto < ADAPTIVE_MIN ? ADAPTIVE_MIN : rto;
+}
+
+/* picks the server most likely to answer first, and sets delay to the
+ * time it takes to answer most queries, returns -1 when we don't know
+ * enough about all servers yet */
+static int
+dnsq_best(dnsq_query *q, int64_t *delay)
+{
+	dnspq_server *s;
+	int64_t score;
+	int64_t bestscore = 0;
+	int32_t health;
+	int best = -1;
+	int i;
+
+	for (i = 0; i < q->nums; i++) {
+		s = q->servers[i];
+		if (__atomic_load_n(&s->srtt, __ATOMIC_RELAXED) == 0)
+			return -1;  /* never measured, have everyone asked */
+		health = __atomic_load_n(&s->health, __ATOMIC_RELAXED);
+		score = (int64_t)server_p95(s) * 1024 / (health < 32 ? 32 : health);
+		if (best == -1 || score < bestscore) {
+			best = i;
+			bestscore = score;
+		}
+	}
+	*delay = server_p95(q->servers[best]);
+	if (*delay < HEDGE_MIN)
+		*delay = HEDGE_MIN;
+	return best;
+}
+
+/* sending to the servers in mask failed, which ends q */
+static void
+dnsq_sendfail(dnsq_query *q, uint32_t mask)
+{
+	int i;
+
+	for (i = 0; i < q->nums; i++)
+		if (mask & (1U << i))
+			DNSPQ_STATS_COUNT(q->servers[i], errors[SENDFAIL]);
+	q->err = SENDFAIL;  /* TODO: fail only when all fail? */
+	q->done = 1;
+}
+
+/* starts a (new) round for q: sends the query to all servers, or in
+ * hedged mode, to the best one only for its first round */
+static void
+dnsq_round_start(int fd, dnsq_query *q, int64_t now)
+{
+	uint32_t mask = (uint32_t)((1ULL << q->nums) - 1);
+	int64_t delay;
+	int best;
+	int i;
+
+	q->sent = q->replied = 0;
+	q->hedgeat = 0;
+	q->round++;
+	q->err = NODATA;
+	/* retries wait twice as long as the previous round did (back off),
+	 * but never longer than the configured retry timeout, in adaptive
+	 * mode the last round waits for whatever time is left, such that
+	 * a server that is merely slower than usual still gets its chance */
+	delay = dnsq_rto(q);
+	for (i = 1; i < q->round && delay < q->retrytimeout; i++)
+		delay *= 2;
+	if (delay > q->retrytimeout)
+		delay = q->retrytimeout;
+	q->deadline = now + delay;
+	if (q->deadline > q->start + q->timeout ||
+			(q->adaptive && q->retries == 0))
+		q->deadline = q->start + q->timeout;
+	if (q->hedge && q->round == 1 && q->nums > 1 &&
+			(q->id / MAXSERVERS) % HEDGE_PROBE != 0 &&
+			(best = dnsq_best(q, &delay)) >= 0 &&
+			now + delay < q->deadline)
+	{
+		mask = 1U << best;
+		q->hedgeat = now + delay;
+	}
+	if (dnsq_send(fd, q, mask, now) != 0)
+		dnsq_sendfail(q, mask);
+}
+
+/* hedged mode: the best server didn't answer in time, ask the rest */
+static void
+dnsq_fanout(int fd, dnsq_query *q, int64_t now)
+{
+	uint32_t mask = (uint32_t)((1ULL << q->nums) - 1) & ~q->sent;
+
+	q->hedgeat = 0;
+	if (dnsq_send(fd, q, mask, now) != 0)
+		dnsq_sendfail(q, mask);
+}
+
+/* whether err is an answer saying the name doesn't exist, or has no
+ * records of the type asked for, which asking again won't change */
+static inline int
+dnsq_negative(dnspq_errno err)
+{
+	return err == DNSNXDOMAIN || err == DNSEMPTY;
+}
+
+/* all servers answered, or we waited long enough: retry when there is
+ * time left, else q is done */
+static void
+dnsq_round_end(int fd, dnsq_query *q, int64_t now)
+{
+	int i;
+
+#if LOGGING > 2
+	syslog(LOG_INFO, "retrying due to error, code %d (%s), time spent: %zd, "
+			"time left: %zd, nums: %d, i: %d, retries: %d",
+			q->err, dnspq_strerror(q->err),
+			(ssize_t)(now - q->start),
+			(ssize_t)(q->start + q->timeout - now),
+			q->nums, __builtin_popcount(q->replied), q->retries);
+#endif
+	/* whoever didn't reply in time counts as failing */
+	for (i = 0; i < q->nums; i++) {
+		if ((q->sent & ~q->replied) & (1U << i)) {
+			server_health(q->servers[i], 0);
+			DNSPQ_STATS_COUNT(q->servers[i], errors[NODATA]);
+		}
+	}
+
+	if (!dnsq_negative(q->err) &&
+			q->retries-- > 0 &&
+			q->start + q->timeout - now > 0)
+	{
+		COUNT(stat_retries);
+		dnsq_round_start(fd, q, now);
+	} else {
+		q->done = 1;
+	}
+}
+
+/* the next moment q needs attention if no reply arrives */
+static inline int64_t
+dnsq_next(const dnsq_query *q)
+{
+	if (q->hedgeat != 0 && q->hedgeat < q->deadline)
+		return q->hedgeat;
+	return q->deadline;
+}
+
+/* handles the passing of the next moment of q */
+static void
+dnsq_timer(int fd, dnsq_query *q, int64_t now)
+{
+	if (q->hedgeat != 0 && q->hedgeat <= now) {
+		dnsq_fanout(fd, q, now);
+	} else if (q->deadline <= now) {
+		dnsq_round_end(fd, q, now);
+	}
+}
+
+/* expands the (compressed) name at p in the packet starting at pkt
+ * into out, in dotted notation, p must lie before end, but pointers
+ * may lead anywhere before end too, returns the position after the
+ * name at p, or NULL when it is malformed or doesn't fit out */
+static unsigned char *
+dnsq_expand(
+		unsigned char *pkt,
+		unsigned char *end,
+		unsigned char *p,
+		char *out,
+		size_t outlen)
+{
+	unsigned char *next = NULL;
+	size_t o = 0;
+	int hops = 0;
+
+	for (;;) {
+		if (p >= end)
+			return NULL;
+		if ((*p & 0xc0) == 0xc0) {
+			/* bounded hops stop pointer loops */
+			if (p + 1 >= end || ++hops > 64)
+				return NULL;
+			if (next == NULL)
+				next = p + 2;
+			p = pkt + (((*p & 0x3f) << 8) | p[1]);
+			continue;
+		}
+		if ((*p & 0xc0) != 0)
+			return NULL;  /* reserved label type */
+		if (*p == 0)
+			break;
+		if (p + 1 + *p > end || o + *p + 1 >= outlen)
+			return NULL;
+		memcpy(out + o, p + 1, *p);
+		o += *p;
+		out[o++] = '.';
+		p += 1 + *p;
+	}
+	if (o == 0) {
+		if (outlen < 2)
+			return NULL;
+		out[o++] = '.';  /* the root */
+	} else {
+		o--;  /* no trailing dot */
+	}
+	out[o] = '\0';
+
+	return next != NULL ? next : p + 1;
+}
+
+/* returns the position after the (compressed) name at p, or NULL when
+ * it runs past end, or uses a reserved label type */
+static inline unsigned char *
+dnsq_skip(unsigned char *p, const unsigned char *end)
+{
+	while (p < end) {
+		if (*p == 0)
+			return p + 1;
+		if ((*p & 0xc0) == 0xc0)
+			return p + 2 <= end ? p + 2 : NULL;
+		if ((*p & 0xc0) != 0)
+			return NULL;
+		p += 1 + *p;
+	}
+	return NULL;
+}
+
+static inline unsigned char
+dnsq_lower(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* follows the compression pointers at *p, if any, returns 0 when they
+ * lead past end, or too far */
+static inline int
+dnsq_follow(const unsigned char *pkt, const unsigned char *end,
+		const unsigned char **p, int *hops)
+{
+	while ((**p & 0xc0) == 0xc0) {
+		if (*p + 1 >= end || ++*hops > 64)
+			return 0;
+		*p = pkt + (((**p & 0x3f) << 8) | (*p)[1]);
+		if (*p >= end)
+			return 0;
+	}
+	return 1;
+}
+
+/* whether the (compressed) name at p ends before end, without looping */
+static int
+dnsq_validname(
+		const unsigned char *pkt,
+		const unsigned char *end,
+		const unsigned char *p)
+{
+	int hops = 0;
+
+	for (;;) {
+		if (p >= end || !dnsq_follow(pkt, end, &p, &hops) ||
+				(*p & 0xc0) != 0 || p + 1 + *p > end)
+			return 0;
+		if (*p == 0)
+			return 1;
+		p += 1 + *p;
+	}
+}
+
+/* whether the (compressed) names at a and b in the packet starting at
+ * pkt are the same, ignoring case, malformed names never match */
+static int
+dnsq_samename(
+		const unsigned char *pkt,
+		const unsigned char *end,
+		const unsigned char *a,
+		const unsigned char *b)
+{
+	int hops = 0;
+	int i;
+
+	for (;;) {
+		if (a >= end || b >= end ||
+				!dnsq_follow(pkt, end, &a, &hops) ||
+				!dnsq_follow(pkt, end, &b, &hops))
+			return 0;
+		if (a == b)
+			return 1;  /* the remainder is shared */
+		if ((*a & 0xc0) != 0 || *a != *b || a + 1 + *a > end ||
+				b + 1 + *b > end)
+			return 0;
+		if (*a == 0)
+			return 1;
+		for (i = 1; i <= *a; i++)
+			if (dnsq_lower(a[i]) != dnsq_lower(b[i]))
+				return 0;
+		a += 1 + *a;
+		b += 1 + *b;
+	}
+}
+
+/* checks the reply from a server and extracts the answer into q, in a
+ * single pass over the answer section: the records of the type asked
+ * for are taken from the name asked for, or the name it is an alias of
+ * (CNAME), following the chain as it goes, which servers put in order */
+static dnspq_errno
+dnsq_parse(dnsq_query *q, unsigned char *p, int saddr_buf_len)
+{
+	unsigned char *pkt = p;
+	unsigned char *end;
+	unsigned char *owner;
+	unsigned char *target;
+	uint16_t ancount;
+	uint16_t type;
+	uint16_t class;
+	uint16_t rdlen;
+	uint32_t ttl;
+	uint32_t chainttl = UINT32_MAX;
+	int cnames = 0;
+	dnspq_errno err = DNSNOA;
+
+	if (saddr_buf_len < 12)
+		return NOHDR;
+	if (QR(p) != 1)
+		return DNSNOQR; /* not a response */
+	if (OPCODE(p) != 0)
+		return DNSNOSQ; /* not a standard query */
+	switch (RCODE(p)) {
+		case 0: /* no error */
+			break;
+		case 1: /* format error */
+		case 2: /* server failure */
+		case 4: /* not implemented */
+		case 5: /* refused */
+			/* haproxy returns server failure for empty pools */
+#if LOGGING > 2
+			syslog(LOG_INFO, "serv fail: %d/%d, %x %x %x %x",
+					ID(p), __builtin_popcount(q->replied),
+					p[0], p[1], p[2], p[3]);
+#endif
+			return DNSRFAIL;
+		case 3:
+			/* NXDOMAIN */
+			return DNSNXDOMAIN;
+		default: /* reserved for future use */
+			return DNSFUTURE;
+	}
+	if ((ancount = ANCOUNT(p)) < 1)
+		return DNSEMPTY; /* we only support non-empty answers */
+
+	if (saddr_buf_len <= q->len || QDCOUNT(p) != 1)
+		return INCOMPLETE;
+
+	/* skip header + request, the request was checked to be ours */
+	end = p + saddr_buf_len;
+	target = p + 12;  /* the name asked for */
+	p += q->len;
+
+	q->ans.naddrs = 0;
+	for (; ancount > 0; ancount--) {
+		owner = p;
+		if ((p = dnsq_skip(p, end)) == NULL || p + 10 > end)
+			return INCOMPLETE;
+		type = ID(p);
+		class = ID(p + 2);
+		memcpy(&ttl, p + 4, sizeof(ttl));
+		ttl = ntohl(ttl);
+		rdlen = ID(p + 8);
+		p += 10;
+		if (p + rdlen > end)
+			return INCOMPLETE;
+		/* owners are mostly a pointer to the name itself, don't bother
+		 * comparing them label by label then */
+		if ((type != q->qtype && type != 5 /* CNAME */) ||
+				(((*owner & 0xc0) != 0xc0 ||
+				  pkt + (((*owner & 0x3f) << 8) | owner[1]) != target) &&
+				 !dnsq_samename(pkt, end, owner, target)))
+		{
+			p += rdlen;  /* not on the chain */
+			continue;
+		}
+		if (class != 1 /* IN */) {
+			err = DNSNOIN;
+		} else if (type == 5 /* CNAME */) {
+			/* the records we're after are those of the alias, which
+			 * must be a name, owners are matched against it by
+			 * their pointers */
+			if (dnsq_skip(p, p + rdlen) != p + rdlen ||
+					!dnsq_validname(pkt, end, p))
+				return DNSAINVALIDLEN;
+			if (q->ans.naddrs == 0) {
+				if (++cnames > MAX_CNAMES)
+					return DNSNOA;
+				target = p;
+				if (ttl < chainttl)
+					chainttl = ttl;
+			}
+		} else if (q->qtype == 12 /* PTR */) {
+			if (q->ans.naddrs == 0) {
+				/* the first name will do */
+				if (dnsq_expand(pkt, p + rdlen, p, q->ans.addrs.ptr,
+							sizeof(q->ans.addrs.ptr)) == NULL)
+					return DNSAINVALIDLEN;
+				q->ans.naddrs = 1;
+				q->ans.ttl = ttl;
+			}
+		} else if (rdlen != (q->qtype == 28 ? 16 : 4)) {
+			return DNSAINVALIDLEN;
+		} else if (q->ans.naddrs < DNSPQ_MAXADDRS) {
+			if (q->qtype == 28) {
+				memcpy(&q->ans.addrs.v6[q->ans.naddrs], p, 16);
+			} else {
+				memcpy(&q->ans.addrs.v4[q->ans.naddrs], p, 4);
+			}
+			if (q->ans.naddrs++ == 0 || ttl < q->ans.ttl)
+				q->ans.ttl = ttl;
+		}
+		p += rdlen;
+	}
+
+	if (q->ans.naddrs == 0)
+		/* an alias without the records asked for is NODATA of the
+		 * name it points to, which only a server can change */
+		return cnames > 0 && err == DNSNOA ? DNSEMPTY : err;
+	/* the answer is only valid as long as the aliases leading to it */
+	if (chainttl < q->ans.ttl)
+		q->ans.ttl = chainttl;
+	return NOERR;
+}
+
+/* matches a reply to one of the n queries in qs, the i-th query using
+ * the MAXSERVERS IDs starting at base + i * MAXSERVERS, and processes
+ * it, returns the query the reply was for, or NULL when ignored */
+static dnsq_query *
+dnsq_reply(
+		int fd,
+		dnsq_query *qs,
+		size_t n,
+		uint16_t base,
+		unsigned char *p,
+		int saddr_buf_len,
+		dnspq_sockaddr *sfrom,
+		int viatcp)
+{
+	dnsq_query *q;
+	dnspq_stats *stats;
+	uint32_t mask;
+	uint16_t off;
+	int64_t now;
+
+	if (saddr_buf_len < 12)  /* must have header */
+		return NULL;
+
+	/* find the query, and check the reply is from the server we
+	 * sent it to, and answers our question, else ignore it */
+	off = ID(p) - base;
+	if (off / MAXSERVERS >= n) {
+		COUNT(stat_stray);
+		return NULL;
+	}
+	q = &qs[off / MAXSERVERS];
+	off %= MAXSERVERS;
+	if (q->done || !(q->sent & ~q->replied & (1U << off)))
+		return NULL;  /* late, or another server already answered */
+	if (!dnsq_from(sfrom, q->servers[off]) ||
+			(saddr_buf_len >= q->len &&
+			 memcmp(p + 12, q->query + 12, q->len - 12) != 0))
+	{
+		COUNT(stat_stray);
+		return NULL;
+	}
+
+	now = now_usec();
+	if (TC(p) && !viatcp) {
+		/* the answer didn't fit, ask again over TCP, all servers that
+		 * didn't answer yet, they're bound to have the same answer */
+		if (!(q->usetcp & (1U << off))) {
+			mask = q->sent & ~q->replied & ~q->usetcp;
+			q->usetcp |= dnsq_send_tcp(q, mask, now);
+		}
+		if (q->usetcp & (1U << off))
+			return q;
+		/* no TCP to this server, make do with what fits */
+	}
+
+	if (RCODE(p) == 1 /* format error */ && q->optlen > 0 &&
+			!(q->noedns & (1U << off)))
+	{
+		/* the server doesn't do EDNS0 (RFC 6891), ask it again
+		 * without, and remember that for the next queries for a
+		 * while, the other servers keep getting it */
+		__atomic_store_n(&q->servers[off]->noedns, now_sec() + EDNS_RETRY,
+				__ATOMIC_RELAXED);
+		q->noedns |= 1U << off;
+		dnsq_send(fd, q, 1U << off, now);
+		return q;
+	}
+
+	q->replied |= 1U << off;
+	q->serverid = (char)off;
+	/* replies to retries are ambiguous (Karn), and those over TCP
+	 * include the UDP round trip, and the handshake */
+	if (q->round == 1 && !viatcp && !(q->usetcp & (1U << off)))
+		server_rtt(q->servers[off], now - q->sentat[off]);
+	q->err = dnsq_parse(q, p, saddr_buf_len);
+	server_health(q->servers[off],
+			q->err == NOERR || dnsq_negative(q->err));
+	if ((stats = q->servers[off]->stats) != NULL) {
+		dnspq_stats_rtt(stats, now - q->sentat[off]);
+		if (q->err < DNSPQ_STATS_ERRORS)
+			__atomic_fetch_add(&stats->errors[q->err], 1, __ATOMIC_RELAXED);
+	}
+	if (q->err == NOERR) {
+		DNSPQ_STATS_COUNT(q->servers[off], wins);
+		q->done = 1;
+		if (q->round == 1) {
+			/* we don't wait for the servers that lost, so we never learn
+			 * their round trip time, take it to be twice the winner's,
+			 * such that they are no longer deemed the fastest */
+			for (off = 0; off < q->nums; off++)
+				if ((q->sent & ~q->replied) & (1U << off))
+					server_rtt(q->servers[off], 2 * (now - q->sentat[off]));
+		}
+	} else if (q->hedgeat != 0 && !dnsq_negative(q->err)) {
+		/* the best server failed us, try the others */
+		dnsq_fanout(fd, q, now);
+	} else if (q->replied == q->sent) {
+		/* everyone answered, no use waiting any longer */
+		dnsq_round_end(fd, q, now);
+	}
+
+	return q;
+}
+
+/* sets up msgs to receive into the RECV_BATCH buffers of pkts */
+static void
+dnsq_recv_init(
+		struct mmsghdr *msgs,
+		struct iovec *iovs,
+		unsigned char (*pkts)[EDNS_MAXPAYLOAD],
+		dnspq_sockaddr *from)
+{
+	int i;
+
+	memset(msgs, 0, sizeof(*msgs) * RECV_BATCH);
+	for (i = 0; i < RECV_BATCH; i++) {
+		iovs[i].iov_base = pkts[i];
+		iovs[i].iov_len = sizeof(pkts[i]);
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/* fills pfds with the connections of tcp waiting for answers, or to
+ * write their queries, and conns with the connections, returns how many */
+static int
+dnsq_tcp_pollfds(dnsq_tcp *tcp, struct pollfd *pfds, dnsq_conn **conns)
+{
+	dnsq_conn *c;
+	int n = 0;
+	int i;
+
+	if (tcp == NULL)
+		return 0;
+	for (i = 0; i < TCP_CONNS; i++) {
+		c = &tcp->conns[i];
+		if (c->fd == -1 || (c->pending == 0 && c->outlen == 0))
+			continue;
+		pfds[n].fd = c->fd;
+		pfds[n].events = POLLIN | (c->outlen > 0 ? POLLOUT : 0);
+		pfds[n].revents = 0;
+		conns[n] = c;
+		n++;
+	}
+	return n;
+}
+
+/* writes the queries queued on c, and processes the answers read from
+ * it, for the n queries in qs, returns how many of them got done */
+static size_t
+dnsq_tcp_read(
+		int fd,
+		dnsq_tcp *tcp,
+		dnsq_conn *c,
+		dnsq_query *qs,
+		size_t n,
+		uint16_t base)
+{
+	dnsq_query *q;
+	unsigned char *p;
+	size_t done = 0;
+	int len;
+
+	if (c->outlen > 0 && tcp_flush(tcp, c) != 0)
+		return 0;
+	while ((p = tcp_recv(c, &len)) != NULL)
+		if ((q = dnsq_reply(fd, qs, n, base, p, len, &c->addr, 1)) != NULL &&
+				q->done)
+			done++;
+	return done;
+}
+
+/* resolves all n queries concurrently over fd, the i-th query uses
+ * the MAXSERVERS IDs starting at base + i * MAXSERVERS */
+static void
+dnsq_run(int fd, dnsq_query *qs, size_t n, uint16_t base)
+{
+	unsigned char (*dnspkg)[EDNS_MAXPAYLOAD] = recvbufs;
+	dnspq_sockaddr from[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct mmsghdr msgs[RECV_BATCH];
+	dnspq_sockaddr *sfrom;
+	struct pollfd pfds[1 + TCP_CONNS];
+	dnsq_conn *conns[1 + TCP_CONNS];
+	struct timespec ts;
+	dnsq_query *q;
+	unsigned char *p;
+	int saddr_buf_len;
+	int rcvd = 0;
+	int rcur = 0;
+	int ready;
+	int npfds;
+	int k;
+	size_t pending = 0;
+	size_t i;
+	int64_t now;
+	int64_t next;
+
+	dnsq_recv_init(msgs, iovs, dnspkg, from);
+
+	now = now_usec();
+	for (i = 0; i < n; i++) {
+		q = &qs[i];
+		if (q->done)
+			continue;
+		q->id = base + i * MAXSERVERS;
+		q->start = now;
+		dnsq_round_start(fd, q, now);
+		if (!q->done)
+			pending++;
+	}
+
+	ready = 0;  /* no use trying to read before anything arrived */
+	while (pending > 0) {
+		if (rcur == rcvd) {
+			if (!ready) {
+				now = now_usec();
+				next = INT64_MAX;
+				for (i = 0; i < n; i++)
+					if (!qs[i].done && dnsq_next(&qs[i]) < next)
+						next = dnsq_next(&qs[i]);
+				if (next > now) {
+					ts.tv_sec = (next - now) / (1000 * 1000);
+					ts.tv_nsec = ((next - now) % (1000 * 1000)) * 1000;
+					pfds[0].fd = fd;
+					pfds[0].events = POLLIN;
+					npfds = 1 + dnsq_tcp_pollfds(threadtcp, pfds + 1, conns + 1);
+					if ((ready = SYSCALL(ppoll(pfds, npfds, &ts, NULL))) < 0) {
+						ready = 0;
+						if (errno == EINTR)
+							continue;
+					}
+					if (ready > 0 && npfds > 1) {
+						/* answers over TCP */
+						for (k = 1; k < npfds; k++)
+							if (pfds[k].revents != 0)
+								pending -= dnsq_tcp_read(fd, threadtcp,
+										conns[k], qs, n, base);
+						if ((ready = pfds[0].revents != 0) == 0)
+							continue;
+					}
+				}
+				if (ready == 0) {
+					/* read timeout, retry sending for late queries */
+					now = now_usec();
+					for (i = 0; i < n; i++) {
+						q = &qs[i];
+						if (q->done || dnsq_next(q) > now)
+							continue;
+						dnsq_timer(fd, q, now);
+						if (q->done)
+							pending--;
+					}
+					continue;
+				}
+			}
+			rcur = 0;
+			if ((rcvd = dnsq_recv(fd, msgs, RECV_BATCH)) <= 0) {
+				rcvd = 0;
+				ready = 0;
+				continue;
+			}
+			if (usemmsg && rcvd < RECV_BATCH)
+				ready = 0;  /* drained, wait for more */
+		}
+		p = dnspkg[rcur];
+		saddr_buf_len = msgs[rcur].msg_len;
+		sfrom = &from[rcur];
+		if (msgs[rcur].msg_hdr.msg_flags & MSG_TRUNC)
+			SET_TC(p, 1);  /* cut short, as good as truncated */
+		rcur++;
+
+		if ((q = dnsq_reply(fd, qs, n, base, p, saddr_buf_len, sfrom, 0)) != NULL &&
+				q->done)
+			pending--;
+	}
+}
+
+/* reserves n blocks of MAXSERVERS IDs on this thread's socket, returns
+ * the first */
+static inline uint16_t
+dnsq_ids(size_t n)
+{
+	uint16_t base = cntr;
+
+	cntr += n * MAXSERVERS;
+	return base;
+}
+
+/* the question type to ask for addresses of family af */
+static inline uint16_t
+dnsq_qtype(int af)
+{
+	return af == AF_INET6 ? 28 /* AAAA */ :
+		af == AF_UNSPEC ? 12 /* PTR */ : 1 /* A */;
+}
+
+/* prepares q for resolving name to records of qtype against
+ * dnsservers */
+static inline void
+dnsq_init(
+		dnsq_query *q,
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *name,
+		uint16_t qtype)
+{
+	int32_t noedns;
+	int32_t now = 0;
+
+	q->noedns = 0;
+	for (q->nums = 0;
+			q->nums < MAXSERVERS && dnsservers[q->nums] != NULL;
+			q->nums++)
+	{
+		/* servers may have gained EDNS0 since they rejected it */
+		noedns = __atomic_load_n(&dnsservers[q->nums]->noedns,
+				__ATOMIC_RELAXED);
+		if (noedns != 0 && now == 0)
+			now = now_sec();
+		if (noedns != 0 && noedns - now > 0)
+			q->noedns |= 1U << q->nums;
+	}
+	q->servers = dnsservers;
+	q->hedge = opts != NULL && opts->hedge;
+	q->adaptive = opts != NULL && opts->adaptive;
+	q->retries = opts != NULL && opts->tries > 0 ?
+		opts->tries - 1 : MAX_RETRIES;
+	q->timeout = opts != NULL && opts->timeout > 0 ?
+		opts->timeout : MAX_TIMEOUT;
+	q->retrytimeout = opts != NULL && opts->retrytimeout > 0 ?
+		opts->retrytimeout : RETRY_TIMEOUT;
+	q->edns = opts != NULL && opts->edns != 0 ?
+		(opts->edns < 0 ? 0 : opts->edns < 512 ? 512 :
+		 opts->edns > EDNS_MAXPAYLOAD ? EDNS_MAXPAYLOAD : opts->edns) :
+		EDNS_PAYLOAD;
+	if (q->nums > 0 && q->noedns == (1U << q->nums) - 1)
+		q->edns = 0;  /* none of them would understand */
+	q->round = 0;
+	q->done = 0;
+	q->usetcp = 0;
+	q->tcp = NULL;
+	q->serverid = 0;
+	q->qtype = qtype;
+	q->ans.ttl = 0;
+	q->ans.af = qtype == 28 ? AF_INET6 : qtype == 1 ? AF_INET : AF_UNSPEC;
+	q->ans.naddrs = 0;
+	if ((q->err = dnsq_build(q, name)) != NOERR)
+		q->done = 1;
+}
+
+static int
+dnsq_resolve(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *a,
+		uint16_t qtype,
+		dnspq_answer *ret,
+		char *serverid)
+{
+	dnsq_query q;
+	int fd;
+
+	dnsq_init(&q, dnsservers, opts, a, qtype);
+	if (q.done)
+		return q.err;
+	if ((fd = udpsock()) == -1)
+		return SOCKFAIL;
+
+	dnsq_run(fd, &q, 1, dnsq_ids(1));
+
+#ifdef LOGGING
+	if (q.err != NOERR)
+		syslog(LOG_INFO, "error while resolving %s, code %d (%s)",
+				a, q.err, dnspq_strerror(q.err));
+#endif
+	if (q.err == NOERR) {
+		*ret = q.ans;
+		*serverid = q.serverid;
+	}
+
+	return (char)q.err;
+}
+
+int dnsq(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *a,
+		int af,
+		dnspq_answer *ret,
+		char *serverid)
+{
+	return dnsq_resolve(dnsservers, opts, a, dnsq_qtype(af), ret, serverid);
+}
+
+/* resolves the PTR record for arpa, as made by dnspq_arpa(), the name
+ * ends up in ret->addrs.ptr */
+int dnsq_ptr(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *arpa,
+		dnspq_answer *ret,
+		char *serverid)
+{
+	return dnsq_resolve(dnsservers, opts, arpa, 12 /* PTR */,
+			ret, serverid);
+}
+
+/* writes the name to look up addr with in the reverse tree into buf,
+ * e.g. 4.3.2.1.in-addr.arpa for 1.2.3.4, returns -1 if it doesn't fit
+ * or af is unknown */
+int
+dnspq_arpa(int af, const void *addr, char *buf, size_t len)
+{
+	const unsigned char *a = addr;
+	size_t o = 0;
+	int i;
+
+	if (af == AF_INET) {
+		if (snprintf(buf, len, "%u.%u.%u.%u.in-addr.arpa",
+					a[3], a[2], a[1], a[0]) >= (int)len)
+			return -1;
+		return 0;
+	} else if (af != AF_INET6) {
+		return -1;
+	}
+
+	/* nibbles, least significant first */
+	if (len < 16 * 4 + sizeof("ip6.arpa"))
+		return -1;
+	for (i = 15; i >= 0; i--) {
+		buf[o++] = "0123456789abcdef"[a[i] & 0x0f];
+		buf[o++] = '.';
+		buf[o++] = "0123456789abcdef"[a[i] >> 4];
+		buf[o++] = '.';
+	}
+	memcpy(buf + o, "ip6.arpa", sizeof("ip6.arpa"));
+	return 0;
+}
+
+int dnsq_batch(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		dnsq_item *items,
+		size_t n)
+{
+	dnsq_query *qs;
+	size_t chunk;
+	size_t i;
+	size_t j;
+	int fd;
+	int ok = 0;
+
+	if ((qs = malloc(sizeof(*qs) * (n < BATCH_SIZE ? n : BATCH_SIZE))) == NULL ||
+			(fd = udpsock()) == -1)
+	{
+		free(qs);
+		for (i = 0; i < n; i++)
+			items[i].err = SOCKFAIL;
+		return 0;
+	}
+
+	/* keep the number of names in flight bounded, such that the
+	 * replies don't overflow the socket's receive buffer */
+	for (i = 0; i < n; i += chunk) {
+		chunk = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		for (j = 0; j < chunk; j++)
+			dnsq_init(&qs[j], dnsservers, opts,
+					items[i + j].name, dnsq_qtype(items[i + j].af));
+		dnsq_run(fd, qs, chunk, dnsq_ids(chunk));
+		for (j = 0; j < chunk; j++) {
+			items[i + j].err = qs[j].err;
+			if (qs[j].err != NOERR) {
+#ifdef LOGGING
+				syslog(LOG_INFO, "error while resolving %s, code %d (%s)",
+						items[i + j].name, qs[j].err,
+						dnspq_strerror(qs[j].err));
+#endif
+				continue;
+			}
+			items[i + j].ans = qs[j].ans;
+			items[i + j].serverid = qs[j].serverid;
+			ok++;
+		}
+	}
+	free(qs);
+
+	return ok;
+}
+
+/* asynchronous interface, for use in event loops: the caller polls the
+ * context's descriptor, and calls dnspq_process() when it is readable
+ * or the deadline returned by dnspq_timeout() has passed, the
+ * descriptor is an epoll instance watching the UDP socket and the TCP
+ * connections of the context */
+struct _dnspq_ctx {
+	int fd;
+	int epfd;
+	dnsq_tcp *tcp;
+	unsigned char (*pkts)[EDNS_MAXPAYLOAD];  /* RECV_BATCH buffers */
+	uint16_t *blocks;  /* slot + 1 using each block of IDs, 0 if none */
+	uint16_t rnd[32];  /* random numbers to draw blocks from */
+	size_t nrnd;
+	size_t cap;
+	size_t inflight;
+	size_t hiwater;  /* slots beyond this one are unused */
+	dnsq_query *qs;
+	struct {
+		dnspq_callback cb;
+		void *udata;
+		char *name;
+	} *owners;
+};
+
+dnspq_ctx *
+dnspq_ctx_new(size_t maxqueries)
+{
+	dnspq_ctx *ctx;
+	struct epoll_event ev;
+	size_t i;
+
+	/* each query needs its own block of IDs */
+	if (maxqueries == 0 || maxqueries > (USHRT_MAX + 1) / MAXSERVERS)
+		maxqueries = (USHRT_MAX + 1) / MAXSERVERS;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+	ctx->cap = maxqueries;
+	ctx->qs = malloc(sizeof(*ctx->qs) * ctx->cap);
+	ctx->owners = calloc(ctx->cap, sizeof(*ctx->owners));
+	ctx->fd = dnsq_socket();
+	ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+	ctx->tcp = tcp_new(ctx->epfd);
+	ctx->pkts = malloc(sizeof(*ctx->pkts) * RECV_BATCH);
+	ctx->blocks = calloc((USHRT_MAX + 1) / MAXSERVERS, sizeof(*ctx->blocks));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;  /* the UDP socket */
+	if (ctx->qs == NULL || ctx->owners == NULL || ctx->fd == -1 ||
+			ctx->epfd == -1 || ctx->tcp == NULL || ctx->pkts == NULL ||
+			ctx->blocks == NULL ||
+			epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->fd, &ev) != 0)
+	{
+		dnspq_ctx_free(ctx);
+		return NULL;
+	}
+	for (i = 0; i < ctx->cap; i++)
+		ctx->qs[i].done = 1;
+
+	return ctx;
+}
+
+void
+dnspq_ctx_free(dnspq_ctx *ctx)
+{
+	size_t i;
+
+	if (ctx == NULL)
+		return;
+	if (ctx->owners != NULL)
+		for (i = 0; i < ctx->hiwater; i++)
+			free(ctx->owners[i].name);
+	if (ctx->fd != -1)
+		close(ctx->fd);
+	tcp_free(ctx->tcp);
+	if (ctx->epfd != -1)
+		close(ctx->epfd);
+	free(ctx->pkts);
+	free(ctx->blocks);
+	free(ctx->qs);
+	free(ctx->owners);
+	free(ctx);
+}
+
+int
+dnspq_fd(const dnspq_ctx *ctx)
+{
+	return ctx->epfd;
+}
+
+/* gives slot k a block of IDs of its own, drawn at random for each use
+ * of the slot, such that its IDs can't be guessed from the slot or the
+ * previous query, there always is a free block, since there are no more
+ * slots than blocks */
+static void
+dnspq_ctx_draw(dnspq_ctx *ctx, size_t k)
+{
+	size_t nblocks = (USHRT_MAX + 1) / MAXSERVERS;
+	size_t b;
+	size_t i;
+
+	if (ctx->nrnd == 0) {
+		if (getrandom(ctx->rnd, sizeof(ctx->rnd), GRND_NONBLOCK) !=
+				sizeof(ctx->rnd))
+			for (i = 0; i < sizeof(ctx->rnd) / sizeof(ctx->rnd[0]); i++)
+				ctx->rnd[i] = random_id();
+		ctx->nrnd = sizeof(ctx->rnd) / sizeof(ctx->rnd[0]);
+	}
+	b = ctx->rnd[--ctx->nrnd] % nblocks;
+	while (ctx->blocks[b] != 0)
+		b = (b + 1) % nblocks;
+	ctx->blocks[b] = (uint16_t)(k + 1);
+	ctx->qs[k].id = (uint16_t)(b * MAXSERVERS);
+}
+
+/* frees slot k, and its block of IDs, replies still coming in for it
+ * are strays from then on */
+static void
+dnspq_ctx_release(dnspq_ctx *ctx, size_t k)
+{
+	ctx->qs[k].done = 1;
+	ctx->blocks[ctx->qs[k].id / MAXSERVERS] = 0;
+	ctx->owners[k].cb = NULL;
+	ctx->owners[k].name = NULL;
+	ctx->inflight--;
+	while (ctx->hiwater > 0 && ctx->owners[ctx->hiwater - 1].cb == NULL)
+		ctx->hiwater--;
+}
+
+/* processes a reply for the slot using the block of IDs it is for,
+ * returns the query it was for, or NULL when ignored */
+static dnsq_query *
+dnspq_ctx_reply(
+		dnspq_ctx *ctx,
+		unsigned char *p,
+		int len,
+		dnspq_sockaddr *from,
+		int viatcp)
+{
+	dnsq_query *q;
+	size_t k;
+
+	if (len < 12)  /* must have header */
+		return NULL;
+	if ((k = ctx->blocks[ID(p) / MAXSERVERS]) == 0) {
+		COUNT(stat_stray);
+		return NULL;
+	}
+	q = &ctx->qs[k - 1];
+	return dnsq_reply(ctx->fd, q, 1, q->id, p, len, from, viatcp);
+}
+
+/* releases slot k, and reports its outcome to its owner */
+static void
+dnspq_complete(dnspq_ctx *ctx, size_t k)
+{
+	dnsq_query *q = &ctx->qs[k];
+	dnspq_callback cb = ctx->owners[k].cb;
+	void *udata = ctx->owners[k].udata;
+	dnsq_item item;
+
+	item.name = ctx->owners[k].name;
+	item.af = q->ans.af;
+	item.err = q->err;
+	item.ans = q->ans;
+	item.serverid = q->serverid;
+
+	/* free the slot first, the callback may want to submit */
+	dnspq_ctx_release(ctx, k);
 
-	tv.tv_sec = 0;
-	gettimeofday(&begin, NULL);
-	end.tv_sec = begin.tv_sec;
-	end.tv_usec = begin.tv_usec;
-	do {
-		p = dnspkg;
-		memset(p, 0, 4); /* need zeros; macros below do or-ing due to bits */
-		/* SET_ID is done per server */
-		SET_QR(p, 0 /* query */);
-		SET_OPCODE(p, 0 /* standard query */);
-		SET_AA(p, 0);
-		SET_TC(p, 0);
-		SET_RD(p, 0);
-		SET_RA(p, 0);
-		SET_Z(p, 0);
-		SET_RCODE(p, 0);
-		SET_QDCOUNT(p, 1 /* one question */);
-		SET_ANCOUNT(p, 0);
-		SET_NSCOUNT(p, 0);
-		SET_ARCOUNT(p, 0);
-
-		if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
-			return SOCKFAIL;
-
-		/* wait at most half of RETRY_TIMOUT */
-		tv.tv_usec = maxtime - timediff(begin, end);
-		if (tv.tv_usec > RETRY_TIMEOUT / 2)
-			tv.tv_usec = RETRY_TIMEOUT / 2;
-		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-		for (i = 0; i < MAXSERVERS && dnsservers[i] != NULL; i++) {
-			SET_ID(p, cntr + i);
-			if (sendto(fd, dnspkg, len, 0,
-						(struct sockaddr *)dnsservers[i],
-						sizeof(*dnsservers[i])) != len) {
-				close(fd);
-				return SENDFAIL;  /* TODO: fail only when all fail? */
-			}
-		}
+	cb(udata, &item);
+	free((char *)item.name);
+}
 
-		/* this can be off by RETRY_TIMOUT / 2 * i, but saves us a
-		 * gettimeofday() call */
-		waittime = timediff(begin, end) + RETRY_TIMEOUT;
-		if (waittime > maxtime)
-			waittime = maxtime;
-		nums = i;
-		i = 0;
-		do {
-			gettimeofday(&end, NULL);
-			tv.tv_usec = waittime - timediff(begin, end);
-			if (tv.tv_usec <= 0)
-				break;
-			(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-			saddr_buf_len = recvfrom(fd, dnspkg, sizeof(dnspkg),
-					0, NULL, NULL);
-
-			if (saddr_buf_len < 0) {
-				err = NODATA;
-				if (errno == EINTR)
-					continue;
-				break;  /* read timeout, retry sending */
-			} else if (saddr_buf_len < 12) { /* must have header */
-				err = NOHDR;
-				continue;
-			}
+int
+dnspq_submit(
+		dnspq_ctx *ctx,
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *name,
+		int af,
+		dnspq_callback cb,
+		void *udata)
+{
+	dnsq_query *q;
+	size_t k;
 
-			p = dnspkg;
-			qid = ID(p);
-			if (qid < cntr || qid > cntr + nums) {
-				err = INVALIDID; /* message not matching our request id */
-				continue;
-			}
-			/* ID matches, assume from a server we sent to */
-			i++;
-			*serverid = qid - cntr;
-			if (QR(p) != 1) {
-				err = DNSNOQR; /* not a response */
-				continue;
-			}
-			if (OPCODE(p) != 0) {
-				err = DNSNOSQ; /* not a standard query */
-				continue;
-			}
-			switch (RCODE(p)) {
-				case 0: /* no error */
-					break;
-				case 1: /* format error */
-				case 2: /* server failure */
-				case 4: /* not implemented */
-				case 5: /* refused */
-					/* haproxy returns server failure for empty pools */
-#if LOGGING > 2
-					syslog(LOG_INFO, "serv fail: %d/%d, %x %x %x %x",
-							qid, i, p[0], p[1], p[2], p[3]);
-#endif
-					err = DNSRFAIL;
-					continue;
-				case 3:
-					/* NXDOMAIN */
-					err = DNSNXDOMAIN;
-					continue;
-				default: /* reserved for future use */
-					err = DNSFUTURE;
-					continue;
-			}
-			if (ANCOUNT(p) < 1) {
-				err = DNSEMPTY; /* we only support non-empty answers */
-				continue;
-			}
+	if (ctx->inflight == ctx->cap || cb == NULL)
+		return -1;
+	for (k = 0; ctx->owners[k].cb != NULL; k++)
+		;
+	q = &ctx->qs[k];
+	dnsq_init(q, dnsservers, opts, name, dnsq_qtype(af));
+	if ((ctx->owners[k].name = strdup(name)) == NULL)
+		return -1;
+	ctx->owners[k].cb = cb;
+	ctx->owners[k].udata = udata;
+	ctx->inflight++;
+	if (k >= ctx->hiwater)
+		ctx->hiwater = k + 1;
+	dnspq_ctx_draw(ctx, k);
 
-			if (saddr_buf_len <= len) {
-				err = INCOMPLETE;
-				continue;
-			}
+	q->tcp = ctx->tcp;
+	if (!q->done) {
+		q->start = now_usec();
+		dnsq_round_start(ctx->fd, q, q->start);
+	}
+	if (q->done)  /* failed straight away, report from dnspq_process() */
+		q->deadline = 0;
 
-			/* skip header + request */
-			p += len;
+	return (int)k;
+}
 
-			if ((*p | 3 << 6) == 3 << 6) {
-				/* compression pointer, skip two octets */
-				p += 2;
-			} else {
-				/* read labels */
-				while (*p != 0)
-					p += 1 + *p;
-				p++;
-			}
-			if (ID(p) != 1 /* QTYPE == A */) {
-				err = DNSNOA;
-				continue;
-			}
-			p += 2;
-			if (ID(p) != 1 /* QCLASS == IN */) {
-				err = DNSNOIN;
-				continue;
-			}
-			p += 2;
-			*ttl = ntohs(*(uint32_t*)p);
-			p += 4;
-			if (ID(p) != 4) {
-				err = DNSAINVALIDLEN;
-				continue;
-			}
-			p += 2;
+void
+dnspq_cancel(dnspq_ctx *ctx, int handle)
+{
+	size_t k = (size_t)handle;
+
+	if (handle < 0 || k >= ctx->hiwater || ctx->owners[k].cb == NULL)
+		return;
+	free(ctx->owners[k].name);
+	dnspq_ctx_release(ctx, k);
+}
+
+int
+dnspq_timeout(const dnspq_ctx *ctx)
+{
+	int64_t next = -1;
+	int64_t now;
+	size_t k;
+
+	for (k = 0; k < ctx->hiwater; k++)
+		if (ctx->owners[k].cb != NULL &&
+				(next == -1 || dnsq_next(&ctx->qs[k]) < next))
+			next = dnsq_next(&ctx->qs[k]);
+	if (next == -1)
+		return -1;
+	now = now_usec();
+	if (next <= now)
+		return 0;
+	return (int)((next - now + 999) / 1000);  /* round up to ms */
+}
 
-			err = NOERR;
-			memcpy(ret, p, 4);
+size_t
+dnspq_process(dnspq_ctx *ctx)
+{
+	unsigned char (*dnspkg)[EDNS_MAXPAYLOAD] = ctx->pkts;
+	dnspq_sockaddr from[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct mmsghdr msgs[RECV_BATCH];
+	dnsq_query *q;
+	dnsq_conn *c;
+	unsigned char *p;
+	int len;
+	int rcvd;
+	int i;
+	size_t k;
+	int64_t now;
 
+	dnsq_recv_init(msgs, iovs, dnspkg, from);
+	do {
+		if ((rcvd = dnsq_recv(ctx->fd, msgs, RECV_BATCH)) <= 0)
 			break;
-		} while (err != NOERR && i < nums);
-#if LOGGING > 2
-		if (err != NOERR) {
-			gettimeofday(&end, NULL);
-			syslog(LOG_INFO, "retrying due to error, code %d (%s), time spent: %zd, time left: %zd, nums: %d, i: %d, retries: %d, tv: %zd %zd, %zd %zd",
-					err, dnspq_strerror(err),
-					timediff(begin, end), maxtime - timediff(begin, end),
-					nums, i, retries,
-					begin.tv_sec, begin.tv_usec,
-					end.tv_sec, end.tv_usec);
+		for (i = 0; i < rcvd; i++) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				SET_TC(dnspkg[i], 1);
+			q = dnspq_ctx_reply(ctx, dnspkg[i], msgs[i].msg_len,
+					&from[i], 0);
+			if (q != NULL && q->done)
+				dnspq_complete(ctx, q - ctx->qs);
 		}
-#endif
-		close(fd);
-	} while (err != NOERR && err != DNSNXDOMAIN &&
-	 		retries-- > 0 &&
-			gettimeofday(&end, NULL) == 0 &&
-			maxtime - timediff(begin, end) > 0);
+	} while (usemmsg ? rcvd == RECV_BATCH : rcvd > 0);
 
-#ifdef LOGGING
-	if (err != NOERR)
-		syslog(LOG_INFO, "error while resolving %s, code %d (%s)",
-				a, err, dnspq_strerror(err));
-#endif
+	/* epoll is level triggered, so just look at all connections */
+	for (i = 0; i < TCP_CONNS; i++) {
+		c = &ctx->tcp->conns[i];
+		if (c->fd == -1 || (c->outlen > 0 && tcp_flush(ctx->tcp, c) != 0))
+			continue;
+		while ((p = tcp_recv(c, &len)) != NULL) {
+			q = dnspq_ctx_reply(ctx, p, len, &c->addr, 1);
+			if (q != NULL && q->done)
+				dnspq_complete(ctx, q - ctx->qs);
+		}
+	}
+
+	now = now_usec();
+	for (k = 0; k < ctx->hiwater; k++) {
+		q = &ctx->qs[k];
+		if (ctx->owners[k].cb == NULL || dnsq_next(q) > now)
+			continue;
+		if (!q->done)
+			dnsq_timer(ctx->fd, q, now);
+		if (q->done)
+			dnspq_complete(ctx, k);
+	}
 
-	return (char)err;
+	return ctx->inflight;
 }
 
 static void
@@ -378,25 +2163,420 @@ do_usage(void)
 	printf("options:\n");
 	printf("  -v                  print version\n");
 	printf("  -h                  this screen\n");
-	printf("  -s <server[:port]>  server to query, multiple -s options are allowed\n");
+	printf("  -s <server[:port]>  server to query, multiple -s options are allowed,\n");
+	printf("                      IPv6 servers with a port go like [::1]:53\n");
+	printf("  -b <count>          resolve each name count times, both with and\n");
+	printf("                      without sendmmsg/recvmmsg, and report syscalls\n");
+	printf("                      and latency\n");
+	printf("  -t <threads>        with -b, run the benchmark from this many\n");
+	printf("                      threads at once, and report retries and\n");
+	printf("                      stray replies\n");
+	printf("  -H                  hedged mode: ask the fastest server first, and\n");
+	printf("                      the others only when it doesn't answer in time\n");
+	printf("  -A                  adaptive mode: retry after a timeout derived\n");
+	printf("                      from the observed round trip times\n");
+	printf("  -T <ms>             total time to wait for an answer (%d)\n",
+			MAX_TIMEOUT / 1000);
+	printf("  -R <ms>             (longest) time to wait before retrying (%d)\n",
+			RETRY_TIMEOUT / 1000);
+	printf("  -r <count>          number of retries (%d)\n", MAX_RETRIES);
+	printf("  -E <bytes>          UDP payload to advertise with EDNS0 (%d),\n",
+			EDNS_PAYLOAD);
+	printf("                      0 to not use EDNS0\n");
+	printf("  -6                  query for IPv6 addresses (AAAA records)\n");
+	printf("  -x                  reverse lookup: arguments are addresses to\n");
+	printf("                      find the name (PTR record) for\n");
+	printf("  -c <image>          compile the config file given as argument\n");
+	printf("                      (%s) into a binary image for the\n",
+			RESOLV_CONF);
+	printf("                      nss module to map, usually %s\n",
+			RESOLV_CONF_IMAGE);
+	printf("  -S                  show the statistics the nss module keeps for\n");
+	printf("                      each server, from the file given as argument,\n");
+	printf("                      or the one configured in %s\n",
+			RESOLV_CONF);
+	printf("  -D                  run as daemon resolving for all processes on\n");
+	printf("                      the host using the nss module, on the socket\n");
+	printf("                      given as argument, or the one configured in\n");
+	printf("                      %s\n", RESOLV_CONF);
 	printf("all further arguments (or those after --) are being queried against\n");
 	printf("the servers given, at least one server must be supplied\n");
 }
 
-int main(int argc, char *argv[]) {
-	struct in_addr ip;
-	unsigned int ttl;
+/* formats the address of srv as ip:port or [ip6]:port */
+static const char *
+print_server(const dnspq_server *srv, char *buf, size_t len)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (srv->addr.sa.sa_family == AF_INET6) {
+		inet_ntop(AF_INET6, &srv->addr.sin6.sin6_addr, ip, sizeof(ip));
+		snprintf(buf, len, "[%s]:%d", ip, ntohs(srv->addr.sin6.sin6_port));
+	} else {
+		inet_ntop(AF_INET, &srv->addr.sin.sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%d", ip, ntohs(srv->addr.sin.sin_port));
+	}
+	return buf;
+}
+
+/* prints what was learnt about each server */
+static void
+print_servers(dnspq_server* const dnsservers[])
+{
+	char buf[INET6_ADDRSTRLEN + 8];
+	int i;
+
+	for (i = 0; dnsservers[i] != NULL; i++)
+		printf("  server %d: %21s srtt %8dus, p95 %8dus, "
+				"health %5.1f%%\n",
+				i, print_server(dnsservers[i], buf, sizeof(buf)),
+				dnsservers[i]->srtt, server_p95(dnsservers[i]),
+				dnsservers[i]->health * 100.0 / 1024);
+}
+
+static void
+do_bench(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *name,
+		int af,
+		int count)
+{
+	dnspq_answer ans;
+	char serverid;
+	struct timespec start, stop;
+	double lat;
+	double total;
+	double min;
+	double max;
+	size_t fails;
+	int mmsg;
+	int i;
+
+	for (mmsg = 1; mmsg >= 0; mmsg--) {
+		usemmsg = mmsg;
+		stat_syscalls = stat_sent = 0;
+		total = max = 0.0;
+		min = -1.0;
+		fails = 0;
+		for (i = 0; i < count; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (dnsq(dnsservers, opts, name, af,
+						&ans, &serverid) != NOERR)
+				fails++;
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+			lat = (stop.tv_sec - start.tv_sec) * 1000000.0 +
+				(stop.tv_nsec - start.tv_nsec) / 1000.0;
+			total += lat;
+			if (min < 0 || lat < min)
+				min = lat;
+			if (lat > max)
+				max = lat;
+		}
+		printf("%-8s %6.2f syscalls/query, %5.2f packets/query, "
+				"latency avg %8.1fus, min %8.1fus, max %8.1fus, "
+				"%zu failed  %s\n",
+				mmsg ? "mmsg" : "sendto",
+				(double)stat_syscalls / count, (double)stat_sent / count,
+				total / count, min, max,
+				fails, name);
+	}
+	print_servers(dnsservers);
+}
+
+/* turns the config file src into an image at dst, replacing dst at
+ * once, such that processes having the old one mapped don't notice */
+static int
+do_compile(const char *src, const char *dst)
+{
+	dnspq_image *img;
+	FILE *f;
+	char *tmp;
+	size_t len;
+	int fd;
+
+	if ((f = fopen(src, "r")) == NULL) {
+		fprintf(stderr, "failed to open %s: %s\n", src, strerror(errno));
+		return 1;
+	}
+	img = dnspq_image_read(f);
+	fclose(f);
+	if (img == NULL) {
+		fprintf(stderr, "failed to compile %s\n", src);
+		return 1;
+	}
+
+	len = strlen(dst) + sizeof(".XXXXXX");
+	if ((tmp = malloc(len)) == NULL) {
+		free(img);
+		return 1;
+	}
+	snprintf(tmp, len, "%s.XXXXXX", dst);
+	if ((fd = mkstemp(tmp)) == -1 ||
+			fchmod(fd, 0644) != 0 ||
+			write(fd, img, img->size) != (ssize_t)img->size ||
+			fsync(fd) != 0 ||
+			close(fd) != 0 ||
+			rename(tmp, dst) != 0)
+	{
+		fprintf(stderr, "failed to write %s: %s\n", dst, strerror(errno));
+		if (fd != -1)
+			unlink(tmp);
+		free(tmp);
+		free(img);
+		return 1;
+	}
+	printf("%s: %u pools, %u groups, %u servers, %u bytes\n",
+			dst, img->npools, img->ngroups, img->nservers, img->size);
+
+	free(tmp);
+	free(img);
+	return 0;
+}
+
+/* formats a time in usec */
+static const char *
+print_usec(uint64_t usec, char *buf, size_t len)
+{
+	if (usec >= 1000000) {
+		snprintf(buf, len, "%.1fs", usec / 1000000.0);
+	} else if (usec >= 1000) {
+		snprintf(buf, len, "%llums", (unsigned long long)usec / 1000);
+	} else {
+		snprintf(buf, len, "%lluus", (unsigned long long)usec);
+	}
+	return buf;
+}
+
+/* the round trip time below which fraction f of the replies of s came,
+ * as the upper bound of the bucket it falls in, formatted */
+static const char *
+print_quantile(const dnspq_stats *s, double f, char *buf, size_t len)
+{
+	uint64_t n = 0;
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < DNSPQ_STATS_BUCKETS; b++)
+		n += s->rtt[b];
+	if (n == 0) {
+		snprintf(buf, len, "-");
+		return buf;
+	}
+	for (b = 0; b < DNSPQ_STATS_BUCKETS - 1; b++)
+		if ((seen += s->rtt[b]) >= n * f)
+			break;
+	buf[0] = '<';
+	print_usec(2ULL << b, buf + 1, len - 1);
+	return buf;
+}
+
+/* reads the config file, for the paths configured in it */
+static dnspq_image *
+read_config(void)
+{
+	dnspq_image *img;
+	FILE *f;
+
+	if ((f = fopen(RESOLV_CONF, "r")) == NULL)
+		return NULL;
+	img = dnspq_image_read(f);
+	fclose(f);
+	return img;
+}
+
+/* dumps the counters of all servers in the statistics file path, or
+ * the one configured in the config file when path is NULL, queries
+ * are either answered (with an error or not), lost (another server
+ * answered first, so the reply wasn't waited for), or timed out */
+static int
+do_stats(const char *path)
+{
+	const dnspq_stats_segment *seg;
+	const dnspq_stats *s;
+	dnspq_image *img = NULL;
+	dnspq_server srv;
+	char buf[INET6_ADDRSTRLEN + 8];
+	char p50[16];
+	char p99[16];
+	uint64_t replies;
+	uint64_t missed;
+	double sent;
+	uint32_t i;
+	int e;
+	int b;
+
+	if (path == NULL && (img = read_config()) != NULL &&
+			img->stats != DNSPQ_IMAGE_NONE)
+		path = (const char *)img + img->names + img->stats;
+	if (path == NULL)
+		path = DNSPQ_STATS_PATH;
+	if ((seg = dnspq_stats_map(path)) == NULL) {
+		fprintf(stderr, "no statistics in %s\n", path);
+		free(img);
+		return 1;
+	}
+
+	for (i = 0; i < seg->nslots; i++) {
+		s = &seg->slots[i];
+		if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != 2)
+			continue;
+		for (replies = 0, e = 0; e < DNSPQ_STATS_ERRORS; e++)
+			if (e != NODATA && e != SENDFAIL)
+				replies += s->errors[e];
+		missed = s->errors[NODATA] + s->errors[SENDFAIL];
+		sent = s->sent == 0 ? 1.0 : (double)s->sent;
+		srv.addr = s->addr;
+		printf("%-24s sent %10llu, won %5.1f%%, answered %5.1f%%, "
+				"lost %5.1f%%, timed out %5.1f%%, rtt p50 %s, p99 %s\n",
+				print_server(&srv, buf, sizeof(buf)),
+				(unsigned long long)s->sent,
+				s->wins * 100.0 / sent,
+				replies * 100.0 / sent,
+				(replies + missed > s->sent ? 0 :
+				 s->sent - replies - missed) * 100.0 / sent,
+				s->errors[NODATA] * 100.0 / sent,
+				print_quantile(s, 0.5, p50, sizeof(p50)),
+				print_quantile(s, 0.99, p99, sizeof(p99)));
+		for (e = 0; e < DNSPQ_STATS_ERRORS; e++)
+			if (e != NOERR && e != NODATA && s->errors[e] != 0)
+				printf("  %10llu  %s\n", (unsigned long long)s->errors[e],
+						dnspq_strerror((dnspq_errno)e));
+		printf("  rtt");
+		for (b = 0; b < DNSPQ_STATS_BUCKETS; b++)
+			if (s->rtt[b] != 0)
+				printf(" <%s:%llu",
+						print_usec(2ULL << b, p50, sizeof(p50)),
+						(unsigned long long)s->rtt[b]);
+		printf("\n");
+	}
+
+	free(img);
+	return 0;
+}
+
+/* runs the daemon on the socket at path, or the one configured */
+static int
+do_daemon(const char *path)
+{
+	dnspq_image *img = NULL;
+	int ret;
+
+	if (path == NULL && (img = read_config()) != NULL &&
+			img->daemon != DNSPQ_IMAGE_NONE)
+		path = (const char *)img + img->names + img->daemon;
+	if (path == NULL)
+		path = DNSPQ_DAEMON_PATH;
+	ret = dnspq_daemon_run(path);
+	free(img);
+	return ret;
+}
+
+typedef struct {
+	dnspq_server* const *dnsservers;
+	const dnspq_opts *opts;
+	const char *name;
+	int af;
+	int count;
+	size_t fails;
+} stress_arg;
+
+static void *
+stress_thread(void *arg)
+{
+	stress_arg *sa = (stress_arg *)arg;
+	dnspq_answer ans;
 	char serverid;
+	int i;
+
+	for (i = 0; i < sa->count; i++)
+		if (dnsq(sa->dnsservers, sa->opts,
+					sa->name, sa->af, &ans, &serverid) != NOERR)
+			sa->fails++;
+	return NULL;
+}
+
+static void
+do_stress(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *name,
+		int af,
+		int count,
+		int threads)
+{
+	pthread_t *tids;
+	stress_arg *args;
+	struct timespec start, stop;
+	double secs;
+	size_t fails = 0;
+	size_t queries = (size_t)count * threads;
+	int i;
+
+	tids = malloc(sizeof(*tids) * threads);
+	args = malloc(sizeof(*args) * threads);
+	if (tids == NULL || args == NULL) {
+		fprintf(stderr, "out of memory\n");
+		free(tids);
+		free(args);
+		return;
+	}
+
+	stat_retries = stat_stray = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++) {
+		args[i].dnsservers = dnsservers;
+		args[i].opts = opts;
+		args[i].name = name;
+		args[i].af = af;
+		args[i].count = count;
+		args[i].fails = 0;
+		pthread_create(&tids[i], NULL, stress_thread, &args[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		fails += args[i].fails;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	secs = (stop.tv_sec - start.tv_sec) +
+		(stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	printf("%d threads: %8.0f queries/s, %6.4f retries/query, "
+			"%zu stray replies, %zu failed  %s\n",
+			threads, queries / secs, (double)stat_retries / queries,
+			stat_stray, fails, name);
+	print_servers(dnsservers);
+
+	free(tids);
+	free(args);
+}
+
+int main(int argc, char *argv[]) {
+	dnsq_item *items;
+	dnsq_item *item;
 	dnspq_errno err;
 	int ret;
 	char *p;
-	char *q;
 	char *r;
 	int i;
 	int a;
-	struct sockaddr_in *dnsservers[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	struct sockaddr_in *dnsserver;
+	unsigned int j;
+	dnspq_server *dnsservers[MAXSERVERS + 1] = { 0 };
+	char ip[INET6_ADDRSTRLEN];
+	char srv[INET6_ADDRSTRLEN + 8];
+	char arpa[80];
+	unsigned char buf[sizeof(struct in6_addr)];
+	dnspq_answer ans;
+	char serverid;
+	int reverse = 0;
+	int af = AF_INET;
+	dnspq_opts opts = { 0 };
 	int dnsi = 0;
+	int bench = 0;
+	int threads = 1;
+	char *image = NULL;
+	int stats = 0;
+	int daemon = 0;
 
 	if (argc == 1) {
 		do_version();
@@ -414,33 +2594,120 @@ int main(int argc, char *argv[]) {
 					/* -s: server */
 					if (*++p == '\0')
 						p = argv[++i];
-					if (dnsi == sizeof(dnsservers) - 1) {
+					if (dnsi == MAXSERVERS) {
 						fprintf(stderr, "not adding server '%s', "
-								"too many already (%zu)\n",
-								p, sizeof(dnsservers) - 1);
+								"too many already (%d)\n",
+								p, MAXSERVERS);
 						break;
 					}
-					r = NULL;
-					for (q = p; *q != '\0'; q++) {
-						if (*q == ':') {
-							*q = '\0';
-							r = q + 1;
-						}
-					}
-
-					dnsserver = dnsservers[dnsi++] = malloc(sizeof(*dnsserver));
-					dnsserver->sin_family = AF_INET;
-					if (inet_pton(dnsserver->sin_family, p,
-								&(dnsserver->sin_addr)) <= 0)
+					dnsservers[dnsi] = malloc(sizeof(*dnsservers[dnsi]));
+					if (dnsservers[dnsi] == NULL ||
+							dnspq_server_parse(dnsservers[dnsi], p) != 0)
 					{
 						fprintf(stderr, "failed to parse IP address '%s'\n", p);
 						return 1;
 					}
-					if (r != NULL) {
-						dnsserver->sin_port = htons(atoi(r));
+					dnsi++;
+					a = i + 1;
+					break;
+				case '6':
+					/* -6: AAAA */
+					af = AF_INET6;
+					a = i + 1;
+					break;
+				case 'x':
+					/* -x: PTR */
+					reverse = 1;
+					a = i + 1;
+					break;
+				case 'b':
+					/* -b: benchmark */
+					if (*++p == '\0')
+						p = argv[++i];
+					if (p == NULL || (bench = atoi(p)) <= 0) {
+						fprintf(stderr, "-b needs a positive count\n");
+						return 1;
+					}
+					a = i + 1;
+					break;
+				case 't':
+					/* -t: threads */
+					if (*++p == '\0')
+						p = argv[++i];
+					if (p == NULL || (threads = atoi(p)) <= 0) {
+						fprintf(stderr, "-t needs a positive count\n");
+						return 1;
+					}
+					a = i + 1;
+					break;
+				case 'H':
+					/* -H: hedged mode */
+					opts.hedge = 1;
+					a = i + 1;
+					break;
+				case 'A':
+					/* -A: adaptive timeouts */
+					opts.adaptive = 1;
+					a = i + 1;
+					break;
+				case 'T':
+				case 'R':
+					/* -T/-R: timeouts */
+					r = p;
+					if (*++p == '\0')
+						p = argv[++i];
+					if (p == NULL || atof(p) <= 0) {
+						fprintf(stderr, "-%c needs a positive time in ms\n", *r);
+						return 1;
+					}
+					if (*r == 'T') {
+						opts.timeout = (int)(atof(p) * 1000);
 					} else {
-						dnsserver->sin_port = htons(53);
+						opts.retrytimeout = (int)(atof(p) * 1000);
+					}
+					a = i + 1;
+					break;
+				case 'r':
+					/* -r: retries */
+					if (*++p == '\0')
+						p = argv[++i];
+					if (p == NULL || atoi(p) < 0) {
+						fprintf(stderr, "-r needs a count\n");
+						return 1;
+					}
+					opts.tries = atoi(p) + 1;
+					a = i + 1;
+					break;
+				case 'E':
+					/* -E: EDNS0 payload */
+					if (*++p == '\0')
+						p = argv[++i];
+					if (p == NULL || atoi(p) < 0) {
+						fprintf(stderr, "-E needs a size in bytes\n");
+						return 1;
+					}
+					opts.edns = atoi(p) > 0 ? atoi(p) : -1;
+					a = i + 1;
+					break;
+				case 'c':
+					/* -c: compile config */
+					if (*++p == '\0')
+						p = argv[++i];
+					if (p == NULL) {
+						fprintf(stderr, "-c needs a file to write to\n");
+						return 1;
 					}
+					image = p;
+					a = i + 1;
+					break;
+				case 'S':
+					/* -S: statistics */
+					stats = 1;
+					a = i + 1;
+					break;
+				case 'D':
+					/* -D: daemon */
+					daemon = 1;
 					a = i + 1;
 					break;
 				case 'v':
@@ -467,27 +2734,288 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (image != NULL)
+		return do_compile(a < argc ? argv[a] : RESOLV_CONF, image);
+	if (stats)
+		return do_stats(a < argc ? argv[a] : NULL);
+	if (daemon)
+		return do_daemon(a < argc ? argv[a] : NULL);
+
 	if (dnsi == 0) {
 		do_usage();
 		return 1;
 	}
 
+	if (bench > 0) {
+		for (i = a; i < argc; i++) {
+			if (threads > 1) {
+				do_stress(dnsservers, &opts, argv[i], af, bench, threads);
+			} else {
+				do_bench(dnsservers, &opts, argv[i], af, bench);
+			}
+		}
+		return 0;
+	}
+
+	if (reverse) {
+		ret = 0;
+		for (i = a; i < argc; i++) {
+			af = strchr(argv[i], ':') != NULL ? AF_INET6 : AF_INET;
+			if (inet_pton(af, argv[i], buf) != 1 ||
+					dnspq_arpa(af, buf, arpa, sizeof(arpa)) != 0)
+			{
+				printf("failed to parse address %s\n", argv[i]);
+				ret = 1;
+			} else if ((err = dnsq_ptr(dnsservers, &opts, arpa,
+							&ans, &serverid)) != NOERR)
+			{
+				printf("failed to resolve %s: %s\n",
+						arpa, dnspq_strerror(err));
+				ret = 1;
+			} else {
+				printf("%s (TTL: %us, responder %d: %21s)  %s\n",
+						ans.addrs.ptr, ans.ttl, serverid,
+						print_server(dnsservers[(int)serverid],
+							srv, sizeof(srv)),
+						argv[i]);
+			}
+		}
+		return ret;
+	}
+
+	/* resolve all names at once, costs about a single round trip */
+	if (a >= argc)
+		return 0;
+	if ((items = malloc(sizeof(*items) * (argc - a))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = a; i < argc; i++) {
+		items[i - a].name = argv[i];
+		items[i - a].af = af;
+	}
+	dnsq_batch(dnsservers, &opts, items, argc - a);
+
 	ret = 0;
 	for (i = a; i < argc; i++) {
-		if ((err = (dnspq_errno)dnsq(dnsservers, argv[i], &ip, &ttl, &serverid)) == NOERR) {
-			printf("%-15s (TTL: %us, ",
-					inet_ntoa(ip), ttl);
-			dnsserver = dnsservers[(int)serverid];
-			printf("responder %d: %15s:%d)  %s\n",
-					serverid,
-					inet_ntoa(dnsserver->sin_addr),
-					ntohs(dnsserver->sin_port),
-					argv[i]);
+		item = &items[i - a];
+		if ((err = (dnspq_errno)item->err) == NOERR) {
+			for (j = 0; j < item->ans.naddrs; j++) {
+				inet_ntop(item->ans.af, item->ans.af == AF_INET6 ?
+						(void *)&item->ans.addrs.v6[j] :
+						(void *)&item->ans.addrs.v4[j], ip, sizeof(ip));
+				if (j > 0) {
+					printf("%s\n", ip);
+					continue;
+				}
+				printf("%-15s (TTL: %us, responder %d: %21s)  %s\n",
+						ip, item->ans.ttl, item->serverid,
+						print_server(dnsservers[(int)item->serverid],
+							srv, sizeof(srv)),
+						argv[i]);
+			}
 		} else {
 			printf("failed to resolve %s: %s\n", argv[i], dnspq_strerror(err));
 			ret = 1;
 		}
 	}
+	free(items);
 	return ret;
 }
 #endif
+
+#ifdef DNSPQ_CHECK
+/* parses pkt, of len bytes, as the answer to the question for name, for
+ * the checks in check.c, which feed it malformed answers */
+int
+dnsq_parse_check(
+		const char *name,
+		int af,
+		unsigned char *pkt,
+		int len,
+		dnspq_answer *ans)
+{
+	dnsq_query q;
+	dnspq_errno err;
+
+	memset(&q, 0, sizeof(q));
+	q.qtype = dnsq_qtype(af);
+	if ((err = dnsq_build(&q, name)) != NOERR)
+		return err;
+	err = dnsq_parse(&q, pkt, len);
+	*ans = q.ans;
+	return err;
+}
+#endif
+
+#ifdef PARSEBENCH
+/* measures dnsq_parse() on a few typical answers, and on mangled copies
+ * of them, which exercise the paths rejecting malformed packets */
+
+typedef struct {
+	const char *label;
+	uint16_t qtype;
+	unsigned char pkt[512];
+	int len;
+} parsecase;
+
+static unsigned char *
+bench_rr(unsigned char *w, const char *owner, size_t olen,
+		uint16_t type, const void *rdata, size_t rdlen)
+{
+	memcpy(w, owner, olen);
+	w += olen;
+	SET_ID(w, type);
+	SET_ID(w + 2, 1);  /* IN */
+	w[4] = w[5] = 0;
+	w[6] = 1;  /* 300s */
+	w[7] = 44;
+	SET_ID(w + 8, rdlen);
+	memcpy(w + 10, rdata, rdlen);
+	return w + 10 + rdlen;
+}
+
+/* the reply to q, with n A records for the name asked for, behind
+ * cnames aliases */
+static void
+bench_answer(parsecase *c, dnsq_query *q, int cnames, int n)
+{
+	unsigned char *w;
+	unsigned char addr[16] = { 10, 0, 0, 0 };
+	char alias[32];
+	char owner[2];
+	int ancount = 0;
+	int at = 12;  /* offset of the current owner */
+	int i;
+
+	memcpy(c->pkt, q->query, q->len);
+	SET_QR(c->pkt, 1);
+	SET_RA(c->pkt, 1);
+	w = c->pkt + q->len;
+	for (i = 0; i < cnames; i++) {
+		/* cdnN.example */
+		owner[0] = (char)(0xc0 | at >> 8);
+		owner[1] = (char)at;
+		alias[0] = 4;
+		memcpy(alias + 1, "cdn", 3);
+		alias[4] = (char)('0' + i);
+		alias[5] = 7;
+		memcpy(alias + 6, "example", 7);
+		alias[13] = 0;
+		at = (int)(w + sizeof(owner) + 10 - c->pkt);
+		w = bench_rr(w, owner, sizeof(owner), 5, alias, 14);
+		ancount++;
+	}
+	owner[0] = (char)(0xc0 | at >> 8);
+	owner[1] = (char)at;
+	for (i = 0; i < n; i++) {
+		addr[3] = (unsigned char)i;
+		w = bench_rr(w, owner, sizeof(owner), q->qtype, addr,
+				q->qtype == 28 ? 16 : 4);
+		ancount++;
+	}
+	SET_ANCOUNT(c->pkt, ancount);
+	c->len = (int)(w - c->pkt);
+	c->qtype = q->qtype;
+}
+
+static inline double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+	parsecase cases[5];
+	dnsq_query q;
+	unsigned char (*mangled)[512];
+	int *mlen;
+	size_t nmangled = 4096;
+	size_t iters = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+	size_t bytes;
+	size_t ok;
+	size_t i;
+	uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+	double start;
+	double ns;
+	int c;
+	int j;
+
+	memset(&q, 0, sizeof(q));
+	q.qtype = 1;
+	if (iters == 0 || dnsq_build(&q, "www.example.com") != NOERR)
+		return 1;
+	bench_answer(&cases[0], &q, 0, 1);
+	cases[0].label = "single A";
+	bench_answer(&cases[1], &q, 0, 8);
+	cases[1].label = "8 A";
+	bench_answer(&cases[2], &q, 2, 2);
+	cases[2].label = "2 CNAME, 2 A";
+	bench_answer(&cases[3], &q, MAX_CNAMES, 1);
+	cases[3].label = "max CNAME, 1 A";
+	q.qtype = 28;
+	dnsq_build(&q, "www.example.com");
+	bench_answer(&cases[4], &q, 1, 4);
+	cases[4].label = "CNAME, 4 AAAA";
+
+	printf("%-20s %10s %10s %8s\n", "answer", "ns/parse", "MB/s", "bytes");
+	for (c = 0; c < 5; c++) {
+		q.qtype = cases[c].qtype;
+		dnsq_build(&q, "www.example.com");
+		if (dnsq_parse(&q, cases[c].pkt, cases[c].len) != NOERR) {
+			fprintf(stderr, "failed to parse %s\n", cases[c].label);
+			return 1;
+		}
+		start = bench_now();
+		for (i = 0; i < iters; i++) {
+			dnsq_parse(&q, cases[c].pkt, cases[c].len);
+			__asm__ volatile("" ::: "memory");
+		}
+		ns = (bench_now() - start) / iters;
+		printf("%-20s %10.1f %10.1f %8d\n", cases[c].label,
+				ns, cases[c].len / ns * 1000.0, cases[c].len);
+	}
+
+	/* flip a few bytes past the question, and cut some short */
+	mangled = malloc(nmangled * sizeof(*mangled));
+	mlen = malloc(nmangled * sizeof(*mlen));
+	if (mangled == NULL || mlen == NULL)
+		return 1;
+	q.qtype = 1;
+	dnsq_build(&q, "www.example.com");
+	for (i = 0, bytes = 0; i < nmangled; i++) {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 7;
+		rnd ^= rnd << 17;
+		c = (int)(rnd % 4);  /* any of the A answers */
+		memcpy(mangled[i], cases[c].pkt, sizeof(mangled[i]));
+		mlen[i] = cases[c].len;
+		for (j = 0; j < 1 + (int)(rnd >> 8) % 4; j++) {
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 7;
+			rnd ^= rnd << 17;
+			mangled[i][q.len + (rnd >> 16) % (mlen[i] - q.len)] =
+				(unsigned char)(rnd >> 40);
+		}
+		if ((rnd >> 24) % 4 == 0)
+			mlen[i] = 12 + (int)((rnd >> 32) % (mlen[i] - 12));
+		bytes += mlen[i];
+	}
+	ok = 0;
+	start = bench_now();
+	for (i = 0; i < iters; i++)
+		ok += dnsq_parse(&q, mangled[i % nmangled],
+				mlen[i % nmangled]) == NOERR;
+	ns = (bench_now() - start) / iters;
+	printf("%-20s %10.1f %10.1f %8zu  (%.1f%% still parse)\n", "mangled",
+			ns, (double)bytes / nmangled / ns * 1000.0, bytes / nmangled,
+			ok * 100.0 / iters);
+
+	free(mangled);
+	free(mlen);
+	return 0;
+}
+#endif
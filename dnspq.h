@@ -18,9 +18,135 @@
 
 #define VERSION "1.3"
 
+typedef enum {
+	NOERR = 0,
+	NODATA = 1,
+	SENDFAIL = 2,
+	QTOOLONG = 3,
+	NOHDR = 4,
+	SOCKFAIL = 5,
+	INVALIDID = 7,
+	DNSNOQR = 8,
+	DNSNOSQ = 9,
+	DNSRFAIL = 10,
+	DNSFUTURE = 11,
+	DNSEMPTY = 12,
+	DNSNXDOMAIN = 13,
+	INCOMPLETE = 14,
+	DNSAINVALIDLEN = 15,
+	DNSNOA = 16,
+	DNSNOIN = 17
+} dnspq_errno;
+
+/* an IPv4 or IPv6 socket address */
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+} dnspq_sockaddr;
+
+/* a server to query, along with what we learnt about it so far, this
+ * is updated by all threads without locking */
+typedef struct _dnspq_stats dnspq_stats;
+typedef struct {
+	dnspq_sockaddr addr;
+	int32_t srtt;  /* smoothed round trip time in usec, 0 when unknown */
+	int32_t rttvar;  /* mean deviation of the round trip time in usec */
+	int32_t health;  /* answer rate, from 0 (none) to 1024 (all), start
+	                  * at 1024 */
+	int32_t noedns;  /* answered EDNS0 with a format error, it's left
+	                    out until then (monotonic seconds), 0 if not */
+	dnspq_stats *stats;  /* shared counters, NULL when not kept */
+} dnspq_server;
+
+int dnspq_server_parse(dnspq_server *srv, char *str);
+
+/* tunables for querying a set of servers, NULL means defaults */
+typedef struct {
+	char hedge;  /* ask the best server first, others when it's late */
+	char adaptive;  /* derive the retry timeout from the round trip times */
+	int tries;  /* rounds of queries to send, 0 for the default */
+	int timeout;  /* usec to wait for an answer in total, 0 for default */
+	int retrytimeout;  /* usec to wait before retrying, 0 for default */
+	int edns;  /* UDP payload to advertise with EDNS0, 0 for default,
+	            * -1 to not use EDNS0 */
+} dnspq_opts;
+
+#ifndef MAXSERVERS
+# define MAXSERVERS  8  /* servers asked for a single name, at most 32 */
+#endif
+#define DNSPQ_MAXADDRS  16  /* addresses kept from a single answer */
+
+/* the addresses from an answer, valid for (the lowest) ttl seconds */
+typedef struct {
+	unsigned int ttl;
+	int af;  /* AF_INET (A records), AF_INET6 (AAAA records) or
+	          * AF_UNSPEC (a PTR record, naddrs is 1) */
+	unsigned int naddrs;
+	union {
+		struct in_addr v4[DNSPQ_MAXADDRS];
+		struct in6_addr v6[DNSPQ_MAXADDRS];
+		char ptr[sizeof(struct in6_addr) * DNSPQ_MAXADDRS];
+	} addrs;
+} dnspq_answer;
+
+/* the number of bytes in use of the addrs of answer A */
+#define DNSPQ_ADDRS_LEN(A) \
+	((A)->af == AF_INET6 ? sizeof(struct in6_addr) * (A)->naddrs : \
+	 (A)->af == AF_INET ? sizeof(struct in_addr) * (A)->naddrs : \
+	 sizeof((A)->addrs.ptr))
+
 int dnsq(
-		struct sockaddr_in* const dnsservers[],
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
 		const char *a,
-		struct in_addr *ret,
-		unsigned int *ttl,
+		int af,
+		dnspq_answer *ret,
+		char *serverid);
+
+int dnsq_ptr(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *arpa,
+		dnspq_answer *ret,
 		char *serverid);
+int dnspq_arpa(int af, const void *addr, char *buf, size_t len);
+
+/* one name to resolve with dnsq_batch(), for addresses of family af,
+ * or its PTR record when af is AF_UNSPEC (name being made by
+ * dnspq_arpa()), ans and serverid are only set when err is NOERR */
+typedef struct {
+	const char *name;
+	int af;
+	dnspq_answer ans;
+	char serverid;
+	char err;
+} dnsq_item;
+
+int dnsq_batch(
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		dnsq_item *items,
+		size_t n);
+
+/* asynchronous interface: dnspq_submit() returns a handle (or -1), and
+ * the callback is invoked from dnspq_process() with the outcome, item
+ * is only valid during the callback, dnspq_fd() is an epoll fd that is
+ * readable when dnspq_process() has work to do */
+typedef struct _dnspq_ctx dnspq_ctx;
+typedef void (*dnspq_callback)(void *udata, const dnsq_item *item);
+
+dnspq_ctx *dnspq_ctx_new(size_t maxqueries);
+void dnspq_ctx_free(dnspq_ctx *ctx);
+int dnspq_fd(const dnspq_ctx *ctx);
+int dnspq_submit(
+		dnspq_ctx *ctx,
+		dnspq_server* const dnsservers[],
+		const dnspq_opts *opts,
+		const char *name,
+		int af,
+		dnspq_callback cb,
+		void *udata);
+void dnspq_cancel(dnspq_ctx *ctx, int handle);
+int dnspq_timeout(const dnspq_ctx *ctx);
+size_t dnspq_process(dnspq_ctx *ctx);
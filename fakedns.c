@@ -0,0 +1,575 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* fake DNS server for benchmarks
+ *
+ * Answers every A, AAAA and PTR question on 127.0.0.1 with a made up
+ * record, after a configurable delay, and misbehaves at configurable
+ * rates: dropping queries, answering SERVFAIL, NXDOMAIN, without
+ * records (NODATA) or with only an alias (CNAME) without records behind
+ * it, or setting the truncation bit.  Each port given is
+ * served by its own thread, with its own behaviour, e.g.
+ *   fakedns 5391 5392,delay=0.2,jitter=0.1 5393,loss=5,servfail=2
+ * The addresses answered encode the port, 10.<port % 256>.x.y and
+ * fd00::<port>:x, such that one can tell which server answered.
+ * Answers that don't fit in a UDP reply (see records) are truncated,
+ * the same port takes queries over TCP, which are answered right away,
+ * and never truncated. */
+
+#define _GNU_SOURCE  /* ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAXPORTS   16
+#define MAXPENDING 4096  /* replies waiting for their delay to pass */
+#define PKTSIZE    512  /* largest answer over UDP, without EDNS0 */
+#define UDPSIZE    4096  /* largest answer over UDP with EDNS0 */
+#define TCPSIZE    8192  /* largest answer over TCP */
+#define MAXCONNS   64  /* TCP clients at once, per port */
+#define MAXRECORDS 256
+
+typedef struct {
+	unsigned short port;
+	double delay;  /* msec */
+	double jitter;  /* msec, added uniformly on top of delay */
+	double loss;  /* percentages */
+	double servfail;
+	double nxdomain;
+	double nodata;
+	double cname;
+	double truncate;
+	unsigned int ttl;
+	unsigned int records;  /* in each A or AAAA answer */
+	int noedns;  /* answer EDNS0 with a format error */
+} fakeserver;
+
+typedef struct {
+	int fd;  /* -1 when unused */
+	size_t len;
+	unsigned char buf[2 + PKTSIZE];  /* a query being read */
+} tcpclient;
+
+typedef struct {
+	int64_t due;  /* nsec */
+	struct sockaddr_in to;
+	size_t len;
+	unsigned char pkt[UDPSIZE];
+} pending;
+
+static volatile sig_atomic_t running = 1;
+
+static inline int64_t
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* xorshift, good enough to pick what to do */
+static inline double
+chance(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (double)(x >> 11) / (double)(1ULL << 53) * 100.0;
+}
+
+static inline uint32_t
+namehash(const unsigned char *p, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+/* turns query q into its answer in r, which has room for TCPSIZE
+ * bytes over tcp, else UDPSIZE, returns the length of the answer, or 0
+ * when there is nothing to answer */
+static size_t
+answer(const fakeserver *srv, uint64_t *rnd,
+		const unsigned char *q, size_t qlen, unsigned char *r, int tcp)
+{
+	const unsigned char *p;
+	unsigned char *w;
+	uint16_t qtype;
+	uint32_t h;
+	size_t len;
+	size_t size = tcp ? TCPSIZE : PKTSIZE;
+	size_t optlen = 0;
+	char name[64];
+	unsigned int i;
+	int n;
+
+	if (qlen < 12 || (q[2] & 0x80) || q[4] != 0 || q[5] != 1)
+		return 0;
+	/* skip the name of the question */
+	for (p = q + 12; p < q + qlen && *p != 0; p += *p + 1)
+		if (*p & 0xc0)
+			return 0;
+	if (p + 5 > q + qlen)
+		return 0;
+	qtype = (uint16_t)(p[1] << 8 | p[2]);
+	len = (size_t)(p + 5 - q);
+	if (len + 64 > PKTSIZE)
+		return 0;  /* no room for the answer */
+	h = namehash(q + 12, (size_t)(p - (q + 12)));
+
+	memcpy(r, q, len);
+	r[2] = 0x80 | (q[2] & 0x79);  /* QR, keep opcode and RD */
+	r[3] = 0x80;  /* RA, NOERROR */
+	memset(r + 6, 0, 6);  /* no answers, authority or additional */
+
+	/* an OPT record following the question: EDNS0 */
+	p += 5;
+	if (q[11] == 1 && p + 11 <= q + qlen && p[0] == 0 &&
+			p[1] == 0 && p[2] == 41)
+	{
+		if (srv->noedns) {
+			r[3] |= 1;  /* FORMERR */
+			return len;
+		}
+		optlen = 11;
+		if (!tcp)
+			size = (size_t)(p[3] << 8 | p[4]);
+		if (size < PKTSIZE)
+			size = PKTSIZE;
+		if (size > (tcp ? TCPSIZE : UDPSIZE))
+			size = tcp ? TCPSIZE : UDPSIZE;
+	}
+	size -= optlen;
+
+	if (chance(rnd) < srv->servfail) {
+		r[3] |= 2;
+		return len;
+	}
+	if (chance(rnd) < srv->nxdomain) {
+		r[3] |= 3;
+		return len;
+	}
+	if (chance(rnd) < srv->nodata)
+		return len;  /* NOERROR without answers */
+	if (chance(rnd) < srv->cname) {
+		/* an alias of the name asked for, which has no records */
+		w = r + len;
+		*w++ = 0xc0;
+		*w++ = 12;
+		*w++ = 0;
+		*w++ = 5;  /* CNAME */
+		*w++ = 0;
+		*w++ = 1;
+		*w++ = (unsigned char)(srv->ttl >> 24);
+		*w++ = (unsigned char)(srv->ttl >> 16);
+		*w++ = (unsigned char)(srv->ttl >> 8);
+		*w++ = (unsigned char)srv->ttl;
+		*w++ = 0;
+		*w++ = 15;
+		memcpy(w, "\005alias\007example\000", 15);
+		w += 15;
+		r[7] = 1;
+		goto opt;
+	}
+	if ((chance(rnd) < srv->truncate && !tcp) ||
+			(qtype == 1 && len + srv->records * 16 > size) ||
+			(qtype == 28 && len + srv->records * 28 > size))
+	{
+		r[2] |= 0x02;  /* TC, without the answer that didn't fit */
+		w = r + len;
+		goto opt;
+	}
+
+	w = r + len;
+	for (i = 1; i < srv->records && (qtype == 1 || qtype == 28); i++) {
+		/* the extra records, the last one follows below */
+		*w++ = 0xc0;
+		*w++ = 12;
+		*w++ = (unsigned char)(qtype >> 8);
+		*w++ = (unsigned char)qtype;
+		*w++ = 0;
+		*w++ = 1;
+		*w++ = (unsigned char)(srv->ttl >> 24);
+		*w++ = (unsigned char)(srv->ttl >> 16);
+		*w++ = (unsigned char)(srv->ttl >> 8);
+		*w++ = (unsigned char)srv->ttl;
+		*w++ = 0;
+		if (qtype == 1) {
+			*w++ = 4;
+			*w++ = 10;
+			*w++ = (unsigned char)srv->port;
+			*w++ = (unsigned char)((h + i) >> 8);
+			*w++ = (unsigned char)(h + i);
+		} else {
+			*w++ = 16;
+			memset(w, 0, 16);
+			w[0] = 0xfd;
+			w[12] = (unsigned char)(srv->port >> 8);
+			w[13] = (unsigned char)srv->port;
+			w[14] = (unsigned char)((h + i) >> 8);
+			w[15] = (unsigned char)(h + i);
+			w += 16;
+		}
+	}
+	*w++ = 0xc0;  /* pointer to the question's name */
+	*w++ = 12;
+	*w++ = (unsigned char)(qtype >> 8);
+	*w++ = (unsigned char)qtype;
+	*w++ = 0;
+	*w++ = 1;  /* IN */
+	*w++ = (unsigned char)(srv->ttl >> 24);
+	*w++ = (unsigned char)(srv->ttl >> 16);
+	*w++ = (unsigned char)(srv->ttl >> 8);
+	*w++ = (unsigned char)srv->ttl;
+	switch (qtype) {
+		case 1:  /* A */
+			*w++ = 0;
+			*w++ = 4;
+			*w++ = 10;
+			*w++ = (unsigned char)srv->port;
+			*w++ = (unsigned char)(h >> 8);
+			*w++ = (unsigned char)h;
+			break;
+		case 28:  /* AAAA */
+			*w++ = 0;
+			*w++ = 16;
+			memset(w, 0, 16);
+			w[0] = 0xfd;
+			w[12] = (unsigned char)(srv->port >> 8);
+			w[13] = (unsigned char)srv->port;
+			w[14] = (unsigned char)(h >> 8);
+			w[15] = (unsigned char)h;
+			w += 16;
+			break;
+		case 12:  /* PTR */
+			n = snprintf(name, sizeof(name), "host-%u", srv->port);
+			*w++ = 0;
+			*w++ = (unsigned char)(1 + n + 9);
+			*w++ = (unsigned char)n;
+			memcpy(w, name, n);
+			w += n;
+			memcpy(w, "\007example\000", 9);
+			w += 9;
+			break;
+		default:
+			return len;  /* NOERROR without answers */
+	}
+	n = qtype == 12 ? 1 : (int)srv->records;
+	r[6] = (unsigned char)(n >> 8);
+	r[7] = (unsigned char)n;
+
+opt:
+	if (optlen > 0) {
+		/* our own OPT record, advertising what we take */
+		*w++ = 0;
+		*w++ = 0;
+		*w++ = 41;
+		*w++ = (unsigned char)(UDPSIZE >> 8);
+		*w++ = (unsigned char)UDPSIZE;
+		memset(w, 0, 6);
+		w += 6;
+		r[11] = 1;
+	}
+	return (size_t)(w - r);
+}
+
+/* keeps the pending replies in a heap ordered by due time */
+static void
+heap_push(pending *heap, size_t *n, const pending *e)
+{
+	size_t i = (*n)++;
+
+	while (i > 0 && heap[(i - 1) / 2].due > e->due) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = *e;
+}
+
+static void
+heap_pop(pending *heap, size_t *n)
+{
+	pending last = heap[--(*n)];
+	size_t i = 0;
+	size_t c;
+
+	while ((c = 2 * i + 1) < *n) {
+		if (c + 1 < *n && heap[c + 1].due < heap[c].due)
+			c++;
+		if (last.due <= heap[c].due)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+}
+
+/* reads what client c sent, and answers the queries complete, returns
+ * -1 when the client is gone */
+static int
+serve_tcp(const fakeserver *srv, uint64_t *rnd, tcpclient *c)
+{
+	unsigned char r[2 + TCPSIZE];
+	size_t qlen;
+	size_t len;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len,
+				MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+			return -1;
+		if (n < 0)
+			return 0;
+		c->len += (size_t)n;
+		while (c->len >= 2 &&
+				c->len >= 2 + (qlen = (size_t)(c->buf[0] << 8 | c->buf[1])))
+		{
+			if (qlen > PKTSIZE)
+				return -1;
+			if ((len = answer(srv, rnd, c->buf + 2, qlen, r + 2, 1)) > 0)
+			{
+				r[0] = (unsigned char)(len >> 8);
+				r[1] = (unsigned char)len;
+				if (send(c->fd, r, len + 2, MSG_NOSIGNAL) != (ssize_t)len + 2)
+					return -1;
+			}
+			c->len -= 2 + qlen;
+			memmove(c->buf, c->buf + 2 + qlen, c->len);
+		}
+		if (c->len == sizeof(c->buf))
+			return -1;  /* a query larger than we take */
+	}
+}
+
+static void *
+serve(void *arg)
+{
+	fakeserver *srv = (fakeserver *)arg;
+	struct sockaddr_in addr;
+	socklen_t alen;
+	struct pollfd pfds[2 + MAXCONNS];
+	struct timespec ts;
+	pending *heap;
+	pending e;
+	tcpclient *clients;
+	size_t npending = 0;
+	unsigned char q[PKTSIZE];
+	uint64_t rnd = 0x9e3779b97f4a7c15ULL ^ srv->port;
+	int64_t now;
+	int64_t wait;
+	ssize_t len;
+	int fd;
+	int lfd;
+	int on = 1;
+	int i;
+
+	if ((heap = malloc(sizeof(*heap) * MAXPENDING)) == NULL ||
+			(clients = malloc(sizeof(*clients) * MAXCONNS)) == NULL ||
+			(fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1 ||
+			(lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+	{
+		perror("fakedns");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(srv->port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(lfd, 64) != 0)
+	{
+		fprintf(stderr, "fakedns: failed to bind port %u: %s\n",
+				srv->port, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < MAXCONNS; i++)
+		clients[i].fd = -1;
+
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = lfd;
+	pfds[1].events = POLLIN;
+	while (running) {
+		now = now_nsec();
+		while (npending > 0 && heap[0].due <= now) {
+			sendto(fd, heap[0].pkt, heap[0].len, 0,
+					(struct sockaddr *)&heap[0].to, sizeof(heap[0].to));
+			heap_pop(heap, &npending);
+		}
+		/* wake up for the first reply due, or to check running */
+		wait = npending > 0 ? heap[0].due - now : 100000000;
+		ts.tv_sec = wait / 1000000000;
+		ts.tv_nsec = wait % 1000000000;
+		for (i = 0; i < MAXCONNS; i++) {
+			pfds[2 + i].fd = clients[i].fd;
+			pfds[2 + i].events = POLLIN;
+			pfds[2 + i].revents = 0;
+		}
+		if (ppoll(pfds, 2 + MAXCONNS, &ts, NULL) <= 0)
+			continue;
+
+		if (pfds[1].revents & POLLIN) {
+			for (i = 0; i < MAXCONNS && clients[i].fd != -1; i++)
+				;
+			if (i < MAXCONNS) {
+				clients[i].fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+				clients[i].len = 0;
+			}
+		}
+		for (i = 0; i < MAXCONNS; i++) {
+			if (pfds[2 + i].revents != 0 &&
+					serve_tcp(srv, &rnd, &clients[i]) != 0)
+			{
+				close(clients[i].fd);
+				clients[i].fd = -1;
+			}
+		}
+
+		for (;;) {
+			alen = sizeof(e.to);
+			len = recvfrom(fd, q, sizeof(q), 0,
+					(struct sockaddr *)&e.to, &alen);
+			if (len <= 0)
+				break;
+			if (chance(&rnd) < srv->loss)
+				continue;
+			if ((e.len = answer(srv, &rnd, q, (size_t)len, e.pkt, 0)) == 0)
+				continue;
+			e.due = now_nsec() + (int64_t)((srv->delay +
+						srv->jitter * chance(&rnd) / 100.0) * 1000000.0);
+			if (npending == MAXPENDING)
+				continue;  /* overloaded, drop it */
+			heap_push(heap, &npending, &e);
+		}
+	}
+
+	for (i = 0; i < MAXCONNS; i++)
+		if (clients[i].fd != -1)
+			close(clients[i].fd);
+	close(lfd);
+	close(fd);
+	free(clients);
+	free(heap);
+	return NULL;
+}
+
+/* parses port[,key=value...] */
+static int
+parse_server(fakeserver *srv, char *spec)
+{
+	char *p;
+	char *v;
+	char *last = NULL;
+
+	memset(srv, 0, sizeof(*srv));
+	srv->ttl = 300;
+	srv->records = 1;
+	if ((p = strtok_r(spec, ",", &last)) == NULL || atoi(p) <= 0 ||
+			atoi(p) > 65535)
+		return -1;
+	srv->port = (unsigned short)atoi(p);
+	while ((p = strtok_r(NULL, ",", &last)) != NULL) {
+		if ((v = strchr(p, '=')) == NULL)
+			return -1;
+		*v++ = '\0';
+		if (strcmp(p, "delay") == 0) {
+			srv->delay = atof(v);
+		} else if (strcmp(p, "jitter") == 0) {
+			srv->jitter = atof(v);
+		} else if (strcmp(p, "loss") == 0) {
+			srv->loss = atof(v);
+		} else if (strcmp(p, "servfail") == 0) {
+			srv->servfail = atof(v);
+		} else if (strcmp(p, "nxdomain") == 0) {
+			srv->nxdomain = atof(v);
+		} else if (strcmp(p, "nodata") == 0) {
+			srv->nodata = atof(v);
+		} else if (strcmp(p, "cname") == 0) {
+			srv->cname = atof(v);
+		} else if (strcmp(p, "truncate") == 0) {
+			srv->truncate = atof(v);
+		} else if (strcmp(p, "ttl") == 0) {
+			srv->ttl = (unsigned int)atoi(v);
+		} else if (strcmp(p, "records") == 0) {
+			srv->records = (unsigned int)atoi(v);
+			if (srv->records < 1 || srv->records > MAXRECORDS)
+				return -1;
+		} else if (strcmp(p, "noedns") == 0) {
+			srv->noedns = atoi(v);
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+int main(int argc, char *argv[]) {
+	fakeserver srvs[MAXPORTS];
+	pthread_t tids[MAXPORTS];
+	int n;
+	int i;
+
+	if (argc < 2 || argc > MAXPORTS + 1) {
+		fprintf(stderr, "usage: fakedns port[,option=value...] ...\n"
+				"options: delay=<ms> jitter=<ms> loss=<%%> servfail=<%%>\n"
+				"         nxdomain=<%%> truncate=<%%> ttl=<s> records=<n>\n"
+				"         nodata=<%%> cname=<%%> noedns=1\n");
+		return 1;
+	}
+	for (n = 0; n < argc - 1; n++) {
+		if (parse_server(&srvs[n], argv[n + 1]) != 0) {
+			fprintf(stderr, "fakedns: invalid server '%s'\n", argv[n + 1]);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	for (i = 0; i < n; i++)
+		pthread_create(&tids[i], NULL, serve, &srvs[i]);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* lookups in flight
+ *
+ * When many threads of a process ask for the same name at once, e.g.
+ * right after its cache entry expired, only the first one resolves it,
+ * the others wait for its outcome instead of asking the servers too.
+ * Waiting is bounded, a waiter that gives up resolves the name itself.
+ * Flights are kept in a small table of lists, each guarded by its own
+ * lock, a flight lives until both the thread resolving it and all of
+ * its waiters are done with it. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "flight.h"
+
+#ifndef FLIGHT_SHARDS
+# define FLIGHT_SHARDS  16
+#endif
+#define FLIGHT_NAMELEN  256
+
+struct _dnspq_flight {
+	struct _dnspq_flight *next;
+	uint32_t hash;
+	int af;
+	size_t refs;  /* the resolving thread and its waiters */
+	char done;
+	char err;
+	dnspq_answer ans;
+	pthread_cond_t cond;
+	char name[FLIGHT_NAMELEN];
+};
+
+typedef struct {
+	pthread_mutex_t lock;
+	dnspq_flight *flights;
+} __attribute__((aligned(64))) flightshard;
+
+static flightshard shards[FLIGHT_SHARDS];
+static pthread_condattr_t condattr;
+static pthread_once_t flightonce = PTHREAD_ONCE_INIT;
+
+/* FNV-1a over the family and name */
+static inline uint32_t
+flight_hash(const char *name, int af)
+{
+	uint32_t h = (2166136261U ^ (unsigned char)af) * 16777619U;
+
+	for (; *name != '\0'; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	return h;
+}
+
+static void
+flight_atfork_child(void)
+{
+	int i;
+
+	/* only the forking thread lives on, none of the flights of the
+	 * others will ever land, forget about them (leaking them) */
+	for (i = 0; i < FLIGHT_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].flights = NULL;
+	}
+}
+
+static void
+flight_init(void)
+{
+	int i;
+
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	for (i = 0; i < FLIGHT_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+	pthread_atfork(NULL, NULL, flight_atfork_child);
+}
+
+static inline void
+flight_release(dnspq_flight *f)
+{
+	if (--f->refs == 0) {
+		pthread_cond_destroy(&f->cond);
+		free(f);
+	}
+}
+
+/* joins the flight resolving name, or starts one when there is none,
+ * in which case lead is set and the caller is to resolve name and hand
+ * the outcome to dnspq_flight_done(), else the caller is to pick it up
+ * with dnspq_flight_wait().  Returns NULL when name can't be shared,
+ * with lead set, the caller then resolves it on its own */
+dnspq_flight *
+dnspq_flight_join(
+		const char *name,
+		int af,
+		int *lead)
+{
+	uint32_t h;
+	flightshard *s;
+	dnspq_flight *f;
+	size_t nlen;
+
+	if ((nlen = strlen(name)) >= FLIGHT_NAMELEN) {
+		*lead = 1;
+		return NULL;
+	}
+	pthread_once(&flightonce, flight_init);
+
+	h = flight_hash(name, af);
+	s = &shards[h % FLIGHT_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	for (f = s->flights; f != NULL; f = f->next) {
+		if (f->hash == h && f->af == af && strcmp(f->name, name) == 0) {
+			f->refs++;
+			pthread_mutex_unlock(&s->lock);
+			*lead = 0;
+			return f;
+		}
+	}
+	if ((f = malloc(sizeof(*f))) != NULL) {
+		f->hash = h;
+		f->af = af;
+		f->ans.af = af;
+		f->refs = 1;
+		f->done = 0;
+		pthread_cond_init(&f->cond, &condattr);
+		memcpy(f->name, name, nlen + 1);
+		f->next = s->flights;
+		s->flights = f;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	*lead = 1;
+	return f;
+}
+
+/* takes another reference to flight f, which the caller started, such
+ * that it can wait for it with dnspq_flight_wait() while another thread
+ * resolves its name */
+void
+dnspq_flight_hold(dnspq_flight *f)
+{
+	flightshard *s = &shards[f->hash % FLIGHT_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	f->refs++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* sets deadline to msec from now, for dnspq_flight_wait() */
+void
+dnspq_flight_deadline(
+		unsigned int msec,
+		struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += msec / 1000;
+	deadline->tv_nsec += (long)(msec % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* waits until deadline at most for the outcome of flight f, returns 1
+ * when it landed, and 0 when the caller should resolve the name itself,
+ * either way the caller is done with f */
+int
+dnspq_flight_wait(
+		dnspq_flight *f,
+		const struct timespec *deadline,
+		dnspq_answer *ret,
+		char *err)
+{
+	flightshard *s = &shards[f->hash % FLIGHT_SHARDS];
+	int landed;
+
+	pthread_mutex_lock(&s->lock);
+	while (!f->done &&
+			pthread_cond_timedwait(&f->cond, &s->lock, deadline) == 0)
+		;
+	if ((landed = f->done)) {
+		*err = f->err;
+		ret->af = f->af;
+		ret->ttl = f->ans.ttl;
+		if (f->err == 0) {
+			ret->naddrs = f->ans.naddrs;
+			memcpy(&ret->addrs, &f->ans.addrs, DNSPQ_ADDRS_LEN(&f->ans));
+		}
+	}
+	flight_release(f);
+	pthread_mutex_unlock(&s->lock);
+
+	return landed;
+}
+
+/* lands flight f with the outcome of resolving its name, waking up all
+ * threads waiting for it, f can be NULL */
+void
+dnspq_flight_done(
+		dnspq_flight *f,
+		const dnspq_answer *ans,
+		char err)
+{
+	flightshard *s;
+	dnspq_flight **p;
+
+	if (f == NULL)
+		return;
+	s = &shards[f->hash % FLIGHT_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	for (p = &s->flights; *p != NULL; p = &(*p)->next) {
+		if (*p == f) {
+			*p = f->next;
+			break;
+		}
+	}
+	f->done = 1;
+	f->err = err;
+	f->ans.ttl = ans->ttl;
+	if (err == 0) {
+		f->ans.naddrs = ans->naddrs;
+		memcpy(&f->ans.addrs, &ans->addrs, DNSPQ_ADDRS_LEN(&f->ans));
+	}
+	pthread_cond_broadcast(&f->cond);
+	flight_release(f);
+	pthread_mutex_unlock(&s->lock);
+}
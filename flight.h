@@ -0,0 +1,36 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+typedef struct _dnspq_flight dnspq_flight;
+
+dnspq_flight *dnspq_flight_join(
+		const char *name,
+		int af,
+		int *lead);
+void dnspq_flight_hold(dnspq_flight *f);
+void dnspq_flight_deadline(
+		unsigned int msec,
+		struct timespec *deadline);
+int dnspq_flight_wait(
+		dnspq_flight *f,
+		const struct timespec *deadline,
+		dnspq_answer *ret,
+		char *err);
+void dnspq_flight_done(
+		dnspq_flight *f,
+		const dnspq_answer *ans,
+		char err);
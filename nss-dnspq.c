@@ -22,8 +22,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <nss.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -32,276 +40,888 @@
 #endif
 
 #include "dnspq.h"
+#include "cache.h"
+#include "shmcache.h"
+#include "stats.h"
+#include "daemon.h"
+#include "flight.h"
+#include "config.h"
 
-#ifndef RESOLV_CONF
-#define RESOLV_CONF "/etc/resolv-dnspq.conf"
+#ifndef RELOAD_INTERVAL
+#define RELOAD_INTERVAL 1  /* seconds between checks for config changes */
 #endif
+#ifndef FLIGHT_WAIT
+#define FLIGHT_WAIT 1000  /* ms to wait for another thread resolving a name */
+#endif
+#ifndef STALE_TTL
+#define STALE_TTL 30  /* seconds, the ttl handed out with stale answers */
+#endif
+#ifndef REFRESH_THREADS
+#define REFRESH_THREADS 4  /* lookups finishing in the background at once */
+#endif
+
+/* a config image, along with the state this process keeps for it: the
+ * servers with their estimates, and the pools' rotation counters, all
+ * in a single allocation.  It is replaced as a whole when the config
+ * changes, see config_get() */
+typedef struct _dnspqconf {
+	const dnspq_image *img;
+	size_t maplen;  /* length of the mapping, 0 when img was allocated */
+	const dnspq_image_slot *slots;
+	const dnspq_image_group *groups;
+	const char *names;
+	dnspq_server *servers;
+	dnspq_server **lists;  /* NULL terminated server list of each group */
+	size_t *rotors;  /* per pool, shared without a lock */
+	size_t refs;  /* lookups using this config */
+	char graced;  /* retired, and no lookup can pick it up anymore */
+	struct _dnspqconf *next;  /* retired configs */
+} dnspqconf;
 
-typedef struct _domaingroup {
-	char *domain;
-	struct _domaingroup *next;
-	size_t poolcount;
-	struct sockaddr_in **dnsservers;
-} domaingroup;
+static dnspqconf *config = NULL;
+static dnspqconf *retired = NULL;  /* replaced, but possibly in use */
+static size_t acquiring = 0;  /* lookups picking up the current config */
+static char reloading = 0;
+static char loaded = 0;  /* caches have been set up */
+static time_t lastcheck = 0;
+static struct stat confstat;  /* identity of the files config came from */
+static struct stat imgstat;
+static pthread_once_t configonce = PTHREAD_ONCE_INIT;
 
-static domaingroup *rpool = NULL;
+#define GROUP_SERVERS(C, G)  ((C)->lists + (C)->groups[G].first + (G))
 
 #ifdef DEBUG
 void debugconfig(void) {
-	domaingroup *walk;
-	struct sockaddr_in *swalk;
-	int i;
-
-	for (walk = rpool; walk != NULL; walk = walk->next) {
-		printf("\"%s\": %zd\n",
-				walk->domain ? walk->domain : "(cont)", walk->poolcount);
-		for (i = 0, swalk = walk->dnsservers[i]; swalk != NULL; swalk = walk->dnsservers[++i]) {
-			printf("    %s:%d\n", inet_ntoa(swalk->sin_addr), htons(swalk->sin_port));
+	const uint32_t *pools;
+	const dnspq_image_slot *slot;
+	const dnspq_image_group *g;
+	dnspq_server **list;
+	char ip[INET6_ADDRSTRLEN];
+	uint32_t p;
+	uint32_t i;
+	int j;
+
+	if (config == NULL)
+		return;
+	pools = DNSPQ_IMAGE_AT(config->img, config->img->pools);
+	for (p = 0; p <= config->img->npools; p++) {
+		if (p < config->img->npools) {
+			slot = &config->slots[pools[p]];
+			printf("\"%.*s\": %u\n", (int)slot->len,
+					config->names + slot->name, slot->count);
+			i = slot->first;
+		} else if ((i = config->img->fallback) != DNSPQ_IMAGE_NONE) {
+			printf("(fallback)\n");
+		} else {
+			break;
+		}
+		for (; p == config->img->npools || i < slot->first + slot->count; i++) {
+			g = &config->groups[i];
+			printf("  %s%s timeout %d retry %d tries %d edns %d\n",
+					g->opts.hedge ? " (hedged)" : "",
+					g->opts.adaptive ? " (adaptive)" : "",
+					g->opts.timeout, g->opts.retrytimeout,
+					g->opts.tries, g->opts.edns);
+			for (list = GROUP_SERVERS(config, i), j = 0; list[j] != NULL; j++) {
+				inet_ntop(list[j]->addr.sa.sa_family,
+						list[j]->addr.sa.sa_family == AF_INET6 ?
+						(void *)&list[j]->addr.sin6.sin6_addr :
+						(void *)&list[j]->addr.sin.sin_addr, ip, sizeof(ip));
+				printf("    %s:%d\n", ip, htons(list[j]->addr.sin.sin_port));
+			}
+			if (p == config->img->npools)
+				break;
 		}
 	}
 }
 #endif
 
-/* library init */
-/* read the config file and build up the structure per domain */
-#ifndef DEBUG
-__attribute__((constructor))
+/* gives the n rotors random starting points, from our own source, as
+ * the application's rand() sequence is none of our business */
+static void seedrotors(size_t *rotors, uint32_t n) {
+	struct timespec ts;
+	uint64_t x;
+	uint64_t z;
+	uint32_t i;
+
+	if (n == 0 || getrandom(rotors, n * sizeof(*rotors), GRND_NONBLOCK) ==
+			(ssize_t)(n * sizeof(*rotors)))
+		return;
+	/* no entropy (yet), mix the time and pid through splitmix64 */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	x = (uint64_t)ts.tv_nsec ^ (uint64_t)getpid() << 32;
+	for (i = 0; i < n; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		rotors[i] = (size_t)(z ^ (z >> 31));
+	}
+}
+
+/* sets up the state of this process for img */
+static dnspqconf *attachimage(const dnspq_image *img, size_t maplen) {
+	dnspqconf *conf;
+	const dnspq_sockaddr *addrs;
+	dnspq_server **list;
+	uint32_t i;
+	uint32_t j;
+
+	conf = calloc(1, sizeof(*conf) +
+			img->nservers * sizeof(*conf->servers) +
+			(img->nservers + img->ngroups) * sizeof(*conf->lists) +
+			img->npools * sizeof(*conf->rotors));
+	if (conf == NULL)
+		return NULL;
+	conf->img = img;
+	conf->maplen = maplen;
+	conf->slots = DNSPQ_IMAGE_AT(img, img->slots);
+	conf->groups = DNSPQ_IMAGE_AT(img, img->groups);
+	conf->names = DNSPQ_IMAGE_AT(img, img->names);
+	conf->servers = (dnspq_server *)(conf + 1);
+	conf->lists = (dnspq_server **)(conf->servers + img->nservers);
+	conf->rotors = (size_t *)(conf->lists + img->nservers + img->ngroups);
+
+	addrs = DNSPQ_IMAGE_AT(img, img->servers);
+	for (i = 0; i < img->nservers; i++) {
+		conf->servers[i].addr = addrs[i];
+		conf->servers[i].health = 1024;
+	}
+	for (i = 0; i < img->ngroups; i++) {
+		list = GROUP_SERVERS(conf, i);
+		for (j = 0; j < conf->groups[i].count; j++)
+			list[j] = &conf->servers[conf->groups[i].first + j];
+	}
+	/* don't let all processes start with the same pool members */
+	seedrotors(conf->rotors, img->npools);
+
+	return conf;
+}
+
+static void freeconfig(dnspqconf *conf) {
+	if (conf->maplen != 0) {
+		munmap((void *)conf->img, conf->maplen);
+	} else {
+		free((void *)conf->img);
+	}
+	free(conf);
+}
+
+/* reads the config, from the image compiled by `dnspq -c` when it is up
+ * to date with the text file, else from the text file, and records the
+ * identity of both files, see config_check() */
+static dnspqconf *loadconfig(void) {
+	dnspqconf *conf;
+	dnspq_image *img;
+	void *map;
+	FILE *f;
+	int text;
+	int fd;
+
+	text = stat(RESOLV_CONF, &confstat) == 0;
+	if (!text)
+		memset(&confstat, 0, sizeof(confstat));
+	memset(&imgstat, 0, sizeof(imgstat));
+	if ((fd = open(RESOLV_CONF_IMAGE, O_RDONLY | O_CLOEXEC)) != -1) {
+		if (fstat(fd, &imgstat) == 0 &&
+				imgstat.st_size >= (off_t)sizeof(dnspq_image) &&
+				imgstat.st_size <= UINT32_MAX &&
+				(map = mmap(NULL, (size_t)imgstat.st_size, PROT_READ,
+							MAP_SHARED, fd, 0)) != MAP_FAILED)
+		{
+			img = map;
+			if (dnspq_image_valid(img, (size_t)imgstat.st_size) &&
+					(!text ||
+					 (img->srcsize == (uint64_t)confstat.st_size &&
+					  img->srcmtime == confstat.st_mtim.tv_sec *
+					  1000000000LL + confstat.st_mtim.tv_nsec)) &&
+					(conf = attachimage(img, (size_t)imgstat.st_size)) != NULL)
+			{
+				close(fd);
+				return conf;
+			}
+			munmap(map, (size_t)imgstat.st_size);
+		}
+		close(fd);
+	}
+
+	if ((f = fopen(RESOLV_CONF, "re")) == NULL)
+		return NULL;
+	fstat(fileno(f), &confstat);
+	img = dnspq_image_read(f);
+	fclose(f);
+	if (img == NULL)
+		return NULL;
+	if ((conf = attachimage(img, 0)) == NULL)
+		free(img);
+	return conf;
+}
+
+/* the caches and statistics are set up by the first config read, and
+ * live on across reloads, servers find their counters by address */
+static void setupcaches(dnspqconf *conf) {
+	uint32_t i;
+
+	if (!loaded) {
+		loaded = 1;
+		dnspq_cache_init(conf->img->cachesize, conf->img->stale);
+		if (conf->img->shmcache != DNSPQ_IMAGE_NONE)
+			dnspq_shmcache_init(conf->names + conf->img->shmcache);
+		if (conf->img->stats != DNSPQ_IMAGE_NONE)
+			dnspq_stats_init(conf->names + conf->img->stats);
+	}
+	for (i = 0; i < conf->img->nservers; i++)
+		conf->servers[i].stats = dnspq_stats_server(&conf->servers[i].addr);
+}
+
+static inline int sameaddr(const dnspq_sockaddr *a, const dnspq_sockaddr *b) {
+	if (a->sa.sa_family != b->sa.sa_family)
+		return 0;
+	if (a->sa.sa_family == AF_INET6)
+		return a->sin6.sin6_port == b->sin6.sin6_port &&
+			memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+					sizeof(struct in6_addr)) == 0;
+	return a->sin.sin_port == b->sin.sin_port &&
+		a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+}
+
+/* hands the estimates of the servers in old to those in conf with the
+ * same address, such that a reload doesn't reset them */
+static void inheritservers(dnspqconf *conf, dnspqconf *old) {
+	dnspq_server *s;
+	dnspq_server *t;
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 0; i < conf->img->nservers; i++) {
+		s = &conf->servers[i];
+		for (j = 0; j < old->img->nservers; j++) {
+			t = &old->servers[j];
+			if (!sameaddr(&s->addr, &t->addr))
+				continue;
+			s->srtt = __atomic_load_n(&t->srtt, __ATOMIC_RELAXED);
+			s->rttvar = __atomic_load_n(&t->rttvar, __ATOMIC_RELAXED);
+			s->health = __atomic_load_n(&t->health, __ATOMIC_RELAXED);
+			s->noedns = __atomic_load_n(&t->noedns, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+}
+
+static inline int samefile(const struct stat *a, const struct stat *b) {
+	return a->st_dev == b->st_dev &&
+		a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* rereads the config when the text file or the image changed, checking
+ * at most once every RELOAD_INTERVAL seconds.  Only a single thread
+ * does so at a time, the others don't wait for it and carry on with
+ * the config they have. */
+static void config_check(void) {
+	struct timespec ts;
+	struct stat st;
+	struct stat ist;
+	time_t last;
+	dnspqconf *conf;
+	dnspqconf **r;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	last = __atomic_load_n(&lastcheck, __ATOMIC_RELAXED);
+	if (ts.tv_sec - last < RELOAD_INTERVAL ||
+			__atomic_test_and_set(&reloading, __ATOMIC_ACQUIRE))
+		return;
+	if (__atomic_load_n(&lastcheck, __ATOMIC_RELAXED) != last) {
+		/* someone else just did */
+		__atomic_clear(&reloading, __ATOMIC_RELEASE);
+		return;
+	}
+	__atomic_store_n(&lastcheck, ts.tv_sec, __ATOMIC_RELAXED);
+
+	if (stat(RESOLV_CONF, &st) != 0)
+		memset(&st, 0, sizeof(st));
+	if (stat(RESOLV_CONF_IMAGE, &ist) != 0)
+		memset(&ist, 0, sizeof(ist));
+	if ((!samefile(&st, &confstat) || !samefile(&ist, &imgstat)) &&
+			(conf = loadconfig()) != NULL)
+	{
+#ifdef LOGGING
+		syslog(LOG_INFO, "reloaded %s", conf->maplen != 0 ?
+				RESOLV_CONF_IMAGE : RESOLV_CONF);
 #endif
+		setupcaches(conf);
+		if (config != NULL)
+			inheritservers(conf, config);
+		conf = __atomic_exchange_n(&config, conf, __ATOMIC_SEQ_CST);
+		if (conf != NULL) {
+			conf->next = retired;
+			retired = conf;
+		}
+	}
+
+	/* a retired config can no longer be picked up once no lookup is
+	 * between loading the config pointer and taking its reference, it
+	 * can be freed once the lookups that did take one are done */
+	for (r = &retired; (conf = *r) != NULL; ) {
+		if (!conf->graced)
+			conf->graced = __atomic_load_n(&acquiring, __ATOMIC_SEQ_CST) == 0;
+		if (conf->graced &&
+				__atomic_load_n(&conf->refs, __ATOMIC_ACQUIRE) == 0)
+		{
+			*r = conf->next;
+			freeconfig(conf);
+		} else {
+			r = &conf->next;
+		}
+	}
+
+	__atomic_clear(&reloading, __ATOMIC_RELEASE);
+}
+
+static void config_atfork_child(void) {
+	/* a reload in progress in another thread never finishes in the
+	 * child */
+	__atomic_clear(&reloading, __ATOMIC_RELAXED);
+}
+
+/* library init, done upon the first lookup, such that processes that
+ * never resolve anything don't pay for reading the config */
 void readconfig(void) {
-	FILE *resolvconf = NULL;
-	int j, k;
-	char buf[1024];
-	domaingroup *tdg = NULL;
-	domaingroup *ndg = NULL;
-	char *p = NULL;
-	struct sockaddr_in *dnsservers[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	struct sockaddr_in *dnsserver = NULL;
-	int dnsi = 0;
-	char *fps[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	int port;
+	struct timespec ts;
 
 #ifdef LOGGING
 	openlog("dnspq", LOG_PID, LOG_USER);
 	syslog(LOG_INFO, "nss-dnspq.so.2 v" VERSION " (" GIT_VERSION ") has been invoked");
 #endif
 
-	/* don't use time to avoid same sequence when multiple processes
-	 * start at the same time */
-	srand(getpid());
-
-	/* .domain ip:port ip:port ...
-	 * or
-	 * nameserver ip 
-	 *
-	 * The first form creates a group of DNS servers to query for the
-	 * domain.  The leading . is mandatory here (to distinguish easily).
-	 * The second form is to facilitate traditional /etc/resolv.conf
-	 * files.  Interleaving both forms is NOT supported.
-	 */
-
-	if ((resolvconf = fopen(RESOLV_CONF, "r")) == NULL)
-		return;
-	while (fgets(buf, sizeof(buf), resolvconf) != NULL)
-		if (
-				buf[0] == 'n' &&
-				buf[1] == 'a' &&
-				buf[2] == 'm' &&
-				buf[3] == 'e' &&
-				buf[4] == 's' &&
-				buf[5] == 'e' &&
-				buf[6] == 'r' &&
-				buf[7] == 'v' &&
-				buf[8] == 'e' &&
-				buf[9] == 'r' &&
-				buf[10] == ' ')
-		{ /* traditional /etc/resolv.conf mode */
-			if (dnsi == sizeof(dnsservers) - 1)
-				continue;
-			if ((p = strchr(buf + 11, '\n')) != NULL)
-				*p = '\0';
-			dnsserver = dnsservers[dnsi++] = malloc(sizeof(*dnsserver));
-			if (inet_pton(AF_INET, buf + 11, &(dnsserver->sin_addr)) <= 0) {
-				free(dnsserver);
-				dnsserver = dnsservers[dnsi--] = NULL;
-				continue;
-			}
-			dnsserver->sin_family = AF_INET;
-			dnsserver->sin_port = htons(53);
-		} else if (buf[0] == '.') { /* group mode */
-			p = buf + 1;
-			dnsi = 0;
-			while (dnsi < sizeof(fps) && (p = strchr(p, ' ')) != NULL) {
-				*p++ = '\0';
-				fps[dnsi] = p;
-				dnsi++;
-			}
-			if (dnsi == 0)
-				continue;
-			if ((p = strchr(fps[dnsi - 1], '\n')) != NULL)
-				*p = '\0';
-			k = -1;
-			if (rpool == NULL) {
-				tdg = rpool = malloc(sizeof(domaingroup));
-				tdg->next = NULL;
-			} else {
-				ndg = NULL;
-				for (tdg = rpool; ; tdg = tdg->next) {
-					if (tdg->domain != NULL &&
-							strcmp(tdg->domain, buf + 1) == 0)
-					{
-						/* randomise insertion */
-						tdg->poolcount++;
-						k = rand() % tdg->poolcount;
-						if (k == 0) {
-							tdg = ndg;
-						} else {
-							for (j = 1; j < k; j++)
-								tdg = tdg->next;
-						}
-						break;
-					}
-					if (tdg->next == NULL)
-						break;
-					ndg = tdg;
-				}
-				ndg = malloc(sizeof(domaingroup));
-				if (tdg == NULL) {
-					ndg->next = rpool;
-					tdg = rpool = ndg;
-				} else {
-					ndg->next = tdg->next;
-					tdg = tdg->next = ndg;
-				}
-			}
-			if (k == -1) {
-				tdg->domain = strdup(buf + 1);
-				tdg->poolcount = 1;
-			} else if (k == 0) {
-				tdg->domain = tdg->next->domain;
-				tdg->poolcount = tdg->next->poolcount;
-				tdg->next->domain = NULL;
-				tdg->next->poolcount = 0;
-			} else {
-				tdg->domain = NULL;
-				tdg->poolcount = 0;
-			}
-			tdg->dnsservers = malloc(sizeof(*dnsserver) * (dnsi + 1));
-			for (j = 0, k = 0; j < dnsi; j++) {
-				dnsserver = tdg->dnsservers[k++] = malloc(sizeof(*dnsserver));
-				port = 0;
-				if ((p = strchr(fps[j], ':')) != NULL) {
-					*p++ = '\0';
-					port = atoi(p);
-				}
-				if (inet_pton(AF_INET, fps[j], &(dnsserver->sin_addr)) <= 0) {
-					free(dnsserver);
-					dnsserver = tdg->dnsservers[--k] = NULL;
-					continue;
-				}
-				dnsserver->sin_family = AF_INET;
-				dnsserver->sin_port = htons(port == 0 ? 53 : port);
-			}
-			tdg->dnsservers[k] = NULL;
-			dnsi = 0;
-		}
-	fclose(resolvconf);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	lastcheck = ts.tv_sec;
+	if ((config = loadconfig()) != NULL)
+		setupcaches(config);
+	pthread_atfork(NULL, NULL, config_atfork_child);
+}
 
-	if (dnsi > 0) {
-		/* create fallback group for traditional mode */
-		if (rpool == NULL) {
-			tdg = rpool = malloc(sizeof(domaingroup));
-		} else {
-			for (tdg = rpool; tdg->next != NULL; tdg = tdg->next)
-				;
-			tdg = tdg->next = malloc(sizeof(domaingroup));
-		}
-		tdg->domain = NULL;
-		tdg->next = NULL;
-		tdg->dnsservers = malloc(sizeof(*dnsserver) * (dnsi + 1));
-		memcpy(tdg->dnsservers, dnsservers, sizeof(*dnsserver) * (dnsi + 1));
-	}
-}
-
-/* strcmp at the tail of a string, either start, or from a dot */
-static inline int tailcmp(const char *haystack, const char *needle) {
-	size_t nl = strlen(needle);
-	size_t hl = strlen(haystack);
-	const char *p;
-	if (nl < hl) {
-		p = haystack + hl - nl - 1;
-		if (*p++ == '.') {
-			for (; *p != '\0' && *p == *needle; p++, needle++)
-				;
-			if (*p == '\0')
-				return 0;
-		}
+static inline void config_init(void) {
+	pthread_once(&configonce, readconfig);
+}
+
+/* returns the current config for the duration of a lookup, without
+ * taking a lock, hand it back with config_put() */
+static inline dnspqconf *config_get(void) {
+	dnspqconf *conf;
+
+	config_init();
+	config_check();
+	__atomic_add_fetch(&acquiring, 1, __ATOMIC_SEQ_CST);
+	conf = __atomic_load_n(&config, __ATOMIC_SEQ_CST);
+	if (conf != NULL)
+		__atomic_add_fetch(&conf->refs, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&acquiring, 1, __ATOMIC_RELEASE);
+	return conf;
+}
+
+static inline void config_put(dnspqconf *conf) {
+	if (conf != NULL)
+		__atomic_sub_fetch(&conf->refs, 1, __ATOMIC_RELEASE);
+}
+
+/* picks the next member of the pool in slot, or the traditional mode
+ * servers when slot is NULL */
+static inline char pick_group(
+		dnspqconf *conf,
+		const dnspq_image_slot *slot,
+		dnspq_server ***dnsservers,
+		const dnspq_opts **opts)
+{
+	uint32_t g;
+
+	if (slot != NULL) {
+		g = slot->first;
+		if (slot->count > 1)
+			g += __atomic_fetch_add(&conf->rotors[slot->pool], 1,
+					__ATOMIC_RELAXED) % slot->count;
+	} else if ((g = conf->img->fallback) == DNSPQ_IMAGE_NONE) {
+		return 0;
 	}
+	*dnsservers = GROUP_SERVERS(conf, g);
+	*opts = &conf->groups[g].opts;
 	return 1;
 }
 
-/* helper function to locate the set of nameservers for the given domain */
+#ifdef POOLBENCH
+/* locates the set of nameservers for the given domain by trying all
+ * pools in turn, the first pool that matches wins */
+static inline char get_dnss_for_domain_walk(
+		dnspqconf *conf,
+		dnspq_server ***dnsservers,
+		const dnspq_opts **opts,
+		const char *name)
+{
+	const uint32_t *pools = DNSPQ_IMAGE_AT(conf->img, conf->img->pools);
+	const dnspq_image_slot *slot;
+	size_t nlen = strlen(name);
+	uint32_t p;
+
+	for (p = 0; p < conf->img->npools; p++) {
+		slot = &conf->slots[pools[p]];
+		if (slot->len < nlen && name[nlen - slot->len - 1] == '.' &&
+				memcmp(name + nlen - slot->len,
+					conf->names + slot->name, slot->len) == 0)
+			return pick_group(conf, slot, dnsservers, opts);
+	}
+	return pick_group(conf, NULL, dnsservers, opts);
+}
+#endif
+
+/* helper function to locate the set of nameservers for the given domain,
+ * probes the index once for every dot in name, and picks the pool that
+ * comes first in the config */
 static inline char get_dnss_for_domain(
-		struct sockaddr_in ***dnsservers,
+		dnspqconf *conf,
+		dnspq_server ***dnsservers,
+		const dnspq_opts **opts,
 		const char *name)
 {
-	domaingroup *w = rpool;
-	int i;
+	const dnspq_image_slot *best = NULL;
+	const dnspq_image_slot *slot;
+	uint32_t mask = conf->img->nslots - 1;
+	uint32_t h = POOLHASH_INIT;
+	uint32_t hh;
+	uint32_t i;
+	size_t nlen;
+	size_t len;
 
-	while (w != NULL) {
-		if (w->domain == NULL) {
-			*dnsservers = w->dnsservers;
-			return 1;
-		} else if (tailcmp(name, w->domain) == 0) {
-			if (w->poolcount > 1) {
-				i = w->next->poolcount;
-				w->next->poolcount = (w->next->poolcount + 1) % w->poolcount;
-				for (; i > 0; i--)
-					w = w->next;
+	nlen = strlen(name);
+	for (len = nlen; len > 0; len--) {
+		if (name[len - 1] == '.') {
+			/* h covers the suffix following this dot */
+			hh = h == 0 ? 1 : h;
+			for (i = hh & mask; conf->slots[i].hash != 0; i = (i + 1) & mask) {
+				slot = &conf->slots[i];
+				if (slot->hash == hh && slot->len == nlen - len &&
+						memcmp(conf->names + slot->name, name + len,
+							slot->len) == 0)
+				{
+					if (best == NULL || slot->pool < best->pool)
+						best = slot;
+					break;
+				}
 			}
-			*dnsservers = w->dnsservers;
-			return 1;
-		} else {
-			/* skip over entire pool */
-			for (i = w->poolcount; i > 0; i--)
-				w = w->next;
 		}
+		h = POOLHASH(h, name[len - 1]);
+	}
+
+	return pick_group(conf, best, dnsservers, opts);
+}
+
+/* how long to remember a failed lookup, 0 when it shouldn't be */
+static inline unsigned int negative_ttl(dnspqconf *conf, char err) {
+	switch (err) {
+		case DNSNXDOMAIN:
+		case DNSEMPTY:  /* no such records, e.g. AAAA of an IPv4 host */
+			return conf->img->negttl;
+		case SOCKFAIL:
+		case SENDFAIL:
+		case QTOOLONG:
+			/* our own trouble, not the servers' */
+			return 0;
+		default:
+			return conf->img->failttl;
+	}
+}
+
+/* looks name up in the caches, promoting answers from the shared one */
+static inline int cache_lookup(const char *name, int af,
+		dnspq_answer *ans, char *err)
+{
+	config_init();  /* sets up the caches */
+	if (dnspq_cache_get(name, af, ans, err))
+		return 1;
+	if (dnspq_shmcache_get(name, af, ans, err)) {
+		dnspq_cache_put(name, ans, *err);
+		return 1;
 	}
 	return 0;
+}
 
+/* remembers the outcome of resolving name in the caches */
+static inline void cache_store(dnspqconf *conf, const char *name, int af,
+		dnspq_answer *ans, char err)
+{
+	if (err != NOERR) {
+		ans->af = af;
+		ans->ttl = negative_ttl(conf, err);
+	}
+	dnspq_cache_put(name, ans, err);
+	dnspq_shmcache_put(name, ans, err);
+}
+
+/* resolves name, through the daemon when one is configured and it
+ * answers, else by asking the servers ourselves */
+static inline char resolve(dnspqconf *conf, dnspq_server **dnsservers,
+		const dnspq_opts *opts, const char *name, int af, dnspq_answer *ans)
+{
+	dnsq_item item;
+	char sid;
+
+	if (conf->img->daemon != DNSPQ_IMAGE_NONE) {
+		item.name = name;
+		item.af = af;
+		if (dnspq_daemon_query(conf->names + conf->img->daemon, opts,
+					&item, 1) == 0)
+		{
+			if (item.err == NOERR)
+				*ans = item.ans;
+			return item.err;
+		}
+	}
+	if (af == AF_UNSPEC)
+		return (char)dnsq_ptr(dnsservers, opts, name, ans, &sid);
+	return (char)dnsq(dnsservers, opts, name, af, ans, &sid);
+}
+
+/* whether a stale answer is better than the outcome err, that is, the
+ * servers didn't give any definite answer */
+static inline int stale_wins(char err) {
+	return err != NOERR && err != DNSNXDOMAIN && err != DNSEMPTY;
+}
+
+/* resolves the items, which share a single name, and caches their
+ * outcomes, except failures when there's a stale answer to fall back
+ * on, which would otherwise get replaced, the stale answer is then
+ * served for as long as the failure would have been remembered */
+static void resolve_items(dnspqconf *conf, dnspq_server **dnsservers,
+		const dnspq_opts *opts, dnsq_item *items, size_t nitems)
+{
+	dnspq_answer stale;
+	size_t i;
+
+	if (nitems == 1) {
+		items[0].err = resolve(conf, dnsservers, opts,
+				items[0].name, items[0].af, &items[0].ans);
+	} else if (conf->img->daemon == DNSPQ_IMAGE_NONE ||
+			dnspq_daemon_query(conf->names + conf->img->daemon, opts,
+				items, nitems) != 0)
+	{
+		dnsq_batch(dnsservers, opts, items, nitems);
+	}
+	for (i = 0; i < nitems; i++) {
+		if (!stale_wins(items[i].err) ||
+				!dnspq_cache_stale(items[i].name, items[i].af, &stale))
+			cache_store(conf, items[i].name, items[i].af,
+					&items[i].ans, items[i].err);
+		else
+			dnspq_cache_retry(items[i].name, items[i].af,
+					negative_ttl(conf, items[i].err));
+	}
+}
+
+/* a lookup that didn't finish within the stale timeout, finished by a
+ * thread of its own, which lands its flights */
+typedef struct {
+	dnspqconf *conf;
+	dnspq_server **dnsservers;
+	const dnspq_opts *opts;
+	dnsq_item items[2];
+	dnspq_flight *flights[2];
+	size_t nitems;
+	char name[256];
+} refreshjob;
+
+static size_t refreshing = 0;  /* refresh threads running */
+
+static void *refresh(void *arg) {
+	refreshjob *r = (refreshjob *)arg;
+	size_t i;
+
+	resolve_items(r->conf, r->dnsservers, r->opts, r->items, r->nitems);
+	for (i = 0; i < r->nitems; i++)
+		dnspq_flight_done(r->flights[i], &r->items[i].ans, r->items[i].err);
+	config_put(r->conf);
+	free(r);
+	__atomic_sub_fetch(&refreshing, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* starts resolving the items in the background, returns -1 when that
+ * can't be done, 1 when REFRESH_THREADS are at it already */
+static int refresh_start(dnspqconf *conf, dnspq_server **dnsservers,
+		const dnspq_opts *opts, dnsq_item *items, dnspq_flight **flights,
+		size_t nitems)
+{
+	refreshjob *r;
+	pthread_t tid;
+	pthread_attr_t attr;
+	sigset_t all;
+	sigset_t old;
+	size_t nlen = strlen(items[0].name);
+	size_t i;
+	int ret;
+
+	if (nlen >= sizeof(r->name))
+		return -1;
+	/* when the servers are down, every name with a stale answer would
+	 * get its own thread, all of them waiting for the timeout */
+	if (__atomic_add_fetch(&refreshing, 1, __ATOMIC_RELAXED) >
+			REFRESH_THREADS)
+	{
+		__atomic_sub_fetch(&refreshing, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if ((r = malloc(sizeof(*r))) == NULL) {
+		__atomic_sub_fetch(&refreshing, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	r->conf = conf;
+	r->dnsservers = dnsservers;
+	r->opts = opts;
+	r->nitems = nitems;
+	memcpy(r->name, items[0].name, nlen + 1);
+	for (i = 0; i < nitems; i++) {
+		r->items[i] = items[i];
+		r->items[i].name = r->name;
+		r->flights[i] = flights[i];
+	}
+	__atomic_add_fetch(&conf->refs, 1, __ATOMIC_RELAXED);
+
+	/* signals are for the application's threads, not ours */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&tid, &attr, refresh, r);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		config_put(conf);
+		free(r);
+		__atomic_sub_fetch(&refreshing, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+/* resolves the nitems (at most two) items, which share a single name,
+ * and caches their outcomes, unless another thread of this process is
+ * resolving them already, then its outcome is used, such that a burst
+ * of lookups for a single name results in a single query.  When the
+ * servers fail, or don't answer within the stale timeout, an answer
+ * that expired no longer than the stale window ago is used instead,
+ * the lookup then finishes in the background to refresh it */
+static void lookup(dnspqconf *conf, dnspq_server **dnsservers,
+		const dnspq_opts *opts, dnsq_item *items, size_t nitems)
+{
+	dnspq_flight *flights[2];
+	dnspq_answer stale[2];
+	int havestale[2];
+	int lead[2];
+	int done[2];
+	dnsq_item own[2];
+	dnspq_flight *ownflights[2];
+	size_t owni[2];
+	size_t nown = 0;
+	size_t i;
+	struct timespec deadline;
+	struct timespec staledeadline;
+	int background = conf->img->staletimeout > 0;
+	int ret;
+
+	for (i = 0; i < nitems; i++) {
+		havestale[i] = dnspq_cache_stale(items[i].name, items[i].af,
+				&stale[i]);
+		done[i] = 0;
+		flights[i] = dnspq_flight_join(items[i].name, items[i].af, &lead[i]);
+		if (!lead[i])
+			continue;
+		if (flights[i] != NULL && cache_lookup(items[i].name, items[i].af,
+					&items[i].ans, &items[i].err))
+		{
+			/* a flight just landed before we took off */
+			dnspq_flight_done(flights[i], &items[i].ans, items[i].err);
+			done[i] = 1;
+			continue;
+		}
+		background &= havestale[i] && flights[i] != NULL;
+		own[nown] = items[i];
+		ownflights[nown] = flights[i];
+		owni[nown] = i;
+		nown++;
+	}
+
+	if (nown > 0 && background) {
+		/* wait for our own flights like the others do, such that we
+		 * can give up on them after the stale timeout */
+		for (i = 0; i < nown; i++)
+			dnspq_flight_hold(ownflights[i]);
+		ret = refresh_start(conf, dnsservers, opts, own, ownflights, nown);
+		if (ret > 0) {
+			/* skip the refresh, leaving it to a later lookup, and
+			 * land as a failure, such that the stale answers are
+			 * used */
+			for (i = 0; i < nown; i++)
+				dnspq_flight_done(ownflights[i], &stale[owni[i]], NODATA);
+		} else if (ret < 0) {
+			resolve_items(conf, dnsservers, opts, own, nown);
+			for (i = 0; i < nown; i++)
+				dnspq_flight_done(ownflights[i], &own[i].ans, own[i].err);
+		}
+	} else if (nown > 0) {
+		resolve_items(conf, dnsservers, opts, own, nown);
+		for (i = 0; i < nown; i++) {
+			items[owni[i]].err = own[i].err;
+			items[owni[i]].ans = own[i].ans;
+			dnspq_flight_done(ownflights[i], &own[i].ans, own[i].err);
+			done[owni[i]] = 1;
+		}
+	}
+
+	/* pick up what others resolve, or resolve it ourselves when they
+	 * take too long, and there's nothing to fall back on */
+	dnspq_flight_deadline(FLIGHT_WAIT, &deadline);
+	dnspq_flight_deadline(conf->img->staletimeout, &staledeadline);
+	nown = 0;
+	for (i = 0; i < nitems; i++) {
+		if (done[i])
+			continue;
+		if (dnspq_flight_wait(flights[i],
+					havestale[i] && conf->img->staletimeout > 0 ?
+					&staledeadline : &deadline,
+					&items[i].ans, &items[i].err))
+			continue;
+		items[i].err = NODATA;  /* timed out */
+		if (!havestale[i]) {
+			own[nown] = items[i];
+			owni[nown] = i;
+			nown++;
+		}
+	}
+	if (nown > 0) {
+		resolve_items(conf, dnsservers, opts, own, nown);
+		for (i = 0; i < nown; i++) {
+			items[owni[i]].err = own[i].err;
+			items[owni[i]].ans = own[i].ans;
+		}
+	}
+
+	for (i = 0; i < nitems; i++) {
+		if (havestale[i] && stale_wins(items[i].err)) {
+			items[i].ans = stale[i];
+			items[i].ans.ttl = STALE_TTL;
+			items[i].err = NOERR;
+		}
+	}
+}
+
+/* the daemon resolves with the pools and caches of the module, it
+ * keeps the config it routed a name with until that name is done */
+void *dnspq_nss_route(const char *name,
+		dnspq_server ***dnsservers, const dnspq_opts **opts)
+{
+	dnspqconf *conf;
+
+	if ((conf = config_get()) != NULL &&
+			!get_dnss_for_domain(conf, dnsservers, opts, name))
+	{
+		config_put(conf);
+		conf = NULL;
+	}
+	return conf;
+}
+
+int dnspq_nss_cached(const char *name, int af,
+		dnspq_answer *ans, char *err)
+{
+	return cache_lookup(name, af, ans, err);
+}
+
+/* caches the outcome for name, when given, and releases conf */
+void dnspq_nss_done(void *conf, const char *name, int af,
+		dnspq_answer *ans, char err)
+{
+	if (conf != NULL && name != NULL)
+		cache_store(conf, name, af, ans, err);
+	config_put(conf);
 }
 
 enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
 		struct hostent *host, char *buf, size_t buflen,
 		int *errnop, int *h_errnop, int32_t *ttlp, char **canonp)
 {
-	unsigned int ttl;
-	char sid;
-	struct sockaddr_in **dnsservers = NULL;
+	char err;
+	dnspqconf *conf = NULL;
+	dnspq_server **dnsservers = NULL;
+	const dnspq_opts *opts = NULL;
+	dnsq_item item;
+	dnspq_answer ans;
 	size_t nlen = 0;
+	size_t alen;
+	size_t pad;
+	unsigned int i;
+	char **ptrs;
+	char *addrs;
 
-	if (af == AF_INET &&
-			(nlen = strlen(name)) > 0 &&
-			buflen >= nlen + 1 + 2 * sizeof(void *) + sizeof(struct in_addr) + sizeof(void *) &&
-			get_dnss_for_domain(&dnsservers, name) &&
-			dnsq(dnsservers, name, (struct in_addr *)buf, &ttl, &sid) == 0)
+	if ((af != AF_INET && af != AF_INET6) || (nlen = strlen(name)) == 0) {
+		err = -1;
+	} else if (cache_lookup(name, af, &ans, &err)) {
+		/* served from cache */
+	} else if ((conf = config_get()) != NULL &&
+			get_dnss_for_domain(conf, &dnsservers, &opts, name))
 	{
+		item.name = name;
+		item.af = af;
+		lookup(conf, dnsservers, opts, &item, 1);
+		if ((err = item.err) == NOERR)
+			ans = item.ans;
+	} else {
+		err = -1;  /* not for us */
+	}
+	config_put(conf);
+
+	if (err == NOERR) {
+		/* buf holds: the address pointers, the (empty) alias list, the
+		 * addresses and the name, the pointers need to be aligned */
+		alen = af == AF_INET6 ?
+			sizeof(struct in6_addr) : sizeof(struct in_addr);
+		pad = -(uintptr_t)buf & (__alignof__(char *) - 1);
+		if (buflen < pad + (ans.naddrs + 2) * sizeof(char *) +
+				ans.naddrs * alen + nlen + 1)
+		{
+			/* the caller retries with a larger buffer */
+			*errnop = ERANGE;
+			*h_errnop = NETDB_INTERNAL;
+			return NSS_STATUS_TRYAGAIN;
+		}
+		ptrs = (char **)(buf + pad);
+		addrs = (char *)&ptrs[ans.naddrs + 2];
 		host->h_addrtype = af;
-		host->h_length = sizeof(struct in_addr);
-		host->h_addr_list = (char **)buf + sizeof(struct in_addr);
-		host->h_addr_list[0] = buf;
-		host->h_addr_list[1] = NULL;
-		host->h_aliases = (char **)&host->h_addr_list[2];
+		host->h_length = (int)alen;
+		host->h_addr_list = ptrs;
+		memcpy(addrs, &ans.addrs, ans.naddrs * alen);
+		for (i = 0; i < ans.naddrs; i++)
+			host->h_addr_list[i] = addrs + i * alen;
+		host->h_addr_list[i] = NULL;
+		host->h_aliases = &host->h_addr_list[i + 1];
 		host->h_aliases[0] = NULL;
-		host->h_name = (char *)&host->h_aliases[1];
+		host->h_name = addrs + ans.naddrs * alen;
 		memcpy(host->h_name, name, nlen + 1);
 		if (ttlp != NULL)
-			*ttlp = (int32_t)ttl;
+			*ttlp = (int32_t)ans.ttl;
 		if (canonp != NULL)
 			*canonp = host->h_name;
 
 		*errnop = 0;
 		*h_errnop = 0;
 		return NSS_STATUS_SUCCESS;
+	} else if (err == DNSNXDOMAIN) {
+		*errnop = ENOENT;
+		*h_errnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
+	} else if (err == DNSEMPTY) {
+		/* the name exists, but not with such records */
+		*errnop = ENOENT;
+		*h_errnop = NO_DATA;
+		return NSS_STATUS_NOTFOUND;
 	}
 
 	*errnop = EINVAL;
@@ -309,6 +929,129 @@ enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
 	return NSS_STATUS_UNAVAIL;
 }
 
+/* the getaddrinfo() entry point: resolves both IPv4 and IPv6 addresses
+ * for name, asking for both in a single round trip */
+enum nss_status _nss_dnspq_gethostbyname4_r(const char *name,
+		struct gaih_addrtuple **pat, char *buf, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp)
+{
+	static const int afs[2] = { AF_INET, AF_INET6 };
+	dnspqconf *conf;
+	dnspq_server **dnsservers = NULL;
+	const dnspq_opts *opts = NULL;
+	dnsq_item items[2];
+	dnspq_answer ans[2];
+	char err[2];
+	size_t nitems = 0;
+	size_t ntuples;
+	size_t nlen;
+	size_t pad;
+	size_t i;
+	unsigned int j;
+	int f;
+	unsigned int ttl = 0;
+	struct gaih_addrtuple *tuples;
+	struct gaih_addrtuple *t;
+	struct gaih_addrtuple **next;
+	char *hname;
+
+	if ((nlen = strlen(name)) == 0) {
+		*errnop = EINVAL;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	for (f = 0; f < 2; f++) {
+		if (!cache_lookup(name, afs[f], &ans[f], &err[f])) {
+			items[nitems].name = name;
+			items[nitems].af = afs[f];
+			nitems++;
+		}
+	}
+	if (nitems > 0) {
+		if ((conf = config_get()) == NULL ||
+				!get_dnss_for_domain(conf, &dnsservers, &opts, name))
+		{
+			/* not for us */
+			config_put(conf);
+			*errnop = EINVAL;
+			*h_errnop = NO_RECOVERY;
+			return NSS_STATUS_UNAVAIL;
+		}
+		lookup(conf, dnsservers, opts, items, nitems);
+		for (i = 0; i < nitems; i++) {
+			f = items[i].af == AF_INET6;
+			err[f] = items[i].err;
+			if (err[f] == NOERR)
+				ans[f] = items[i].ans;
+		}
+		config_put(conf);
+	}
+
+	if (err[0] != NOERR && err[1] != NOERR) {
+		if (err[0] == DNSNXDOMAIN || err[1] == DNSNXDOMAIN) {
+			*errnop = ENOENT;
+			*h_errnop = HOST_NOT_FOUND;
+			return NSS_STATUS_NOTFOUND;
+		}
+		if (err[0] == DNSEMPTY && err[1] == DNSEMPTY) {
+			*errnop = ENOENT;
+			*h_errnop = NO_DATA;
+			return NSS_STATUS_NOTFOUND;
+		}
+		*errnop = EINVAL;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	/* buf holds the tuples followed by the name they share, the caller
+	 * may have supplied the first tuple */
+	ntuples = 0;
+	for (f = 0; f < 2; f++)
+		if (err[f] == NOERR)
+			ntuples += ans[f].naddrs;
+	pad = -(uintptr_t)buf & (__alignof__(struct gaih_addrtuple) - 1);
+	if (buflen < pad + ntuples * sizeof(struct gaih_addrtuple) + nlen + 1) {
+		*errnop = ERANGE;
+		*h_errnop = NETDB_INTERNAL;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	tuples = (struct gaih_addrtuple *)(buf + pad);
+	hname = (char *)&tuples[ntuples];
+	memcpy(hname, name, nlen + 1);
+
+	next = pat;
+	for (f = 0; f < 2; f++) {
+		if (err[f] != NOERR)
+			continue;
+		if (ttl == 0 || ans[f].ttl < ttl)
+			ttl = ans[f].ttl;
+		for (j = 0; j < ans[f].naddrs; j++) {
+			if (*next == NULL)
+				*next = tuples;
+			t = *next;
+			tuples++;
+			t->next = NULL;
+			t->name = hname;
+			t->family = afs[f];
+			t->scopeid = 0;
+			memset(t->addr, 0, sizeof(t->addr));
+			if (afs[f] == AF_INET6) {
+				memcpy(t->addr, &ans[f].addrs.v6[j], sizeof(struct in6_addr));
+			} else {
+				memcpy(t->addr, &ans[f].addrs.v4[j], sizeof(struct in_addr));
+			}
+			next = &t->next;
+		}
+	}
+	if (ttlp != NULL)
+		*ttlp = (int32_t)ttl;
+
+	*errnop = 0;
+	*h_errnop = 0;
+	return NSS_STATUS_SUCCESS;
+}
+
 enum nss_status _nss_dnspq_gethostbyname2_r(const char *name, int af,
 		struct hostent *host, char *buffer, size_t buflen,
 		int *errnop, int *h_errnop)
@@ -329,14 +1072,76 @@ enum nss_status _nss_dnspq_gethostbyaddr2_r(const void* addr, socklen_t len,
 		int af, struct hostent *host, char *buffer, size_t buflen,
 		int *errnop, int *h_errnop, int32_t *ttlp)
 {
-	/* pacify compiler */
-	(void) addr;
-	(void) len;
-	(void) af;
-	(void) host;
-	(void) buffer;
-	(void) buflen;
-	(void) ttlp;
+	char arpa[80];
+	char err;
+	dnspqconf *conf = NULL;
+	dnspq_server **dnsservers = NULL;
+	const dnspq_opts *opts = NULL;
+	dnsq_item item;
+	dnspq_answer ans;
+	size_t nlen;
+	size_t pad;
+	char **ptrs;
+
+	if ((af == AF_INET && len != sizeof(struct in_addr)) ||
+			(af == AF_INET6 && len != sizeof(struct in6_addr)) ||
+			dnspq_arpa(af, addr, arpa, sizeof(arpa)) != 0)
+	{
+		err = -1;
+	} else if (cache_lookup(arpa, AF_UNSPEC, &ans, &err)) {
+		/* served from cache */
+	} else if ((conf = config_get()) != NULL &&
+			get_dnss_for_domain(conf, &dnsservers, &opts, arpa))
+	{
+		/* pools for reverse lookups are found by their arpa suffix,
+		 * e.g. .10.in-addr.arpa */
+		item.name = arpa;
+		item.af = AF_UNSPEC;
+		lookup(conf, dnsservers, opts, &item, 1);
+		if ((err = item.err) == NOERR)
+			ans = item.ans;
+	} else {
+		err = -1;  /* not for us */
+	}
+	config_put(conf);
+
+	if (err == NOERR) {
+		/* buffer holds: the address pointers, the (empty) alias list,
+		 * the address and the name */
+		nlen = strlen(ans.addrs.ptr);
+		pad = -(uintptr_t)buffer & (__alignof__(char *) - 1);
+		if (buflen < pad + 3 * sizeof(char *) + len + nlen + 1) {
+			*errnop = ERANGE;
+			*h_errnop = NETDB_INTERNAL;
+			return NSS_STATUS_TRYAGAIN;
+		}
+		ptrs = (char **)(buffer + pad);
+		host->h_addrtype = af;
+		host->h_length = (int)len;
+		host->h_addr_list = ptrs;
+		host->h_addr_list[0] = (char *)&ptrs[3];
+		memcpy(host->h_addr_list[0], addr, len);
+		host->h_addr_list[1] = NULL;
+		host->h_aliases = &ptrs[2];
+		host->h_aliases[0] = NULL;
+		host->h_name = host->h_addr_list[0] + len;
+		memcpy(host->h_name, ans.addrs.ptr, nlen + 1);
+		if (ttlp != NULL)
+			*ttlp = (int32_t)ans.ttl;
+
+		*errnop = 0;
+		*h_errnop = 0;
+		return NSS_STATUS_SUCCESS;
+	} else if (err == DNSNXDOMAIN) {
+		*errnop = ENOENT;
+		*h_errnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
+	} else if (err == DNSEMPTY) {
+		/* the name exists, but not with such records */
+		*errnop = ENOENT;
+		*h_errnop = NO_DATA;
+		return NSS_STATUS_NOTFOUND;
+	}
 
 	*errnop = EINVAL;
 	*h_errnop = NO_RECOVERY;
@@ -347,16 +1152,97 @@ enum nss_status _nss_dnspq_gethostbyaddr_r(const void* addr, socklen_t len,
 		int af, struct hostent *host, char *buffer, size_t buflen,
 		int *errnop, int *h_errnop)
 {
-	/* pacify compiler */
-	(void) addr;
-	(void) len;
-	(void) af;
-	(void) host;
-	(void) buffer;
-	(void) buflen;
+	return _nss_dnspq_gethostbyaddr2_r(addr, len, af, host, buffer, buflen,
+			errnop, h_errnop, NULL);
+}
 
-	*errnop = EINVAL;
-	*h_errnop = NO_RECOVERY;
-	return NSS_STATUS_UNAVAIL;
+#ifdef POOLBENCH
+#include <time.h>
+
+static inline double bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
 }
 
+/* compares finding pools through the index with walking the list, for
+ * a config with the given number of pools of two members each, and
+ * lookups of which one in ten doesn't match any pool */
+int main(int argc, char *argv[]) {
+	char path[] = "/tmp/poolbench.XXXXXX";
+	size_t npools = argc > 1 ? (size_t)atol(argv[1]) : 100;
+	size_t nlookups = 1000000;
+	size_t nnames = 1024;
+	char (*names)[64];
+	dnspq_server **sw;
+	dnspq_server **si;
+	const dnspq_opts *opts;
+	size_t matched = 0;
+	size_t i;
+	double start;
+	double walk;
+	double idx;
+	FILE *f;
+	int fd;
+	dnspq_image *img;
+	dnspqconf *conf;
+
+	if (npools == 0 || (fd = mkstemp(path)) == -1 ||
+			(f = fdopen(fd, "w")) == NULL)
+		return 1;
+	for (i = 0; i < npools; i++) {
+		fprintf(f, ".pool%zd.example 10.%zd.%zd.1:5301 10.%zd.%zd.2:5301\n",
+				i, i / 256 % 256, i % 256, i / 256 % 256, i % 256);
+		fprintf(f, ".pool%zd.example 10.%zd.%zd.1:5302 10.%zd.%zd.2:5302\n",
+				i, i / 256 % 256, i % 256, i / 256 % 256, i % 256);
+	}
+	fclose(f);
+	f = fopen(path, "r");
+	img = f != NULL ? dnspq_image_read(f) : NULL;
+	if (f != NULL)
+		fclose(f);
+	unlink(path);
+	if (img == NULL || (conf = attachimage(img, 0)) == NULL)
+		return 1;
+
+	names = malloc(nnames * sizeof(*names));
+	for (i = 0; i < nnames; i++) {
+		if (i % 10 == 9) {
+			snprintf(names[i], sizeof(names[i]), "host%zd.elsewhere.example", i);
+		} else {
+			snprintf(names[i], sizeof(names[i]), "host%zd.sub.pool%zd.example",
+					i, (size_t)rand() % npools);
+		}
+		/* both must agree, modulo the member picked */
+		sw = si = NULL;
+		if (get_dnss_for_domain_walk(conf, &sw, &opts, names[i]) !=
+				get_dnss_for_domain(conf, &si, &opts, names[i]) ||
+				(sw != NULL && memcmp(&sw[0]->addr.sin.sin_addr,
+					&si[0]->addr.sin.sin_addr, sizeof(struct in_addr)) != 0))
+		{
+			fprintf(stderr, "mismatch for %s\n", names[i]);
+			return 1;
+		}
+	}
+
+	start = bench_now();
+	for (i = 0; i < nlookups; i++)
+		matched += get_dnss_for_domain_walk(conf, &sw, &opts,
+				names[i % nnames]);
+	walk = (bench_now() - start) / nlookups;
+
+	start = bench_now();
+	for (i = 0; i < nlookups; i++)
+		matched += get_dnss_for_domain(conf, &si, &opts,
+				names[i % nnames]);
+	idx = (bench_now() - start) / nlookups;
+
+	printf("%zd pools, %zd lookups (%zd matched)\n",
+			npools, nlookups, matched / 2);
+	printf("list walk: %8.1f ns/lookup\n", walk);
+	printf("index:     %8.1f ns/lookup\n", idx);
+
+	return 0;
+}
+#endif
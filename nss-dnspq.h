@@ -16,6 +16,9 @@
  */
 
 
+enum nss_status _nss_dnspq_gethostbyname4_r(const char *name,
+		struct gaih_addrtuple **pat, char *buf, size_t buflen,
+		int *errnop, int *h_errnop, int32_t *ttlp);
 enum nss_status _nss_dnspq_gethostbyname3_r(const char *name, int af,
 		struct hostent *host, char *buf, size_t buflen,
 		int *errnop, int *h_errnop, int32_t *ttlp, char **canonp);
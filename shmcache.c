@@ -0,0 +1,292 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* cross-process answer cache
+ *
+ * A fixed size table of slots in a file mapped by all processes using
+ * the library, typically living on /dev/shm.  Each slot is guarded by
+ * a sequence counter (seqlock): readers never write to the mapping,
+ * they copy the slot and retry when the counter changed underneath.
+ * Writers claim a slot by making its counter odd, and simply skip
+ * caching when another writer holds it, this cache is best effort.  A
+ * writer that died halfway leaves its slot odd, which is taken over
+ * once it stayed that way for SHMCACHE_STUCK seconds, until then
+ * readers treat it as empty.
+ *
+ * As root processes use the answers too, the file is only used when
+ * it is a regular file owned by us or root, that only its owner can
+ * write to. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "shmcache.h"
+
+#ifndef SHMCACHE_SLOTS
+# define SHMCACHE_SLOTS  4096
+#endif
+#define SHMCACHE_PROBE    4  /* slots to consider for a name */
+#define SHMCACHE_NAMELEN  256
+#define SHMCACHE_MAGIC    0x64707163  /* "dpqc" */
+#define SHMCACHE_VERSION  4
+#define SHMCACHE_STUCK    2  /* seconds a writer may hold a slot */
+
+typedef struct {
+	uint64_t seq;  /* odd while being written, the upper half holds
+	                * the time the last writer claimed the slot */
+	uint32_t hash;  /* 0 means unused slot */
+	int64_t expires;
+	dnspq_answer ans;  /* ttl unused, see expires */
+	char err;  /* 0 for answers, dnspq_errno for failed lookups */
+	char name[SHMCACHE_NAMELEN];
+} shmslot;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t slotsize;
+	shmslot slots[];
+} shmheader;
+
+static char *shmpath = NULL;
+static shmheader *shm = NULL;
+static int shmwritable = 0;
+static pthread_once_t shmonce = PTHREAD_ONCE_INIT;
+
+static inline int64_t
+shmcache_now(void)
+{
+	struct timespec ts;
+
+	/* the monotonic clock is shared by all processes on the host, and
+	 * /dev/shm doesn't survive the reboot that resets it */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int64_t)ts.tv_sec;
+}
+
+static inline uint32_t
+shmcache_hash(const char *name, int af)
+{
+	uint32_t h = (2166136261U ^ (unsigned char)af) * 16777619U;
+
+	for (; *name != '\0'; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	return h == 0 ? 1 : h;
+}
+
+/* maps the segment, creating it when we're the first */
+static void
+shmcache_open(void)
+{
+	int fd;
+	struct stat st;
+	size_t len = sizeof(shmheader) + SHMCACHE_SLOTS * sizeof(shmslot);
+	shmheader *h;
+
+	if ((fd = open(shmpath,
+					O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644)) != -1)
+	{
+		shmwritable = 1;
+	} else if ((fd = open(shmpath,
+					O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+	{
+		return;
+	}
+	/* someone else's file could feed us answers, or be truncated to
+	 * crash us with SIGBUS */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+			(st.st_uid != geteuid() && st.st_uid != 0) ||
+			(st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+			(st.st_size == 0 && (!shmwritable || st.st_uid != geteuid() ||
+				ftruncate(fd, len) != 0)) ||
+			(st.st_size != 0 && (size_t)st.st_size != len))
+	{
+		close(fd);
+		return;
+	}
+	h = mmap(NULL, len, PROT_READ | (shmwritable ? PROT_WRITE : 0),
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+		return;
+
+	if (h->magic == 0 && shmwritable) {
+		/* fresh segment, racing creators all write the same */
+		h->version = SHMCACHE_VERSION;
+		h->nslots = SHMCACHE_SLOTS;
+		h->slotsize = sizeof(shmslot);
+		__atomic_store_n(&h->magic, SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHMCACHE_MAGIC ||
+			h->version != SHMCACHE_VERSION ||
+			h->nslots != SHMCACHE_SLOTS ||
+			h->slotsize != sizeof(shmslot))
+	{
+		munmap(h, len);
+		return;
+	}
+	shm = h;
+}
+
+static inline shmheader *
+shmcache_get_segment(void)
+{
+	if (shmpath == NULL)
+		return NULL;
+	pthread_once(&shmonce, shmcache_open);
+	return shm;
+}
+
+/* enables the cache backed by the file at path, the segment is only
+ * mapped upon first use */
+void
+dnspq_shmcache_init(const char *path)
+{
+	if (path != NULL && *path != '\0')
+		shmpath = strdup(path);
+}
+
+int
+dnspq_shmcache_get(
+		const char *name,
+		int af,
+		dnspq_answer *ret,
+		char *err)
+{
+	shmheader *h;
+	shmslot *s;
+	uint32_t hash;
+	uint64_t seq;
+	int64_t expires;
+	int64_t now;
+	dnspq_answer ans;
+	char serr;
+	int found;
+	int i;
+
+	if ((h = shmcache_get_segment()) == NULL)
+		return 0;
+
+	hash = shmcache_hash(name, af);
+	now = shmcache_now();
+	for (i = 0; i < SHMCACHE_PROBE; i++) {
+		s = &h->slots[(hash + i) % SHMCACHE_SLOTS];
+		if (__atomic_load_n(&s->hash, __ATOMIC_RELAXED) != hash)
+			continue;
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			return 0;  /* being written, or stuck, don't wait for it */
+		expires = s->expires;
+		ans.af = af;
+		ans.naddrs = s->ans.naddrs;
+		if (ans.naddrs > DNSPQ_MAXADDRS)
+			ans.naddrs = 0;  /* torn, caught by the seq check below */
+		memcpy(&ans.addrs, &s->ans.addrs, DNSPQ_ADDRS_LEN(&ans));
+		serr = s->err;
+		found = s->ans.af == af &&
+			strncmp(s->name, name, SHMCACHE_NAMELEN) == 0;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq ||
+				s->hash != hash)
+			return 0;  /* changed while we were reading */
+		if (!found)
+			continue;
+		if (expires <= now)
+			return 0;
+		ret->af = af;
+		if ((*err = serr) == 0) {
+			ret->naddrs = ans.naddrs;
+			memcpy(&ret->addrs, &ans.addrs, DNSPQ_ADDRS_LEN(&ans));
+		}
+		ret->ttl = (unsigned int)(expires - now);
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+dnspq_shmcache_put(
+		const char *name,
+		const dnspq_answer *ans,
+		char err)
+{
+	shmheader *h;
+	shmslot *s;
+	shmslot *victim = NULL;
+	uint32_t hash;
+	uint32_t cnt;
+	uint64_t seq;
+	uint64_t claim;
+	int64_t now;
+	size_t nlen;
+	int i;
+
+	if (ans->ttl == 0 || (nlen = strlen(name)) >= SHMCACHE_NAMELEN ||
+			(h = shmcache_get_segment()) == NULL || !shmwritable)
+		return;
+
+	hash = shmcache_hash(name, ans->af);
+	now = shmcache_now();
+	/* prefer the slot holding this name, else the one expiring first */
+	for (i = 0; i < SHMCACHE_PROBE; i++) {
+		s = &h->slots[(hash + i) % SHMCACHE_SLOTS];
+		if (s->hash == hash && s->ans.af == ans->af &&
+				strncmp(s->name, name, nlen + 1) == 0)
+		{
+			victim = s;
+			break;
+		}
+		if (victim == NULL || s->expires < victim->expires)
+			victim = s;
+	}
+	s = victim;
+
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) && now - (int64_t)(seq >> 32) < SHMCACHE_STUCK)
+		return;  /* someone else is writing this slot */
+	/* claim it, or take it over from a writer that died halfway,
+	 * keeping the counter odd either way */
+	cnt = (uint32_t)seq + ((seq & 1) ? 2 : 1);
+	claim = (uint64_t)now << 32 | cnt;
+	if (!__atomic_compare_exchange_n(&s->seq, &seq, claim,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&s->hash, hash, __ATOMIC_RELAXED);
+	s->expires = now + ans->ttl;
+	s->ans.af = ans->af;
+	if ((s->err = err) == 0) {
+		s->ans.naddrs = ans->naddrs;
+		memcpy(&s->ans.addrs, &ans->addrs, DNSPQ_ADDRS_LEN(ans));
+	}
+	memcpy(s->name, name, nlen + 1);
+	/* unless we took that long that someone took over */
+	__atomic_compare_exchange_n(&s->seq, &claim, claim + 1,
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
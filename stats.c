@@ -0,0 +1,194 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* per-server statistics
+ *
+ * A fixed size table of counters in a file mapped by all processes
+ * using the library, typically living on /dev/shm, such that `dnspq -S`
+ * can show how the servers are doing.  A server's slot is claimed once,
+ * by whoever uses it first, after that the counters are only ever
+ * added to, with relaxed atomics, as exact totals across them don't
+ * matter.  Like the shm cache, the file is only used when it is a
+ * regular file owned by us or root, that only its owner can write to. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "dnspq.h"
+#include "stats.h"
+
+#ifndef STATS_SLOTS
+# define STATS_SLOTS  256
+#endif
+#define STATS_MAGIC    0x64707173  /* "dpqs" */
+#define STATS_VERSION  1
+#define STATS_SPINS    1000  /* times to wait for a slot being claimed */
+
+#define STATS_FREE     0
+#define STATS_CLAIMED  1
+#define STATS_USED     2
+
+static dnspq_stats_segment *stats = NULL;
+
+#define STATS_LEN  (sizeof(dnspq_stats_segment) + \
+		STATS_SLOTS * sizeof(dnspq_stats))
+
+/* the key of a slot: family, port and address only, such that padding
+ * and scope don't matter */
+static void
+stats_key(const dnspq_sockaddr *addr, dnspq_sockaddr *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->sa.sa_family = addr->sa.sa_family;
+	if (addr->sa.sa_family == AF_INET6) {
+		key->sin6.sin6_port = addr->sin6.sin6_port;
+		key->sin6.sin6_addr = addr->sin6.sin6_addr;
+	} else {
+		key->sin.sin_port = addr->sin.sin_port;
+		key->sin.sin_addr = addr->sin.sin_addr;
+	}
+}
+
+static uint32_t
+stats_hash(const dnspq_sockaddr *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(*key); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+/* maps the segment at path, read-only, or read-write creating it when
+ * we're the first, returns NULL when it isn't usable */
+static dnspq_stats_segment *
+stats_open(const char *path, int writable)
+{
+	int fd;
+	struct stat st;
+	dnspq_stats_segment *h;
+
+	if (writable) {
+		fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+	} else {
+		fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	if (fd == -1)
+		return NULL;
+	/* someone else's file could be truncated to crash us with SIGBUS,
+	 * or have its counters messed with */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+			(st.st_uid != geteuid() && st.st_uid != 0) ||
+			(st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+			(st.st_size == 0 && (!writable || st.st_uid != geteuid() ||
+				ftruncate(fd, STATS_LEN) != 0)) ||
+			(st.st_size != 0 && (size_t)st.st_size != STATS_LEN))
+	{
+		close(fd);
+		return NULL;
+	}
+	h = mmap(NULL, STATS_LEN, PROT_READ | (writable ? PROT_WRITE : 0),
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+		return NULL;
+
+	if (h->magic == 0 && writable) {
+		/* fresh segment, racing creators all write the same */
+		h->version = STATS_VERSION;
+		h->nslots = STATS_SLOTS;
+		h->slotsize = sizeof(dnspq_stats);
+		__atomic_store_n(&h->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+			h->version != STATS_VERSION ||
+			h->nslots != STATS_SLOTS ||
+			h->slotsize != sizeof(dnspq_stats))
+	{
+		munmap(h, STATS_LEN);
+		return NULL;
+	}
+	return h;
+}
+
+/* enables the statistics kept in the file at path */
+void
+dnspq_stats_init(const char *path)
+{
+	if (stats == NULL && path != NULL && *path != '\0')
+		stats = stats_open(path, 1);
+}
+
+/* returns the counters of the server at addr, claiming a slot for it
+ * when it has none yet, or NULL when statistics aren't kept, or the
+ * table is full */
+dnspq_stats *
+dnspq_stats_server(const dnspq_sockaddr *addr)
+{
+	dnspq_sockaddr key;
+	dnspq_stats *s;
+	uint32_t h;
+	uint32_t state;
+	size_t i;
+	int spins;
+
+	if (stats == NULL)
+		return NULL;
+
+	stats_key(addr, &key);
+	h = stats_hash(&key);
+	for (i = 0; i < STATS_SLOTS; i++) {
+		s = &stats->slots[(h + i) % STATS_SLOTS];
+		state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+		if (state == STATS_FREE &&
+				__atomic_compare_exchange_n(&s->state, &state, STATS_CLAIMED,
+					0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			s->addr = key;
+			__atomic_store_n(&s->state, STATS_USED, __ATOMIC_RELEASE);
+			return s;
+		}
+		/* someone else is claiming it, possibly for this server too */
+		for (spins = 0; state == STATS_CLAIMED && spins < STATS_SPINS;
+				spins++)
+		{
+			sched_yield();
+			state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+		}
+		if (state == STATS_USED && memcmp(&s->addr, &key, sizeof(key)) == 0)
+			return s;
+	}
+
+	return NULL;
+}
+
+/* maps the segment at path for reading, as done by `dnspq -S` */
+const dnspq_stats_segment *
+dnspq_stats_map(const char *path)
+{
+	return stats_open(path, 0);
+}
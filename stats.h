@@ -0,0 +1,64 @@
+/*
+ *  This file is part of dnspq.
+ *
+ *  dnspq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  dnspq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with dnspq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSPQ_STATS_PATH
+#define DNSPQ_STATS_PATH "/dev/shm/dnspq-stats"
+#endif
+
+#define DNSPQ_STATS_ERRORS   (DNSNOIN + 1)
+#define DNSPQ_STATS_BUCKETS  24  /* round trip times up to 2^24 usec */
+
+/* the counters of a single server, shared by all processes using it,
+ * and updated without any locking */
+struct _dnspq_stats {
+	uint32_t state;  /* 0 unused, 1 being claimed, 2 in use */
+	uint32_t pad;
+	dnspq_sockaddr addr;
+	uint64_t sent;  /* queries */
+	uint64_t wins;  /* answers used, the first good one for a query */
+	uint64_t errors[DNSPQ_STATS_ERRORS];  /* replies by outcome, NODATA
+	                                       * counts those that never came */
+	uint64_t rtt[DNSPQ_STATS_BUCKETS];  /* bucket b: < 2^(b+1) usec */
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t slotsize;
+	dnspq_stats slots[];
+} dnspq_stats_segment;
+
+#define DNSPQ_STATS_COUNT(S, F) \
+	do { \
+		if ((S)->stats != NULL) \
+			__atomic_fetch_add(&(S)->stats->F, 1, __ATOMIC_RELAXED); \
+	} while (0)
+
+static inline void
+dnspq_stats_rtt(dnspq_stats *s, int64_t usec)
+{
+	int b = usec < 2 ? 0 : 63 - __builtin_clzll((unsigned long long)usec);
+
+	if (b >= DNSPQ_STATS_BUCKETS)
+		b = DNSPQ_STATS_BUCKETS - 1;
+	__atomic_fetch_add(&s->rtt[b], 1, __ATOMIC_RELAXED);
+}
+
+void dnspq_stats_init(const char *path);
+dnspq_stats *dnspq_stats_server(const dnspq_sockaddr *addr);
+const dnspq_stats_segment *dnspq_stats_map(const char *path);